@@ -5,18 +5,98 @@
 #include <boost/filesystem/path.hpp>
 #include <iostream>
 #include <fstream>
+#include <functional>
 #include <istream>
 #include <ostream>
+#include <set>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 #include <boost/filesystem.hpp>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "archive_parser.hpp"
+#include "archive_reader.hpp"
+#include "parallel_ingest.hpp"
+#include "work_stealing_pool.hpp"
 
 namespace fs = boost::filesystem;
 
+enum class ZipInput
+{
+    file,
+    stream,
+    folder
+};
+
+using ZipInputHandler = std::function<void(ZipInput, const fs::path&)>;
+
+// With sorted the children of a directory come in name order, so the same
+// tree is always walked the same way.
+static void walk_zip_directory (const fs::path &dir, bool sorted, const ZipInputHandler &add)
+{
+    if(!sorted)
+    {
+        for(fs::directory_entry& file : fs::recursive_directory_iterator(dir))
+        {
+            fs::path file_path = file.path();
+            if(fs::is_regular_file(file_path))
+            {
+                add(ZipInput::file, file_path);
+            }
+            else if(fs::is_empty(file_path))
+            {
+                add(ZipInput::folder, file_path);
+            }
+        }
+        return;
+    }
+    std::vector<fs::path> children{fs::directory_iterator(dir), fs::directory_iterator()};
+    std::sort(children.begin(), children.end());
+    for(const fs::path &file_path : children)
+    {
+        if(fs::is_regular_file(file_path))
+        {
+            add(ZipInput::file, file_path);
+        }
+        else if(fs::is_empty(file_path))
+        {
+            add(ZipInput::folder, file_path);
+        }
+        else if(fs::is_directory(fs::symlink_status(file_path)))
+        {
+            walk_zip_directory(file_path, sorted, add);
+        }
+    }
+}
+
+static void walk_zip_input (const fs::path &entry, bool sorted, const ZipInputHandler &add)
+{
+    if(fs::is_regular_file(entry))
+    {
+        add(ZipInput::file, entry);
+    }
+    else if(fs::status(entry).type() == fs::fifo_file || fs::status(entry).type() == fs::character_file)
+    {
+        add(ZipInput::stream, entry);
+    }
+    if(fs::is_directory(entry))
+    {
+        if(fs::is_empty(entry))
+        {
+            add(ZipInput::folder, entry);
+        }
+        else
+        {
+            walk_zip_directory(entry, sorted, add);
+        }
+    }
+}
+
 static void parse_command_zip (std::istream &ins, std::ostream &outs, std::ostream &errs)
 {
     (void) outs;
@@ -32,47 +112,95 @@ static void parse_command_zip (std::istream &ins, std::ostream &outs, std::ostre
     std::getline(ins, other_args_str, '\n');
     std::istringstream other_args(other_args_str);
 
+    // -j N: compress with N threads, 0 for one per hardware thread
+    // --deterministic: the same input always gives the same archive
+    unsigned jobs = 1;
+    bool deterministic = false;
+    std::vector<fs::path> entries;
     std::string entry_str;
+    while(other_args >> entry_str)
+    {
+        if(entry_str == "-j")
+        {
+            if(!(other_args >> jobs))
+            {
+                throw std::runtime_error("-j needs a number of threads");
+            }
+            continue;
+        }
+        if(entry_str == "--deterministic")
+        {
+            deterministic = true;
+            continue;
+        }
+        entries.push_back(fs::path(entry_str).lexically_normal());
+    }
+
     try {
         ArchiveParser arch = ArchiveParser::MakeArchive(archive_path.c_str());
         // NOTE!!!: това задава каква да е компресията и какъв алгоритъм да е. Не съм го извел навън през командния ред
-        arch.setDefaultCompressionStrategy(ArchiveParser::CompressionStrategy("LZW", 3));
-        while(other_args >> entry_str)
+        arch.setDefaultCompressionStrategy(ArchiveParser::CompressionStrategy("AUTO", 3 | ArchiveParser::CompressionStrategy::LZW_VARIABLE_WIDTH));
+        // pipes are kept in memory up to 16 MiB and in a temporary file after that
+        ArchiveParser::SpillPolicy spill;
+        spill.maxSize = 4ULL * 1024 * 1024 * 1024;
+        arch.setSpillPolicy(spill);
+        // the entries are linked once at the end
+        arch.beginBatch();
+        if(jobs == 1)
         {
-            fs::path entry(entry_str);
-            entry = entry.lexically_normal();
-            if(fs::is_regular_file(entry))
-            {
-                std::fstream file(entry.native().c_str(), std::fstream::in);
-                file.exceptions(std::fstream::badbit | std::fstream::failbit);
-                arch.addFile(entry.generic_string().c_str(), file);
-            }
-            if(fs::is_directory(entry))
+            ZipInputHandler add = [&arch](ZipInput kind, const fs::path &path)
             {
-                if(fs::is_empty(entry))
+                switch(kind)
                 {
-                    arch.addFolder(entry.generic_string().c_str());
-                }
-                else
-                {
-                    for(fs::directory_entry& file : fs::recursive_directory_iterator(entry))
+                case ZipInput::file:
+                    arch.addFileFromPath(path.generic_string().c_str(), path.native().c_str());
+                    break;
+                case ZipInput::stream:
                     {
-                        fs::path file_path = file.path();
-                        if(fs::is_regular_file(file_path))
-                        {
-                            std::fstream new_file(file_path.native().c_str(), std::fstream::in | std::fstream::binary);
-                            new_file.exceptions(std::fstream::badbit | std::fstream::failbit);
-                            arch.addFile(file_path.generic_string().c_str(), new_file);
-                        }
-                        else if(fs::is_empty(file_path))
-                        {
-                            arch.addFolder(file_path.generic_string().c_str());
-                        }
+                        std::fstream file(path.native().c_str(), std::fstream::in | std::fstream::binary);
+                        file.exceptions(std::fstream::badbit);
+                        arch.addFileStream(path.generic_string().c_str(), file);
                     }
+                    break;
+                case ZipInput::folder:
+                    arch.addFolder(path.generic_string().c_str());
+                    break;
                 }
+            };
+            for(const fs::path &entry : entries)
+            {
+                walk_zip_input(entry, deterministic, add);
             }
-
         }
+        else
+        {
+            // this thread walks the input while the pool compresses it
+            ParallelIngest::Options options;
+            options.threads = jobs;
+            options.deterministic = deterministic;
+            ParallelIngest ingest(arch, options);
+            ZipInputHandler add = [&ingest](ZipInput kind, const fs::path &path)
+            {
+                switch(kind)
+                {
+                case ZipInput::file:
+                    ingest.addFile(path.generic_string().c_str(), path.native().c_str());
+                    break;
+                case ZipInput::stream:
+                    ingest.addStream(path.generic_string().c_str(), path.native().c_str());
+                    break;
+                case ZipInput::folder:
+                    ingest.addFolder(path.generic_string().c_str());
+                    break;
+                }
+            };
+            for(const fs::path &entry : entries)
+            {
+                walk_zip_input(entry, deterministic, add);
+            }
+            ingest.finish();
+        }
+        arch.commit();
     } catch (...)
     {
         fs::remove(archive_path);
@@ -95,6 +223,9 @@ static void parse_command_info (std::istream &ins, std::ostream &outs, std::ostr
              << " ComprAlg: " << file.getCompressionStrg().getAlgStr() << "-" 
              << static_cast<short>(file.getCompressionStrg().getAlgOptionsVal()) <<'\n';
     }
+    ArchiveParser::ArchiveStats stats = arch.getStats();
+    outs << "Archive size: " << stats.logicalSize << "\tOn disk: " << stats.physicalSize
+         << "\tFree: " << stats.freeBytes << " in " << stats.holes << " holes\n";
 }
 
 static bool path_is_base_of (const fs::path &fromp, const fs::path &ofp)
@@ -113,6 +244,28 @@ static bool path_is_base_of (const fs::path &fromp, const fs::path &ofp)
     return from_it == fromp.end();
 }
 
+// stored files are copied by the kernel, see ArchiveReader::Entry::readFile
+static void extract_file (const ArchiveReader::Entry &file, const fs::path &path)
+{
+    int fd = ::open(path.native().c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666); // NOLINT
+    if(fd < 0)
+    {
+        throw std::runtime_error("Can not create " + path.string());
+    }
+    try
+    {
+        file.readFile(fd);
+    } catch(...)
+    {
+        ::close(fd);
+        throw;
+    }
+    if(::close(fd) != 0)
+    {
+        throw std::runtime_error("Can not write " + path.string());
+    }
+}
+
 static void parse_command_unzip (std::istream &ins, std::ostream &outs, std::ostream &errs)
 {
     (void) outs;
@@ -131,71 +284,96 @@ static void parse_command_unzip (std::istream &ins, std::ostream &outs, std::ost
     std::getline(ins, other_args_str, '\n');
     std::istringstream other_args(other_args_str);
 
-
+    // -j N: extract with N threads, 0 for one per hardware thread
+    unsigned jobs = 1;
+    std::vector<fs::path> entries;
     std::string entry_str;
-    ArchiveParser arch(archive_path.c_str());
-    std::size_t args = 0;
     while(other_args >> entry_str)
     {
-        ++args;
-        fs::path entry(entry_str);
-        for(const ArchiveParser::value_type &file : arch)
+        if(entry_str == "-j")
         {
-            if(path_is_base_of(entry, file.getFileName()))
+            if(!(other_args >> jobs))
             {
-                fs::path cur_path(dest_path);
-                cur_path /= file.getFileName();
-                if(fs::exists(cur_path))
-                {
-                    errs << "File " << cur_path.c_str() << " already exists!\n";
-                    continue;
-                }
-                if(file.getFileType() == ArchiveParser::fileType::folder)
-                {
-                    fs::create_directories(cur_path);
-                }
-                else
-                {
-                    fs::path parentPath = cur_path.parent_path();
-                    if(!parentPath.empty())
-                    {
-                        fs::create_directories(parentPath);
-                    }
-                    std::fstream new_file(cur_path.native().c_str(), std::fstream::out | std::fstream::trunc | std::fstream::binary);
-                    new_file.exceptions(std::fstream::badbit | std::fstream::failbit);
-                    file.readFile(new_file);
-                }
+                throw std::runtime_error("-j needs a number of threads");
             }
+            continue;
         }
+        entries.emplace_back(entry_str);
     }
-    if(args == 0)
+
+    ArchiveReader arch(archive_path.c_str());
+    struct Extraction
+    {
+        std::size_t index;
+        fs::path path;
+        std::uint64_t size;
+    };
+    std::vector<Extraction> files;
+    std::set<fs::path> dirs;
+    for(std::size_t i=0; i<arch.size(); i++)
     {
-        for(const ArchiveParser::value_type &file : arch)
+        ArchiveReader::Entry file = arch[i];
+        bool selected = entries.empty() || std::any_of(entries.begin(), entries.end(), [&file](const fs::path &entry)
         {
-            fs::path cur_path(dest_path);
-            cur_path /= file.getFileName();
-            if(fs::exists(cur_path))
-            {
-                errs << "File " << cur_path.c_str() << " already exists!\n";
-                continue;
-            }
-            if(file.getFileType() == ArchiveParser::fileType::folder)
-            {
-                fs::create_directories(cur_path);
-            }
-            else
+            return path_is_base_of(entry, file.getFileName());
+        });
+        if(!selected)
+        {
+            continue;
+        }
+        fs::path cur_path(dest_path);
+        cur_path /= file.getFileName();
+        if(fs::exists(cur_path))
+        {
+            errs << "File " << cur_path.c_str() << " already exists!\n";
+            continue;
+        }
+        if(file.getFileType() == ArchiveParser::fileType::folder)
+        {
+            dirs.insert(cur_path);
+        }
+        else
+        {
+            fs::path parentPath = cur_path.parent_path();
+            if(!parentPath.empty())
             {
-                fs::path parentPath = cur_path.parent_path();
-                if(!parentPath.empty())
-                {
-                    fs::create_directories(parentPath);
-                }
-                std::fstream new_file(cur_path.native().c_str(), std::fstream::out | std::fstream::trunc | std::fstream::binary);
-                new_file.exceptions(std::fstream::badbit | std::fstream::failbit);
-                file.readFile(new_file);
+                dirs.insert(parentPath);
             }
+            files.push_back(Extraction{i, cur_path, file.getCompressedFileSize()});
+        }
+    }
+    // each directory once, parents are created with their children
+    for(auto dir = dirs.begin(); dir != dirs.end(); ++dir)
+    {
+        auto next = std::next(dir);
+        if(next == dirs.end() || !path_is_base_of(*dir, *next))
+        {
+            fs::create_directories(*dir);
+        }
+    }
+
+    // the largest first, so no long extraction starts last
+    std::stable_sort(files.begin(), files.end(), [](const Extraction &lhs, const Extraction &rhs)
+    {
+        return lhs.size > rhs.size;
+    });
+    WorkStealingPool pool(jobs);
+    // every worker reads through its own file descriptor, and with several
+    // workers each decompresses the blocks of its entry itself
+    std::vector<ArchiveReader> readers;
+    readers.reserve(pool.size());
+    for(std::size_t i=0; i<pool.size(); i++)
+    {
+        readers.push_back(arch.reopen());
+        if(pool.size() > 1)
+        {
+            readers.back().setBlockThreads(1);
         }
     }
+    pool.run(files.size(), [&readers, &files](unsigned worker, std::size_t i)
+    {
+        extract_file(readers[worker][files[i].index], files[i].path);
+    });
 }
 
 static void parse_command_ec (std::istream &ins, std::ostream &outs, std::ostream &errs)
@@ -223,23 +401,69 @@ static void parse_command_refresh (std::istream &ins, std::ostream &outs, std::o
     ins >> archive_path;
     ArchiveParser arch(archive_path.c_str());
     // NOTE!!!: това задава каква да е компресията и какъв алгоритъм да е. Не съм го извел навън през командния ред
-    arch.setDefaultCompressionStrategy(ArchiveParser::CompressionStrategy("LZW", 3));
+    arch.setDefaultCompressionStrategy(ArchiveParser::CompressionStrategy("AUTO", 3 | ArchiveParser::CompressionStrategy::LZW_VARIABLE_WIDTH));
     std::string old_file;
     ins >> old_file;
     std::string replaced_file_content;
     ins >> replaced_file_content;
+    std::string other_args_str;
+    std::getline(ins, other_args_str, '\n');
+    std::istringstream other_args(other_args_str);
+    // --punch-hole: give the blocks of the old file back to the file system
+    bool punch_hole = false;
+    std::string option;
+    while(other_args >> option)
+    {
+        if(option != "--punch-hole")
+        {
+            throw std::runtime_error("Unknown option " + option);
+        }
+        punch_hole = true;
+    }
 
     if(arch.getFileType(old_file.c_str()) != ArchiveParser::fileType::file)
     {
         throw std::runtime_error(old_file + " is not a folder in the archive!");
     }
 
-    arch.deleteFile(old_file.c_str());
+    arch.deleteFile(old_file.c_str(), punch_hole);
     std::fstream new_file(replaced_file_content, std::fstream::in | std::fstream::binary);
     new_file.exceptions(std::fstream::badbit | std::fstream::failbit);
     arch.addFile(old_file.c_str(), new_file);
 }
 
+static void parse_command_compact (std::istream &ins, std::ostream &outs, std::ostream &errs)
+{
+    (void) outs;
+    (void) errs;
+    std::string archive_path;
+    ins >> archive_path;
+    std::string other_args_str;
+    std::getline(ins, other_args_str, '\n');
+    std::istringstream other_args(other_args_str);
+    // with a second path the compacted archive is written there instead
+    std::string new_archive_path;
+    other_args >> new_archive_path;
+
+    ArchiveParser arch(archive_path.c_str());
+    if(new_archive_path.empty())
+    {
+        arch.compact();
+        return;
+    }
+    if(fs::exists(new_archive_path))
+    {
+        throw std::runtime_error(std::string("File with name ") + new_archive_path + " already exists!");
+    }
+    try {
+        arch.compactTo(new_archive_path.c_str());
+    } catch (...)
+    {
+        fs::remove(new_archive_path);
+        throw;
+    }
+}
+
 static void parse_commands (std::istream &ins, std::ostream &outs, std::ostream &errs)
 {
     std::string comm;
@@ -268,6 +492,10 @@ static void parse_commands (std::istream &ins, std::ostream &outs, std::ostream
             {
                 parse_command_refresh(ins, outs, errs);
             }
+            else if(comm == "COMPACT")
+            {
+                parse_command_compact(ins, outs, errs);
+            }
             else if(comm == "EXIT")
             {
 
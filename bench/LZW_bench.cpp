@@ -0,0 +1,159 @@
+// Compares the old boost::unordered_map dictionary with the flat
+// dictionaries from LZW_dictionary.hpp on every compression level, then
+// shows how block LZW scales with the number of threads.
+//
+// usage: LZW_bench [input size in MiB]
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "LZW.hpp"
+#include "LZW_block.hpp"
+#include "LZW_dictionary.hpp"
+
+namespace
+{
+
+// Text like data: words from a small vocabulary with skewed frequencies
+std::string generateInput(std::size_t size)
+{
+    std::mt19937 gen(42); // NOLINT
+    std::vector<std::string> words;
+    std::uniform_int_distribution<int> lenDist(2, 10);
+    std::uniform_int_distribution<int> chrDist('a', 'z');
+    for(unsigned i=0; i<4096; ++i) // NOLINT
+    {
+        std::string word(static_cast<std::size_t>(lenDist(gen)), ' ');
+        for(char &chr : word)
+        {
+            chr = static_cast<char>(chrDist(gen));
+        }
+        words.push_back(word);
+    }
+
+    std::geometric_distribution<std::size_t> wordDist(0.002); // NOLINT
+    std::string res;
+    res.reserve(size + 16); // NOLINT
+    while(res.size() < size)
+    {
+        res += words[wordDist(gen) % words.size()];
+        res += ' ';
+    }
+    res.resize(size);
+    return res;
+}
+
+template<unsigned DICT_SIZE_POW>
+double runDecompressor(const std::string &compressed)
+{
+    std::ostringstream oss;
+    OstreamSink sink(oss);
+    auto start = std::chrono::steady_clock::now();
+    {
+        LZWDecompressor<DICT_SIZE_POW> lzd(sink);
+        lzd.feed(reinterpret_cast<const std::uint8_t*>(compressed.data()), compressed.size()); // NOLINT
+        lzd.flush();
+    }
+    auto stop = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(stop - start).count();
+}
+
+template<unsigned DICT_SIZE_POW, class Dict>
+std::pair<double, std::string> runCompressor(const std::string &input)
+{
+    std::ostringstream oss;
+    OstreamSink sink(oss);
+    auto start = std::chrono::steady_clock::now();
+    {
+        LZWCompressor<DICT_SIZE_POW, Dict> lzc(sink);
+        lzc.feed(reinterpret_cast<const std::uint8_t*>(input.data()), input.size()); // NOLINT
+        lzc.flush();
+    }
+    auto stop = std::chrono::steady_clock::now();
+    return {std::chrono::duration<double>(stop - start).count(), oss.str()};
+}
+
+template<unsigned DICT_SIZE_POW>
+void benchLevel(unsigned level, const std::string &input)
+{
+    auto oldRes = runCompressor<DICT_SIZE_POW, LZWMapDictionary<DICT_SIZE_POW>>(input);
+    auto newRes = runCompressor<DICT_SIZE_POW, LZWDictionary<DICT_SIZE_POW>>(input);
+    double decodeTime = runDecompressor<DICT_SIZE_POW>(newRes.second);
+    double mib = static_cast<double>(input.size()) / (1024.0 * 1024.0);
+
+    std::cout << std::setw(5) << level << std::setw(6) << DICT_SIZE_POW
+              << std::setw(12) << std::fixed << std::setprecision(1) << mib / oldRes.first
+              << std::setw(12) << mib / newRes.first
+              << std::setw(9) << std::setprecision(2) << oldRes.first / newRes.first << 'x'
+              << std::setw(13) << std::setprecision(1) << mib / decodeTime
+              << (oldRes.second == newRes.second ? "" : "  OUTPUT MISMATCH!") << '\n';
+}
+
+} // namespace
+
+void benchBlockThreads(const std::string &input, unsigned threads)
+{
+    const auto *data = reinterpret_cast<const std::uint8_t*>(input.data()); // NOLINT
+    VectorSink compressed;
+    auto start = std::chrono::steady_clock::now();
+    {
+        // level 5
+        BlockLZWCompressor lzc(compressed, 16, true, threads); // NOLINT
+        lzc.feed(data, input.size());
+        lzc.flush();
+    }
+    auto mid = std::chrono::steady_clock::now();
+    VectorSink decompressed;
+    {
+        BlockLZWDecompressor lzd(decompressed, 16, true, threads); // NOLINT
+        lzd.feed(compressed.data.data(), compressed.data.size());
+        lzd.flush();
+    }
+    auto stop = std::chrono::steady_clock::now();
+    double mib = static_cast<double>(input.size()) / (1024.0 * 1024.0);
+    std::cout << std::fixed
+              << std::setw(7) << threads
+              << std::setw(13) << std::setprecision(1) << mib / std::chrono::duration<double>(mid - start).count()
+              << std::setw(13) << std::setprecision(1) << mib / std::chrono::duration<double>(stop - mid).count()
+              << '\n';
+}
+
+int main(int argc, char **argv)
+{
+    std::size_t sizeMiB = 16;
+    if(argc > 1)
+    {
+        sizeMiB = std::strtoul(argv[1], nullptr, 10); // NOLINT
+    }
+    std::string input = generateInput(sizeMiB * 1024 * 1024);
+
+    std::cout << "level  bits  map MiB/s  flat MiB/s  speedup  decode MiB/s\n";
+    // same level -> dictionary size mapping as ArchiveParser::CompressionStrategy
+    benchLevel<9>(0, input);
+    benchLevel<10>(1, input);
+    benchLevel<11>(2, input);
+    benchLevel<13>(3, input);
+    benchLevel<14>(4, input);
+    benchLevel<16>(5, input);
+    benchLevel<18>(6, input);
+    benchLevel<21>(7, input);
+    benchLevel<24>(8, input);
+    benchLevel<26>(9, input);
+
+    std::cout << "\nblock LZW, level 5\nthreads  encode MiB/s  decode MiB/s\n";
+    for(unsigned threads=1; threads<=ThreadPool::defaultThreadCount(); threads*=2)
+    {
+        benchBlockThreads(input, threads);
+    }
+
+    return 0;
+}
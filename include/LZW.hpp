@@ -1,13 +1,18 @@
 #pragma once
 
+#include "bit_io.hpp"
 #include "compressor_base.hpp"
+#include "LZW_dictionary.hpp"
+#include "memory_budget.hpp"
 
-#include <boost/unordered/unordered_map.hpp>
+#include <algorithm>
+#include <cassert>
 #include <climits>
 #include <cstdint>
 #include <ios>
 #include <istream>
 #include <limits>
+#include <memory>
 #include <stdexcept>
 #include <type_traits>
 #include <utility>
@@ -19,8 +24,11 @@
 // Probably only if CHAR_BIT == 8
 static_assert(CHAR_BIT == 8, ""); // NOLINT
 
-template<unsigned DICT_SIZE_POW>
-class LZWCompressor final : public Compressor
+// output is handed to the ByteSink in blocks of this size
+constexpr std::size_t LZW_OUT_BLOCK_SIZE = 64 * 1024;
+
+template<unsigned DICT_SIZE_POW, class Dict = LZWDictionary<DICT_SIZE_POW>>
+class LZWCompressor final : public PushCompressor
 {
 private:
 
@@ -28,82 +36,81 @@ private:
     static_assert(DICT_SIZE_POW > CHAR_BIT, "Dictionary size is too small");
     static_assert(DICT_SIZE_POW <= 32, "Dictionary size is too large"); // NOLINT
     using CodeType = std::conditional_t<DICT_SIZE_POW <= 16, std::uint16_t, std::uint32_t>;
-    using KeyType = std::pair<CodeType, uint8_t>;
-    // Използвам boost::unordered_map защото се представя доста по-бързо от 
-    // колкото std::unordered_map (или поне така беше преди, не знам, може и да 
-    // са пренаписали libstdcpp или libc++)
-    using DictContainer = boost::unordered_map<KeyType, CodeType>;
+    // see LZW_dictionary.hpp
+    using DictContainer = Dict;
+    static_assert(std::is_same<CodeType, typename DictContainer::CodeType>::value, "");
 
     // static constatns
     static constexpr std::size_t DICT_SIZE = (1ULL << DICT_SIZE_POW);
     static constexpr unsigned DICT_MAX_SIZE = DICT_SIZE - 1U;
     static constexpr CodeType INVALID_CODETYPE = DICT_MAX_SIZE;
+    static constexpr unsigned FIRST_FREE_CODE = 1U << CHAR_BIT;
 
     // member variables
+    // taken before the dictionary is allocated
+    MemoryReservation memory;
     DictContainer dict{};
-    std::ostream &out;
-    std::uint64_t bitsBuffer = 0;
-    unsigned bitsBufferSize = 0;
-    unsigned dictSizeBits = 0;
+    unsigned dictSize = 0;
+    BitPacker out;
+    // code of the longest match so far, INVALID_CODETYPE before the first byte
+    CodeType curCode = INVALID_CODETYPE;
+    // Variable width codes: every code is written with the width the
+    // decompressor will use to read it. That width depends on the size of
+    // the decompressor's dictionary, which lags one entry behind ours, so
+    // its size is tracked separately in decoderDictSize.
+    bool variableWidth = false;
+    bool firstCodeWritten = false;
+    unsigned decoderDictSize = FIRST_FREE_CODE;
+    unsigned dictSizeBits = 9;
     bool codeTypeWriteFinished = false;
 
     // private functions
-    void resetDictionary()
+    // strings the dictionary holds at most, sizeHint is the input size or 0
+    static std::size_t maxEntries(std::size_t sizeHint)
     {
-        dict.clear();
-        constexpr unsigned minc = std::numeric_limits<uint8_t>::min();
-        constexpr unsigned maxc = std::numeric_limits<uint8_t>::max();
-        static_assert(minc == 0, "");
-        for(unsigned i=minc; i<=maxc; i++)
-        {
-            CodeType cur_code = static_cast<CodeType>(i);//CodeType cur_code = dict.size();
-            dict[{INVALID_CODETYPE, i}] = cur_code;
-        }
-        dictSizeBits = 9;
+        constexpr std::size_t MAX_ENTRIES = DICT_MAX_SIZE - FIRST_FREE_CODE;
+        return sizeHint == 0 ? MAX_ENTRIES : std::min(sizeHint, MAX_ENTRIES);
     }
-    
-    void writeBits(std::uint64_t bits, unsigned bitsSize)
+
+    void resetDictionary()
     {
-        assert(bitsSize < 64-8);
-        bitsBuffer |= (bits << bitsBufferSize);
-        bitsBufferSize += bitsSize;
-        while(bitsBufferSize >= 8)
-        {
-            unsigned char val = (bitsBuffer & 0xFFU);
-            out.write(reinterpret_cast<char*>(&val), 1); // NOLINT
-            bitsBuffer >>= 8U; bitsBufferSize -= 8U;
-        }
+        // the single byte strings are implicit in the dictionary
+        dict.reset();
+        dictSize = FIRST_FREE_CODE;
     }
 
-    /*
-    template<unsigned DSP = DICT_SIZE_POW, std::enable_if_t<DSP == 16, bool> = true>
-    template<unsigned DSP = DICT_SIZE_POW, std::enable_if_t<DSP != 16, bool> = true>
-    */
-
     void finishCodeTypeWrite()
     {
         codeTypeWriteFinished = true;
-        assert(bitsBufferSize < 8);
-        if(bitsBufferSize == 0)
-        {
-            return;
-        }
-        char val = static_cast<char>(bitsBuffer & 0xFFU);
-        out.write(&val, 1);
-        bitsBuffer = 0; bitsBufferSize = 0;
+        out.finish();
     }
 
     void writeCodeType(CodeType data)
     {
-        // TODO: variable bit size
-        //if(dictSizeBits <= 12)
+        if(!variableWidth)
         {
-            // TODO: dynamic bit size
-            //writeBits(data, dictSizeBits);
-            writeBits(data, DICT_SIZE_POW);
+            out.put<DICT_SIZE_POW>(data);
+            return;
+        }
+
+        out.put(data, dictSizeBits);
+        // do what LZWDecompressor does after reading this code
+        if(decoderDictSize == DICT_MAX_SIZE)
+        {
+            decoderDictSize = FIRST_FREE_CODE;
+            dictSizeBits = 9;
+        }
+        if(firstCodeWritten)
+        {
+            ++decoderDictSize;
+            if((decoderDictSize >> dictSizeBits) != 0)
+            {
+                ++dictSizeBits;
+            }
         }
+        firstCodeWritten = true;
     }
-    
+
 public:
 
     LZWCompressor(const LZWCompressor&) = delete;
@@ -111,89 +118,90 @@ public:
 
     LZWCompressor(LZWCompressor&&)  noexcept = default;
     LZWCompressor& operator= (LZWCompressor&&)  noexcept = default;
-    
-    ~LZWCompressor() override
-    {
-        if(codeTypeWriteFinished)
-        {
-            return;
-        }
-        // да скрием проблемите под килима!
-        try 
-        {
-            finishCodeTypeWrite();
-        } catch(...)
-        {
 
-        }
-    }
+    ~LZWCompressor() override = default;
 
-    void finish() override
+    // sizeHint - the input size if it is known. A small input gets a small
+    // reservation in MemoryBudget::global(), the dictionary grows on demand.
+    explicit LZWCompressor(ByteSink &_out, bool _variableWidth = false, std::size_t sizeHint = 0) :
+        memory(MemoryBudget::global(), dictMemoryBound(sizeHint)),
+        out(_out, LZW_OUT_BLOCK_SIZE), variableWidth(_variableWidth)
     {
-        finishCodeTypeWrite();
+        resetDictionary();
     }
 
-    explicit LZWCompressor(std::ostream &_out) : 
-        out(_out)
-    {}
+    static std::size_t dictMemoryBound(std::size_t sizeHint)
+    {
+        return DictContainer::memoryBound(maxEntries(sizeHint));
+    }
 
-    void prepare(std::istream &ins, std::size_t read_size) override
+    std::size_t peakMemoryUsage() const override
     {
-        (void) ins;
-        (void) read_size;
-        // TODO: map of used characters
+        return dict.memoryUsage();
     }
 
-    void operator()(std::istream &ins, std::size_t read_size) override
+    void feed(const std::uint8_t *data, std::size_t size) override
     {
         assert(codeTypeWriteFinished == false);
+        if(size == 0)
+        {
+            return;
+        }
 
-        resetDictionary();
-        
-        CodeType cur_code = INVALID_CODETYPE;
-        std::uint8_t chr; // NOLINT
+        std::size_t i = 0;
+        CodeType cur_code = curCode;
+        if(cur_code == INVALID_CODETYPE)
+        {
+            cur_code = data[0];
+            i = 1;
+        }
 #pragma GCC unroll 4
-        for(std::size_t i=0; i<read_size; i++)
+        for(; i<size; i++)
         {
-            ins.get(reinterpret_cast<char&>(chr)); // NOLINT
-            
-            if(dict.size() == DICT_MAX_SIZE)
+            std::uint8_t chr = data[i]; // NOLINT
+
+            if(dictSize == DICT_MAX_SIZE)
             {
                 resetDictionary();
             }
-            
-            if(dict.count({cur_code, chr}) == 0)
+
+            CodeType new_code = static_cast<CodeType>(dictSize);
+            CodeType next_code = dict.findOrInsert(cur_code, chr, new_code);
+            if(next_code == INVALID_CODETYPE)
             {
-                // not in the dict, so
-                // add it to the dictionary:
-                CodeType new_code = static_cast<CodeType>(dict.size());
-                dict[{cur_code, chr}] = new_code;
-                if((1U << dictSizeBits) - 2U <= new_code + 1U)
-                {
-                    ++dictSizeBits;
-                }
+                // not in the dict, so it was just added
+                ++dictSize;
                 writeCodeType(cur_code);
-                cur_code = chr; // cur_code = dict[{INVALID_CODETYPE, chr}];
+                cur_code = chr;
             }
             else
             {
                 // already in the dict
-                cur_code = dict[{cur_code, chr}];
+                cur_code = next_code;
             }
         }
+        curCode = cur_code;
+    }
 
-        if(cur_code != INVALID_CODETYPE)
+    void flush() override
+    {
+        if(codeTypeWriteFinished)
+        {
+            return;
+        }
+        if(curCode != INVALID_CODETYPE)
         {
-            writeCodeType(cur_code);
+            writeCodeType(curCode);
         }
-    }    
+        finishCodeTypeWrite();
+    }
 
 };
 
 
 
 template<unsigned DICT_SIZE_POW>
-class LZWDecompressor final : public Decompressor
+class LZWDecompressor final : public PushDecompressor
 {
 private:
 
@@ -201,48 +209,54 @@ private:
     static_assert(DICT_SIZE_POW > CHAR_BIT, "Dictionary size is too small");
     static_assert(DICT_SIZE_POW <= 32, "Dictionary size is too large"); // NOLINT
     using CodeType = std::conditional_t<DICT_SIZE_POW <= 16, std::uint16_t, std::uint32_t>;
-    using KeyType = std::pair<CodeType, uint8_t>;
-    using DictContainer = std::vector<KeyType>;
+    // The string of a code is the string of prefix followed by last.
+    // length and first are stored so a string can be written back to front
+    // straight into the output block without walking the chain twice.
+    struct Entry
+    {
+        CodeType prefix;
+        std::uint32_t length;
+        std::uint8_t last;
+        std::uint8_t first;
+    };
+    using DictContainer = std::vector<Entry>;
 
     // static constatns
     static constexpr std::size_t DICT_SIZE = (1ULL << DICT_SIZE_POW);
     static constexpr unsigned DICT_MAX_SIZE = DICT_SIZE - 1;
     static constexpr CodeType INVALID_CODETYPE = DICT_MAX_SIZE;
-    static_assert(DICT_SIZE_POW > CHAR_BIT, "Dictionary size is too small");
+    static constexpr unsigned FIRST_FREE_CODE = 1U << CHAR_BIT;
 
     // member variables
+    MemoryReservation memory;
     DictContainer dict{};
-    std::ostream &out;
-    std::uint64_t bitsBuffer = 0;
-    unsigned bitsBufferSize = 0;
-    unsigned dictSizeBits = 0;
+    ByteSink &out;
+    std::vector<std::uint8_t> outBlock;
+    std::size_t outBlockPos = 0;
+    CodeType prevCode = INVALID_CODETYPE;
+    BitUnpacker in{};
+    // see LZWCompressor::writeCodeType
+    bool variableWidth = false;
+    unsigned dictSizeBits = 9;
     bool codeTypeReadFinished = false;
 
     // private functions
-    CodeType readBits(unsigned bitsSize, std::istream &ins, std::size_t &read_size)
+    // entries the dictionary holds at most, sizeHint is the compressed size
+    // or 0. Every code is at least 9 bits and adds at most one entry.
+    static std::size_t maxEntries(std::size_t sizeHint)
     {
-        assert(bitsSize <= sizeof(CodeType)*CHAR_BIT);
-        assert(bitsSize < 64-8 && bitsSize > 0);
-        while(bitsBufferSize < bitsSize)
+        if(sizeHint == 0 || sizeHint >= DICT_SIZE)
         {
-            unsigned char val;
-            if(read_size == 0)
-            {
-                throw std::runtime_error("Archive is corrupted!");
-            }
-            ins.read(reinterpret_cast<char*>(&val), 1); --read_size; // NOLINT
-            bitsBuffer |= (static_cast<std::uint64_t>(val) << bitsBufferSize); bitsBufferSize += 8;
+            return DICT_SIZE;
         }
-        CodeType res = static_cast<CodeType>(bitsBuffer & ((1ULL << bitsSize) - 1U));
-        bitsBuffer >>= bitsSize; bitsBufferSize -= bitsSize;
-
-        return res;
+        return std::min<std::size_t>(DICT_SIZE, FIRST_FREE_CODE + sizeHint * CHAR_BIT / 9 + 1);
     }
 
     void finishCodeTypeRead()
     {
         codeTypeReadFinished = true;
-        if(bitsBuffer != 0)
+        // only the zero padding of the last byte may be left
+        if(!in.onlyPaddingLeft())
         {
             throw std::runtime_error("Archive is corrupted!");
         }
@@ -250,56 +264,107 @@ private:
 
     void resetDictionary()
     {
-        dict.clear();
-        constexpr unsigned minc = std::numeric_limits<uint8_t>::min();
-        constexpr unsigned maxc = std::numeric_limits<uint8_t>::max();
-        static_assert(minc == 0, "");
-        dict.resize(maxc-minc+1);
-        for(unsigned i=minc; i<=maxc; i++)
+        // the single byte strings never change
+        if(dict.size() < FIRST_FREE_CODE)
         {
-            CodeType cur_code = static_cast<CodeType>(i); //CodeType cur_code = dict.size();
-            dict[cur_code] = {INVALID_CODETYPE, i};
+            dict.resize(FIRST_FREE_CODE);
+            for(unsigned i=0; i<FIRST_FREE_CODE; i++)
+            {
+                auto chr = static_cast<std::uint8_t>(i);
+                dict[i] = {INVALID_CODETYPE, 1, chr, chr};
+            }
         }
+        dict.resize(FIRST_FREE_CODE);
         dictSizeBits = 9;
     }
 
-    void codeTypeToStr(CodeType code, std::vector<std::uint8_t> &res)
+    void addEntry(CodeType prefix, std::uint8_t last)
+    {
+        // The compressor resets right after adding an entry, when its
+        // current code is a single byte. So even the first entry after a
+        // reset has a prefix that is already known.
+        if(prefix >= dict.size())
+        {
+            throw std::runtime_error("Archive is corrupted");
+        }
+        const Entry &pref = dict[prefix];
+        dict.push_back({prefix, pref.length + 1, last, pref.first});
+    }
+
+    void flushOutBlock()
     {
-        res.clear();
-        while(code != INVALID_CODETYPE)
+        if(outBlockPos != 0)
         {
-            res.push_back(dict[code].second);
-            code = dict[code].first;
+            out.write(outBlock.data(), outBlockPos);
+            outBlockPos = 0;
         }
-        std::reverse(res.begin(), res.end());
     }
 
-    std::uint8_t codeTypeToFirstChar(CodeType code)
+    void writeString(CodeType code)
     {
-        assert(code != INVALID_CODETYPE);
-        while(code != INVALID_CODETYPE)
+        std::size_t length = dict[code].length;
+        if(outBlock.size() - outBlockPos < length)
         {
-            if(dict[code].first == INVALID_CODETYPE) 
+            flushOutBlock();
+            if(outBlock.size() < length)
             {
-                return dict[code].second;
+                outBlock.resize(length);
             }
-            code = dict[code].first;
         }
-        assert(false); // we should not be here!
-        return 0;
+        outBlockPos += length;
+        std::uint8_t *pos = outBlock.data() + outBlockPos;
+        for(std::size_t i=0; i<length; i++)
+        {
+            const Entry &cur = dict[code];
+            *--pos = cur.last; // NOLINT
+            code = cur.prefix;
+        }
+    }
+
+    unsigned nextCodeWidth()
+    {
+        if(!variableWidth)
+        {
+            return DICT_SIZE_POW;
+        }
+        // the code can be at most dict.size(), so it fits in its bit length
+        if((dict.size() >> dictSizeBits) != 0)
+        {
+            ++dictSizeBits;
+        }
+        return dictSizeBits;
     }
 
-    bool readCodeType(std::istream &ins, std::size_t &read_size, CodeType &code)
+    void decodeCode(CodeType cur_code)
     {
-        if(read_size == 0) 
+        if(dict.size() == DICT_MAX_SIZE)
         {
-            return false;
+            resetDictionary();
         }
-        code = readBits(DICT_SIZE_POW, ins, read_size);
-        // TODO: dynamic bit size
-        //code = readBits(dictSizeBits, ins, read_size);
 
-        return true;
+        if(cur_code > dict.size())
+        {
+            throw std::runtime_error("Archive is corrupted");
+        }
+
+        if(cur_code == dict.size())
+        {
+            if(prevCode >= dict.size())
+            {
+                throw std::runtime_error("Archive is corrupted");
+            }
+            addEntry(prevCode, dict[prevCode].first);
+        }
+        else // cur_code < dict.size()
+        {
+            if(prevCode != INVALID_CODETYPE)
+            {
+                addEntry(prevCode, dict[cur_code].first);
+            }
+        }
+
+        writeString(cur_code);
+        prevCode = cur_code;
     }
 
 public:
@@ -309,81 +374,81 @@ public:
 
     LZWDecompressor(LZWDecompressor&&)  noexcept = default;
     LZWDecompressor& operator= (LZWDecompressor&&)  noexcept = default;
-    
-    ~LZWDecompressor() override
+
+    ~LZWDecompressor() override = default;
+
+    // sizeHint - the compressed size if it is known. Without it the
+    // dictionary grows with the input up to DICT_SIZE entries.
+    // budget - where the dictionary is reserved
+    explicit LZWDecompressor(ByteSink &_out, bool _variableWidth = false, std::size_t sizeHint = 0,
+                             MemoryBudget &budget = MemoryBudget::global()) :
+        memory(budget, dictMemoryBound(sizeHint)),
+        out(_out), outBlock(LZW_OUT_BLOCK_SIZE), variableWidth(_variableWidth)
     {
-        try {
-            finishCodeTypeRead();
-        } catch(...)
+        if(sizeHint != 0)
         {
-
+            dict.reserve(maxEntries(sizeHint));
         }
+        resetDictionary();
     }
 
-    explicit LZWDecompressor(std::ostream &_out) : 
-        out(_out)
+    static std::size_t dictMemoryBound(std::size_t sizeHint)
     {
-        dict.reserve(DICT_SIZE);
+        return maxEntries(sizeHint) * sizeof(Entry);
     }
 
-    void finish() override
+    std::size_t peakMemoryUsage() const override
     {
-        finishCodeTypeRead();
+        return dict.capacity() * sizeof(Entry);
     }
 
-    void operator()(std::istream &ins, std::size_t read_size) override
+    void feed(const std::uint8_t *data, std::size_t size) override
     {
-        resetDictionary();
-        
-        CodeType cur_code; // NOLINT
-        CodeType prev_code = INVALID_CODETYPE;
-        std::vector<std::uint8_t> tmps;
-        tmps.reserve(64); // NOLINT
-        while(readCodeType(ins, read_size, cur_code))
+        assert(codeTypeReadFinished == false);
+        in.attach(data, size);
+        if(!variableWidth)
         {
-            //ins.get(reinterpret_cast<char&>(chr)); // NOLINT
-            
-            if(dict.size() == DICT_MAX_SIZE)
+            while(in.canGet(DICT_SIZE_POW))
             {
-                resetDictionary();
-            }
-            
-            if(cur_code > dict.size())
-            {
-                throw std::runtime_error("Archive is corrupted");
-            }
-
-            if(cur_code == dict.size())
-            {
-                uint8_t lchr = codeTypeToFirstChar(prev_code);
-                dict.push_back({prev_code, lchr});
-                if(dict.size() >= (1U << dictSizeBits) - 2U)
-                {
-                    ++dictSizeBits;
-                }
-                codeTypeToStr(cur_code, tmps);
-            }
-            else // cur_code < dict.size()
-            {
-                codeTypeToStr(cur_code, tmps);
-                if(prev_code != INVALID_CODETYPE)
-                {
-                    dict.push_back({prev_code, tmps.front()});
-                    if(dict.size() >= (1U << dictSizeBits) - 2U)
-                    {
-                        ++dictSizeBits;
-                    }
-                }
+                decodeCode(static_cast<CodeType>(in.get<DICT_SIZE_POW>()));
             }
+            return;
+        }
+        unsigned width = nextCodeWidth();
+        while(in.canGet(width))
+        {
+            decodeCode(static_cast<CodeType>(in.get(width)));
+            width = nextCodeWidth();
+        }
+    }
 
-            out.write(reinterpret_cast<const char*>(tmps.data()),  // NOLINT
-                      static_cast<std::streamsize>(tmps.size())); 
-            prev_code = cur_code;
+    void flush() override
+    {
+        if(codeTypeReadFinished)
+        {
+            return;
         }
+        flushOutBlock();
+        finishCodeTypeRead();
     }
 
 };
 
-
-std::unique_ptr<Compressor> makeLZWCompressor(unsigned dictSize, std::ostream &out);
-std::unique_ptr<Decompressor> makeLZWDecompressor(unsigned dictSize, std::ostream &out);
+// variableWidth - write each code with the current dictionary width instead
+// of always DICT_SIZE_POW bits. Both sides must use the same setting.
+// sizeHint - input size (compressed size for the decompressor) or 0 if it is
+// not known, see LZWCompressor::LZWCompressor
+std::unique_ptr<PushCompressor> makeLZWPushCompressor(unsigned dictSize, ByteSink &out,
+                                                      bool variableWidth = false, std::size_t sizeHint = 0);
+std::unique_ptr<PushDecompressor> makeLZWPushDecompressor(unsigned dictSize, ByteSink &out,
+                                                          bool variableWidth = false, std::size_t sizeHint = 0,
+                                                          MemoryBudget &budget = MemoryBudget::global());
+
+// upper bound of the dictionary memory of makeLZWPushCompressor(dictSize, ..., sizeHint)
+std::size_t LZWCompressorMemoryBound(unsigned dictSize, std::size_t sizeHint);
+// upper bound of the dictionary memory of makeLZWPushDecompressor(dictSize, ..., sizeHint)
+std::size_t LZWDecompressorMemoryBound(unsigned dictSize, std::size_t sizeHint);
+
+// istream based versions, see PushCompressorAdapter
+std::unique_ptr<Compressor> makeLZWCompressor(unsigned dictSize, std::ostream &out, bool variableWidth = false);
+std::unique_ptr<Decompressor> makeLZWDecompressor(unsigned dictSize, std::ostream &out, bool variableWidth = false);
@@ -0,0 +1,143 @@
+#pragma once
+
+#include "compressor_base.hpp"
+#include "memory_budget.hpp"
+#include "thread_pool.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <vector>
+
+// Block LZW
+//
+// The input is cut into blocks of blockSize bytes and every block is
+// compressed with its own dictionary, so the blocks can be compressed and
+// decompressed independently on a thread pool. The stream is a sequence of
+// frames:
+//
+//     uint32 raw size | uint32 packed size | packed size bytes of LZW codes
+//
+// both sizes little endian. The frame headers form the block offset table,
+// it is inline so the stream can still be written and read in one pass.
+// The output does not depend on the number of threads.
+//
+// The blocks are coded on ThreadPool::shared(), so a codec does not start
+// threads of its own and the codecs of concurrent entries share the same
+// hardware threads. Callers that already run an entry per thread ask for
+// one thread, their blocks are coded on the calling thread.
+//
+// Every block codec takes its own reservation, sized for one block, in
+// MemoryBudget::global() or in the budget given to the decompressor.
+
+constexpr std::size_t LZW_BLOCK_SIZE = 1024 * 1024;
+constexpr std::size_t LZW_BLOCK_FRAME_HEADER_SIZE = 2 * sizeof(std::uint32_t);
+// larger frames are treated as corruption instead of allocating for them
+constexpr std::size_t LZW_BLOCK_MAX_SIZE = 64 * 1024 * 1024;
+
+// a compressed frame or a decompressed block
+struct LZWBlockResult
+{
+    std::vector<std::uint8_t> data;
+    std::size_t peakMemory;
+};
+
+class BlockLZWCompressor final : public PushCompressor
+{
+private:
+    ByteSink &out;
+    unsigned dictSizePow;
+    bool variableWidth;
+    std::size_t blockSize;
+    std::size_t maxBlocksInFlight;
+    std::vector<std::uint8_t> curBlock;
+    // compressed frames, in stream order
+    std::deque<std::future<LZWBlockResult>> inFlight;
+    bool flushed = false;
+    unsigned threadsUsed;
+    std::size_t maxBlockPeakMemory = 0;
+    std::size_t blocksDone = 0;
+    // ThreadPool::shared(), null if everything is done on the calling thread
+    ThreadPool *pool = nullptr;
+
+    void submitBlock();
+    void writeBlock(const LZWBlockResult &block);
+    void writeOldestBlock();
+
+public:
+    // threads == 0 means one per hardware thread
+    BlockLZWCompressor(ByteSink &_out, unsigned _dictSizePow, bool _variableWidth,
+                       unsigned threads, std::size_t _blockSize = LZW_BLOCK_SIZE);
+
+    BlockLZWCompressor(const BlockLZWCompressor&) = delete;
+    BlockLZWCompressor& operator= (const BlockLZWCompressor&) = delete;
+    BlockLZWCompressor(BlockLZWCompressor&&) = delete;
+    BlockLZWCompressor& operator= (BlockLZWCompressor&&) = delete;
+    ~BlockLZWCompressor() override = default;
+
+    void feed(const std::uint8_t *data, std::size_t size) override;
+
+    void flush() override;
+
+    // the largest block dictionary times the blocks that can be in flight
+    std::size_t peakMemoryUsage() const override;
+};
+
+class BlockLZWDecompressor final : public PushDecompressor
+{
+private:
+    ByteSink &out;
+    unsigned dictSizePow;
+    bool variableWidth;
+    std::size_t maxBlocksInFlight;
+    // the frame that is being read, header included
+    std::vector<std::uint8_t> curFrame;
+    std::size_t curFrameSize = LZW_BLOCK_FRAME_HEADER_SIZE;
+    std::size_t curRawSize = 0;
+    // decompressed blocks, in stream order
+    std::deque<std::future<LZWBlockResult>> inFlight;
+    bool flushed = false;
+    unsigned threadsUsed;
+    std::size_t maxBlockPeakMemory = 0;
+    std::size_t blocksDone = 0;
+    MemoryBudget &budget;
+    // see BlockLZWCompressor::pool
+    ThreadPool *pool = nullptr;
+
+    void readFrameHeader();
+    void submitFrame();
+    void writeBlock(const LZWBlockResult &block);
+    void writeOldestBlock();
+
+public:
+    // budget - where the block dictionaries are reserved
+    BlockLZWDecompressor(ByteSink &_out, unsigned _dictSizePow, bool _variableWidth, unsigned threads,
+                         MemoryBudget &_budget = MemoryBudget::global());
+
+    BlockLZWDecompressor(const BlockLZWDecompressor&) = delete;
+    BlockLZWDecompressor& operator= (const BlockLZWDecompressor&) = delete;
+    BlockLZWDecompressor(BlockLZWDecompressor&&) = delete;
+    BlockLZWDecompressor& operator= (BlockLZWDecompressor&&) = delete;
+    // waits for the blocks that are still decompressed
+    ~BlockLZWDecompressor() override;
+
+    void feed(const std::uint8_t *data, std::size_t size) override;
+
+    void flush() override;
+
+    // the largest block dictionary times the blocks that can be in flight
+    std::size_t peakMemoryUsage() const override;
+};
+
+// the block dictionaries a codec for threads (0 for one per hardware
+// thread) has at once: one per block that is being coded, at most as many
+// as ThreadPool::shared() runs
+unsigned blockLZWDictionaryCount(unsigned threads);
+
+std::unique_ptr<PushCompressor> makeBlockLZWPushCompressor(unsigned dictSize, ByteSink &out,
+                                                           bool variableWidth = false, unsigned threads = 0);
+std::unique_ptr<PushDecompressor> makeBlockLZWPushDecompressor(unsigned dictSize, ByteSink &out,
+                                                               bool variableWidth = false, unsigned threads = 0,
+                                                               MemoryBudget &budget = MemoryBudget::global());
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <boost/unordered/unordered_map.hpp>
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Dictionary engines for LZWCompressor.
+//
+// Every engine maps (prefix code, next byte) -> code. The 256 single byte
+// strings are implicit (code == byte) and are never stored, so a stored code
+// is always >= 256.
+//
+// findOrInsert() is the only lookup done per input byte: it returns the code
+// of the string if it is already known, otherwise it stores the string with
+// new_code and returns INVALID_CODETYPE.
+//
+// memoryBound(entries) is the most memory the engine uses while it holds at
+// most that many strings, memoryUsage() is what it uses now. Neither goes
+// down on reset(), so memoryUsage() is also the peak.
+
+template<unsigned DICT_SIZE_POW>
+struct LZWDictionaryTraits
+{
+    static_assert(DICT_SIZE_POW > CHAR_BIT, "Dictionary size is too small");
+    static_assert(DICT_SIZE_POW <= 32, "Dictionary size is too large"); // NOLINT
+    using CodeType = std::conditional_t<DICT_SIZE_POW <= 16, std::uint16_t, std::uint32_t>;
+    static constexpr std::size_t DICT_SIZE = (1ULL << DICT_SIZE_POW);
+    static constexpr CodeType INVALID_CODETYPE = static_cast<CodeType>(DICT_SIZE - 1U);
+};
+
+// The old node based map. Kept only as a reference for tests and benchmarks.
+// It does the same count() + operator[] pair of lookups as before.
+template<unsigned DICT_SIZE_POW>
+class LZWMapDictionary
+{
+public:
+    using CodeType = typename LZWDictionaryTraits<DICT_SIZE_POW>::CodeType;
+    static constexpr CodeType INVALID_CODETYPE = LZWDictionaryTraits<DICT_SIZE_POW>::INVALID_CODETYPE;
+
+private:
+    using KeyType = std::pair<CodeType, std::uint8_t>;
+    // rough size of a node and its bucket pointer
+    static constexpr std::size_t NODE_SIZE = sizeof(KeyType) + sizeof(CodeType) + 3 * sizeof(void*);
+    boost::unordered_map<KeyType, CodeType> dict{};
+    std::size_t maxSize = 0;
+
+public:
+    static std::size_t memoryBound(std::size_t entries)
+    {
+        return entries * NODE_SIZE;
+    }
+
+    std::size_t memoryUsage() const
+    {
+        return std::max(maxSize, dict.size()) * NODE_SIZE;
+    }
+
+    void reset()
+    {
+        maxSize = std::max(maxSize, dict.size());
+        dict.clear();
+    }
+
+    CodeType findOrInsert(CodeType prefix, std::uint8_t chr, CodeType new_code)
+    {
+        if(dict.count({prefix, chr}) == 0)
+        {
+            dict[{prefix, chr}] = new_code;
+            return INVALID_CODETYPE;
+        }
+        return dict[{prefix, chr}];
+    }
+};
+
+// Dense child table: one slot for every possible (prefix, byte) pair.
+// Lookup is a single indexed load. Only usable for small dictionaries, the
+// table has DICT_SIZE * 256 entries.
+template<unsigned DICT_SIZE_POW>
+class LZWDenseDictionary
+{
+public:
+    using CodeType = typename LZWDictionaryTraits<DICT_SIZE_POW>::CodeType;
+    static constexpr CodeType INVALID_CODETYPE = LZWDictionaryTraits<DICT_SIZE_POW>::INVALID_CODETYPE;
+
+private:
+    static constexpr std::size_t DICT_SIZE = LZWDictionaryTraits<DICT_SIZE_POW>::DICT_SIZE;
+    static constexpr std::size_t TABLE_SIZE = DICT_SIZE << CHAR_BIT;
+    static constexpr CodeType EMPTY_SLOT = 0;
+
+    std::unique_ptr<CodeType[]> children; // NOLINT
+    // slots that are in use, so reset() does not have to clear the whole table
+    std::vector<std::uint32_t> usedSlots{};
+
+    static std::size_t slotIndex(CodeType prefix, std::uint8_t chr)
+    {
+        return (static_cast<std::size_t>(prefix) << CHAR_BIT) | chr;
+    }
+
+public:
+    LZWDenseDictionary() : children(new CodeType[TABLE_SIZE]()) // NOLINT
+    {
+        usedSlots.reserve(DICT_SIZE);
+    }
+
+    static std::size_t memoryBound(std::size_t entries)
+    {
+        (void) entries;
+        return TABLE_SIZE * sizeof(CodeType) + DICT_SIZE * sizeof(std::uint32_t);
+    }
+
+    std::size_t memoryUsage() const
+    {
+        return TABLE_SIZE * sizeof(CodeType) + usedSlots.capacity() * sizeof(std::uint32_t);
+    }
+
+    void reset()
+    {
+        for(std::uint32_t slot : usedSlots)
+        {
+            children[slot] = EMPTY_SLOT;
+        }
+        usedSlots.clear();
+    }
+
+    CodeType findOrInsert(CodeType prefix, std::uint8_t chr, CodeType new_code)
+    {
+        std::size_t slot = slotIndex(prefix, chr);
+        CodeType res = children[slot];
+        if(res != EMPTY_SLOT)
+        {
+            return res;
+        }
+        children[slot] = new_code;
+        usedSlots.push_back(static_cast<std::uint32_t>(slot));
+        return INVALID_CODETYPE;
+    }
+};
+
+// Open addressing hash table with linear probing. The table starts small and
+// doubles when it gets half full, so its size follows the number of strings
+// actually stored, not DICT_SIZE.
+template<unsigned DICT_SIZE_POW>
+class LZWHashDictionary
+{
+public:
+    using CodeType = typename LZWDictionaryTraits<DICT_SIZE_POW>::CodeType;
+    static constexpr CodeType INVALID_CODETYPE = LZWDictionaryTraits<DICT_SIZE_POW>::INVALID_CODETYPE;
+
+private:
+    static constexpr std::size_t DICT_SIZE = LZWDictionaryTraits<DICT_SIZE_POW>::DICT_SIZE;
+    static constexpr unsigned MIN_CAPACITY_POW = std::min(12U, DICT_SIZE_POW + 1);
+    static constexpr unsigned MAX_CAPACITY_POW = DICT_SIZE_POW + 1;
+    static constexpr CodeType EMPTY_SLOT = 0;
+
+    struct Slot
+    {
+        CodeType prefix;
+        CodeType code; // EMPTY_SLOT if the slot is free
+        std::uint8_t chr;
+    };
+
+    std::vector<Slot> slots;
+    std::size_t slotsUsed = 0;
+    unsigned capacityPow = MIN_CAPACITY_POW;
+
+    std::size_t slotIndex(CodeType prefix, std::uint8_t chr) const
+    {
+        constexpr std::uint64_t GOLDEN_RATIO = 0x9E3779B97F4A7C15ULL;
+        std::uint64_t key = (static_cast<std::uint64_t>(prefix) << CHAR_BIT) | chr;
+        return (key * GOLDEN_RATIO) >> (64U - capacityPow); // NOLINT
+    }
+
+    void grow()
+    {
+        std::vector<Slot> old(1ULL << (capacityPow + 1), Slot{0, EMPTY_SLOT, 0});
+        old.swap(slots);
+        ++capacityPow;
+        const std::size_t mask = slots.size() - 1;
+        for(const Slot &cur : old)
+        {
+            if(cur.code == EMPTY_SLOT)
+            {
+                continue;
+            }
+            std::size_t idx = slotIndex(cur.prefix, cur.chr);
+            while(slots[idx].code != EMPTY_SLOT)
+            {
+                idx = (idx + 1) & mask;
+            }
+            slots[idx] = cur;
+        }
+    }
+
+public:
+    LZWHashDictionary() : slots(1ULL << MIN_CAPACITY_POW, Slot{0, EMPTY_SLOT, 0}) {}
+
+    static std::size_t memoryBound(std::size_t entries)
+    {
+        unsigned pow = MIN_CAPACITY_POW;
+        while(pow < MAX_CAPACITY_POW && (1ULL << pow) < 2 * entries)
+        {
+            ++pow;
+        }
+        // grow() holds the old table and the new one, twice as large
+        return (1ULL << pow) * sizeof(Slot) * 3 / 2;
+    }
+
+    std::size_t memoryUsage() const
+    {
+        return slots.capacity() * sizeof(Slot);
+    }
+
+    void reset()
+    {
+        std::fill(slots.begin(), slots.end(), Slot{0, EMPTY_SLOT, 0});
+        slotsUsed = 0;
+    }
+
+    CodeType findOrInsert(CodeType prefix, std::uint8_t chr, CodeType new_code)
+    {
+        if(2 * (slotsUsed + 1) > slots.size() && capacityPow < MAX_CAPACITY_POW)
+        {
+            grow();
+        }
+        const std::size_t mask = slots.size() - 1;
+        std::size_t idx = slotIndex(prefix, chr);
+        while(true)
+        {
+            Slot &cur = slots[idx];
+            if(cur.code == EMPTY_SLOT)
+            {
+                cur = Slot{prefix, new_code, chr};
+                ++slotsUsed;
+                return INVALID_CODETYPE;
+            }
+            if(cur.prefix == prefix && cur.chr == chr)
+            {
+                return cur.code;
+            }
+            idx = (idx + 1) & mask;
+        }
+    }
+};
+
+// Dense tables are used while they stay small (up to 2 MiB).
+constexpr unsigned LZW_DENSE_DICT_MAX_POW = 12;
+
+template<unsigned DICT_SIZE_POW>
+using LZWDictionary = std::conditional_t<(DICT_SIZE_POW <= LZW_DENSE_DICT_MAX_POW),
+                                         LZWDenseDictionary<DICT_SIZE_POW>,
+                                         LZWHashDictionary<DICT_SIZE_POW>>;
@@ -1,6 +1,10 @@
 #pragma once
 
+#include "byte_histogram.hpp"
 #include "compressor_base.hpp"
+#include "free_space_map.hpp"
+#include "memory_budget.hpp"
+#include "spill_buffer.hpp"
 #include <array>
 #include <boost/none.hpp>
 #include <cassert>
@@ -9,15 +13,24 @@
 #include <fstream>
 #include <functional>
 #include <istream>
+#include <limits>
 #include <memory>
 #include <mutex>
+#include <set>
+#include <string>
 #include <boost/optional.hpp>
 #include <boost/optional/optional.hpp>
 #include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 // also ... only little endian
 
-// NB!: const operations are *NOT* thread safe!
+class ArchiveReader;
+
+// NB!: const operations are *NOT* thread safe! See ArchiveReader for
+// concurrent reads.
 class ArchiveParser
 {
 public:
@@ -32,15 +45,51 @@ public:
         enum class Algorithm : std::uint8_t
         {
             none = 0,
-            LZW
+            LZW,
+            // LZW in independently compressed blocks, see LZW_block.hpp.
+            // Takes the same options as LZW.
+            blockLZW,
+            // NONE or LZW, picked per file by addFile (see resolve). Takes
+            // the LZW options, it is never stored in an entry.
+            automatic = 0xFF
         };
+        // LZW options: level (0-9) in the low nibble, optionally ORed with
+        // LZW_VARIABLE_WIDTH. Entries written without the flag use fixed
+        // width codes, so older archives decode unchanged.
+        static constexpr unsigned LZW_VARIABLE_WIDTH = 0x10;
+
         Algorithm m_alg;
         std::uint8_t m_algOptions;
+        // threads used by blockLZW, 0 is one per hardware thread.
+        // Not stored in the archive, the output does not depend on it.
+        unsigned m_threads = 0;
+        // entries compressed at the same time with this strategy, each with
+        // its own dictionaries (see ParallelIngest). Not stored either.
+        unsigned m_concurrentEntries = 1;
         CompressionStrategy() : CompressionStrategy("NONE", 0) { }
         CompressionStrategy(const char *alg, unsigned options);
         CompressionStrategy(std::uint8_t alg, unsigned options);
-        std::unique_ptr<Compressor> getCompressor(std::ostream &out) const;
-        std::unique_ptr<Decompressor> getDecompressor(std::ostream &out) const;
+        // sizeHint - the input size if it is known, it bounds the memory
+        // reserved for the dictionary (see memory_budget.hpp)
+        std::unique_ptr<Compressor> getCompressor(std::ostream &out, std::size_t sizeHint = 0) const;
+        std::unique_ptr<Decompressor> getDecompressor(std::ostream &out, std::size_t sizeHint = 0) const;
+        std::unique_ptr<PushCompressor> getPushCompressor(ByteSink &out, std::size_t sizeHint = 0) const;
+        // budget - where the decompressor reserves its dictionaries
+        std::unique_ptr<PushDecompressor> getPushDecompressor(ByteSink &out, std::size_t sizeHint = 0,
+                                                              MemoryBudget &budget = MemoryBudget::global()) const;
+        // upper bound of the dictionaries getPushDecompressor reserves for an
+        // entry of compressedSize bytes
+        std::size_t decompressorMemoryBound(std::uint64_t compressedSize) const;
+        // Lowers the LZW level while a smaller dictionary still never fills
+        // up on fileSize bytes, then while the dictionaries of all
+        // concurrent entries and blocks do not fit in memoryBudget. The
+        // level is stored in the entry, so extraction gets the smaller
+        // dictionary too.
+        CompressionStrategy clampLevel(std::uint64_t fileSize, std::size_t memoryBudget) const;
+        // For automatic: NONE if the sampled bytes look random (already
+        // compressed data), otherwise LZW with a level that fits how
+        // redundant they are. Other strategies are returned unchanged.
+        CompressionStrategy resolve(const ByteHistogram &sample) const;
         std::uint8_t getAlgVal() const
         {
             return static_cast<std::uint8_t>(m_alg);
@@ -52,6 +101,41 @@ public:
         const char* getAlgStr() const;
     };
 
+    // addFile stops compressing a file that does not shrink and stores it
+    struct EarlyAbortPolicy
+    {
+        // input bytes compressed before the ratio is checked, 0 disables it
+        std::size_t probeWindow = 1024 * 1024;
+        // compressed / input size above which the file is stored
+        double maxRatio = 1.0;
+    };
+
+    // addFileStream keeps the raw input of a stream that is being compressed,
+    // so it can still store the entry if compression does not pay off
+    struct SpillPolicy
+    {
+        // raw bytes kept in memory, the rest goes to a temporary file
+        std::size_t memoryLimit = 16 * 1024 * 1024;
+        // raw bytes kept at all, 0 keeps only the early abort window
+        std::uint64_t maxSize = 0;
+        // where the temporary file is created, the system temp dir if empty
+        std::string tempDir;
+    };
+
+    struct ArchiveStats
+    {
+        std::size_t entries;
+        // bytes of the archive
+        std::uint64_t logicalSize;
+        // bytes the archive takes on disk, logicalSize if it is not a file
+        std::uint64_t physicalSize;
+        // bytes in the holes between the entries
+        std::uint64_t freeBytes;
+        std::size_t holes;
+        // bytes given back to the file system by deletes since opening
+        std::uint64_t punchedBytes;
+    };
+
 private:
 
     // typedefs
@@ -61,13 +145,22 @@ private:
     static constexpr unsigned M_MAGIC_SIZE = 8;
     static constexpr std::array<char, M_MAGIC_SIZE> M_FORMAT_MAGIC = 
                     { 'P', 'a', 'c', 'o', 'Z', 'I', 'P', 'P'};
+    // version 0: the entries are only a linked list
+    // version 1: the list plus a central directory, see writeDirectory
+    static constexpr std::uint16_t M_LATEST_VERSION = 1;
     // structs
     struct archiveHeader
     {
         uint16_t header_version;
         uint16_t _reserved;
         FileOffsetType first_file_pos;
-        static constexpr unsigned FIRST_FILE_FIELD_POS = M_MAGIC_SIZE + sizeof(header_version);
+        // version 1 only, directory_pos is zero while the directory in the
+        // archive is not up to date
+        FileOffsetType directory_pos;
+        FileOffsetType directory_size;
+        static constexpr unsigned V0_SIZE = M_MAGIC_SIZE + sizeof(header_version) +
+            sizeof(_reserved) + sizeof(first_file_pos);
+        static constexpr unsigned V1_SIZE = V0_SIZE + sizeof(directory_pos) + sizeof(directory_size);
     };
 
     struct FileHeader
@@ -85,34 +178,121 @@ private:
             sizeof(file_type) + sizeof(compression_alg) + sizeof(compression_alg_args);
     };
 
+    // an entry of the central directory, next_file_pos is kept in sync too
+    struct DirectoryEntry
+    {
+        FileHeader header;
+        std::string name;
+        // handle of the entry in m_nameIndex, ascends in list order
+        std::uint64_t seq = 0;
+    };
+
+    // what beginBatch holds back until commit
+    struct Batch
+    {
+        // the state abort goes back to
+        archiveHeader header;
+        std::vector<DirectoryEntry> directory;
+        bool directoryOnDisk;
+        FileOffsetType dataEnd;
+        // size of the archive file, 0 if it was opened from a stream
+        FileOffsetType archiveSize;
+        // where the new entries start, behind the data and the central directory
+        FileOffsetType base;
+        // file headers written in the batch, by position
+        std::set<FileOffsetType> dirtyHeaders;
+        bool headerDirty = false;
+        // (offset, size) freed in the batch, only reused after commit
+        std::vector<std::pair<FileOffsetType, FileOffsetType>> released;
+        std::vector<std::pair<FileOffsetType, FileOffsetType>> punched;
+    };
+
     // member variables
     std::fstream m_archiveStrg;
     std::reference_wrapper<std::iostream> m_archive;
+    // empty if the archive was opened from a stream
+    std::string m_archivePath;
     archiveHeader m_archiveHeader;
-    FileOffsetType m_lastFilePos = 0;
+    // every entry in list order
+    std::vector<DirectoryEntry> m_directory;
+    // name -> seq of its entry, the first entry if a name repeats; a delete
+    // only touches its own name, the position is found by entryIndex
+    std::unordered_map<std::string, std::uint64_t> m_nameIndex;
+    std::uint64_t m_nextSeq = 0;
+    // some name is in the list more than once, only in damaged archives
+    bool m_repeatedNames = false;
+    // holes between the entries
+    FreeSpaceMap m_freeSpace;
+    // end of the header or of the last entry in the file
+    FileOffsetType m_dataEnd = 0;
+    // the directory in the archive matches m_directory
+    bool m_directoryOnDisk = false;
     CompressionStrategy m_defaultCompStr;
-    bool m_lastFilePosValid = false;
+    mutable std::size_t m_lastPeakDictMemory = 0;
+    EarlyAbortPolicy m_earlyAbort;
+    std::size_t m_earlyAbortCount = 0;
+    SpillPolicy m_spill;
+    std::uint64_t m_punchedBytes = 0;
+    // set between beginBatch and commit or abort
+    std::unique_ptr<Batch> m_batch;
 
     // private member functions
     // all of these expect global_lock to be held
     void readArchiveHeader();
     void writeArchiveHeader();
-
-    FileHeader readFileHeader(FileOffsetType file_pos) const;
+    // buf holds V1_SIZE bytes, returns the size of the header for its version
+    static std::size_t encodeArchiveHeader(const archiveHeader &head, std::uint8_t *buf);
+    // size - bytes available in buf, throws if they are not an archive header
+    static archiveHeader decodeArchiveHeader(const std::uint8_t *buf, std::size_t size);
+
+    // buf holds HEADER_SIZE bytes of the header at file_pos
+    static void encodeFileHeader(const FileHeader &fih, std::uint8_t *buf);
+    static FileHeader decodeFileHeader(const std::uint8_t *buf, FileOffsetType file_pos);
+    class HeaderReadAhead;
     void writeFileHeader(const FileHeader &fih);
 
-    FileOffsetType getLastFilePos() const;
-    void updateLastFilePos(FileOffsetType new_last);
-    void calcCrcFileEntry(FileHeader &header, const char *name, std::istream &file, std::size_t file_size);
+    // fills m_directory from the central directory if it is up to date,
+    // otherwise by walking the list
+    void loadDirectory();
+    bool readDirectory();
+    // buf holds the whole directory, false if it is damaged
+    static bool decodeDirectory(const std::vector<std::uint8_t> &buf, FileOffsetType first_file_pos,
+                                std::vector<DirectoryEntry> &entries, FreeSpaceMap &holes);
+    void writeDirectory();
+    // called before the archive is changed
+    void invalidateDirectory();
+    // numbers the entries in list order and indexes their names
+    void rebuildNameIndex();
+    // index in m_directory of the entry with seq
+    std::size_t entryIndex(std::uint64_t seq) const;
+    // m_freeSpace and m_dataEnd from the entries
+    void rebuildFreeSpace();
+    // data_crc is the CRC32 of the file_size bytes of data
+    void calcCrcFileEntry(FileHeader &header, const char *name, std::uint32_t data_crc);
     void calcCrcFolderEntry(FileHeader &header, const char *name);
     bool verifyCrcFileEntry(const FileHeader &header) const;
 
     static FileOffsetType calculateFileEntrySize(std::size_t name_size, std::size_t file_size);
-    FileOffsetType allocateFileEntrySpace(std::size_t file_entry_size) const;
-    void writeFileEntry (const FileHeader &header, const char *name, std::istream &file, std::size_t file_size);
+    // best fit among the holes, otherwise the end of the data
+    FileOffsetType allocateFileEntrySpace(FileOffsetType file_entry_size);
+    void releaseFileEntrySpace(FileOffsetType pos, FileOffsetType size);
+    // copies the entry at index to newPos and links it there
+    void moveFileEntry (std::size_t index, FileOffsetType newPos, std::vector<std::uint8_t> &buf);
+    // writes the entries back to back into the empty archive dest
+    void copyEntriesTo (ArchiveParser &dest) const;
+    // appends an entry whose header is already written to the list
+    void linkFileEntry (const FileHeader &header, const char *name);
     void writeFolderEntry (const FileHeader &header, const char *name);
+    // Compresses file straight into a newly allocated entry in one pass:
+    // the data is checksummed as it is written and the header is written last.
+    // sourcePath - where file was opened from, lets an entry that was
+    // compressed in full but did not shrink be copied inside the kernel,
+    // may be nullptr
+    void ingestFile (const char *name, std::istream &file, const CompressionStrategy &requested_comps,
+                     const char *sourcePath = nullptr);
+    // throws if name can not be added, returns its length
+    std::size_t checkNewFileName (const char *name) const;
 
-    std::string readFileName (const FileHeader &header) const;
     void readAndDecompressFileContents (const FileHeader &header, std::ostream &out) const;
 
     bool checkArchiveConsistency() const;
@@ -126,11 +306,12 @@ public:
     private:
         const ArchiveParser *m_archive;
         FileHeader m_fileHeader;
+        std::string m_fileName;
 
         FileInfo() : m_archive(nullptr), m_fileHeader() {} // zero is invalid position
 
-        FileInfo(const ArchiveParser &archive, FileOffsetType filePos) 
-            : m_archive(&archive), m_fileHeader(m_archive->readFileHeader(filePos))
+        FileInfo(const ArchiveParser &archive, const DirectoryEntry &entry)
+            : m_archive(&archive), m_fileHeader(entry.header), m_fileName(entry.name)
         { }
 
     public:
@@ -138,7 +319,7 @@ public:
         std::string getFileName() const
         {
             assert(m_archive != nullptr);
-            return m_archive->readFileName(m_fileHeader);
+            return m_fileName;
         }
 
         void readFile(std::ostream &out) const
@@ -187,12 +368,15 @@ public:
     class FileIterator
     {
     private:
+        static constexpr std::size_t BEFORE_BEGIN = std::numeric_limits<std::size_t>::max();
+
         const ArchiveParser &m_archive;
-        FileOffsetType m_filePos;
+        // index in m_directory
+        std::size_t m_index;
         FileInfo m_fileInfo;
 
-        FileIterator(const ArchiveParser &archive, FileOffsetType filePos)
-            : m_archive(archive), m_filePos(filePos)
+        FileIterator(const ArchiveParser &archive, std::size_t index)
+            : m_archive(archive), m_index(index)
         { }
 
     public:
@@ -200,7 +384,7 @@ public:
         bool operator== (const FileIterator &other) const
         {
             assert(&m_archive == &other.m_archive);
-            return m_filePos == other.m_filePos;
+            return m_index == other.m_index;
         }
 
         bool operator!= (const FileIterator &other) const
@@ -241,12 +425,27 @@ public:
     static ArchiveParser MakeArchive(const char *archivePath);
     static ArchiveParser MakeArchive(std::iostream &archive);
 
+    // m_archive may refer to m_archiveStrg of other
     ArchiveParser(ArchiveParser &&other) noexcept
         : m_archiveStrg(std::move(other.m_archiveStrg)),
-          m_archive(other.m_archive), 
+          m_archive(&other.m_archive.get() == &other.m_archiveStrg ? m_archiveStrg : other.m_archive.get()),
+          m_archivePath(std::move(other.m_archivePath)),
           m_archiveHeader(other.m_archiveHeader),
-          m_lastFilePos(other.m_lastFilePos),
-          m_lastFilePosValid(other.m_lastFilePosValid)
+          m_directory(std::move(other.m_directory)),
+          m_nameIndex(std::move(other.m_nameIndex)),
+          m_nextSeq(other.m_nextSeq),
+          m_repeatedNames(other.m_repeatedNames),
+          m_freeSpace(std::move(other.m_freeSpace)),
+          m_dataEnd(other.m_dataEnd),
+          // the moved from parser has nothing to write
+          m_directoryOnDisk(std::exchange(other.m_directoryOnDisk, true)),
+          m_defaultCompStr(other.m_defaultCompStr),
+          m_lastPeakDictMemory(other.m_lastPeakDictMemory),
+          m_earlyAbort(other.m_earlyAbort),
+          m_earlyAbortCount(other.m_earlyAbortCount),
+          m_spill(std::move(other.m_spill)),
+          m_punchedBytes(other.m_punchedBytes),
+          m_batch(std::move(other.m_batch))
     {
     }
     ArchiveParser(const ArchiveParser &) = delete;
@@ -254,11 +453,34 @@ public:
     void swap(ArchiveParser &other)
     {
         using std::swap;
+        bool ownsStrg = &m_archive.get() == &m_archiveStrg;
+        bool otherOwnsStrg = &other.m_archive.get() == &other.m_archiveStrg;
         swap(m_archiveStrg, other.m_archiveStrg);
         swap(m_archive, other.m_archive);
+        if(otherOwnsStrg)
+        {
+            m_archive = m_archiveStrg;
+        }
+        if(ownsStrg)
+        {
+            other.m_archive = other.m_archiveStrg;
+        }
+        swap(m_archivePath, other.m_archivePath);
         swap(m_archiveHeader, other.m_archiveHeader);
-        swap(m_lastFilePos, other.m_lastFilePos);
-        swap(m_lastFilePosValid, other.m_lastFilePosValid);
+        swap(m_directory, other.m_directory);
+        swap(m_nameIndex, other.m_nameIndex);
+        swap(m_nextSeq, other.m_nextSeq);
+        swap(m_repeatedNames, other.m_repeatedNames);
+        swap(m_freeSpace, other.m_freeSpace);
+        swap(m_dataEnd, other.m_dataEnd);
+        swap(m_directoryOnDisk, other.m_directoryOnDisk);
+        swap(m_defaultCompStr, other.m_defaultCompStr);
+        swap(m_lastPeakDictMemory, other.m_lastPeakDictMemory);
+        swap(m_earlyAbort, other.m_earlyAbort);
+        swap(m_earlyAbortCount, other.m_earlyAbortCount);
+        swap(m_spill, other.m_spill);
+        swap(m_punchedBytes, other.m_punchedBytes);
+        swap(m_batch, other.m_batch);
     }
 
     ArchiveParser &operator=(ArchiveParser &&other) noexcept
@@ -267,7 +489,29 @@ public:
         return *this;
     }
     ArchiveParser &operator=(const ArchiveParser &) = delete; 
-    ~ArchiveParser() = default; // TODO: flush file header
+    // writes the central directory, errors are ignored, call flush() to see them;
+    // a batch that is not committed is aborted
+    ~ArchiveParser();
+
+    // writes the central directory if it changed and flushes the archive,
+    // in a batch only the entries written so far are flushed
+    void flush();
+
+    // Starts a batch of adds and deletes. Until commit only the data of the
+    // new entries is written: they are laid out back to back behind the data
+    // and the central directory, while the file headers they link and the
+    // archive header are kept in memory. commit writes those in one pass in
+    // file order; abort drops the batch and leaves the archive as it was.
+    // Space freed in a batch is reused after commit. Batches do not nest
+    // and compact can not be called in one.
+    void beginBatch();
+    void commit();
+    void abort();
+
+    bool inBatch() const
+    {
+        return m_batch != nullptr;
+    }
 
     const_iterator cbefore_begin() const;
     const_iterator cbegin() const;
@@ -300,7 +544,9 @@ public:
     }
 
     const_iterator findFile(const char *name) const;
-    void deleteAfter(const_iterator pos);
+    // reclaimSpace - also give the disk blocks of the entry back to the file
+    // system, see punchFileHole; only for archives opened from a path
+    void deleteAfter(const_iterator pos, bool reclaimSpace = false);
 
     void setDefaultCompressionStrategy(const CompressionStrategy &comp)
     {
@@ -312,17 +558,121 @@ public:
         return m_defaultCompStr;
     }
 
+    void setEarlyAbortPolicy(const EarlyAbortPolicy &policy)
+    {
+        m_earlyAbort = policy;
+    }
+
+    EarlyAbortPolicy getEarlyAbortPolicy() const
+    {
+        return m_earlyAbort;
+    }
+
+    // files whose compression was aborted and that were stored instead
+    std::size_t getEarlyAbortCount() const
+    {
+        return m_earlyAbortCount;
+    }
+
+    void setSpillPolicy(const SpillPolicy &policy)
+    {
+        m_spill = policy;
+    }
+
+    SpillPolicy getSpillPolicy() const
+    {
+        return m_spill;
+    }
+
     void addFile(const char *name, std::istream &file, const CompressionStrategy &comps, const char *tempFilePath="");
     void addFile(const char *name, std::istream &file, const CompressionStrategy &comps, std::iostream &temp_file);
     void addFile(const char *name, std::istream &file)
     {
         addFile(name, file, getDefaultCompressionStrategy());
     }
+    // Adds the file at filePath. If the archive was opened from a path and
+    // the whole file was compressed without shrinking, it is stored by a
+    // kernel copy (copyFileRange) with the checksum from the compression
+    // pass; every other stored file is copied once through a buffer.
+    void addFileFromPath(const char *name, const char *filePath, const CompressionStrategy &comps);
+    void addFileFromPath(const char *name, const char *filePath)
+    {
+        addFileFromPath(name, filePath, getDefaultCompressionStrategy());
+    }
+    // Adds the rest of file without seeking in it or knowing its size
+    // (pipes, sockets, generated data). The entry is appended at the end of
+    // the archive and its header is written once the stream ends. The entry
+    // is stored instead if it does not shrink, within the limits of the
+    // early abort window and the SpillPolicy.
+    void addFileStream(const char *name, std::istream &file, const CompressionStrategy &comps);
+    void addFileStream(const char *name, std::istream &file)
+    {
+        addFileStream(name, file, getDefaultCompressionStrategy());
+    }
+
+    // A file compressed apart from any archive by prepareFile
+    class PreparedFile
+    {
+    private:
+        std::string m_name;
+        CompressionStrategy m_comps;
+        std::unique_ptr<SpillBuffer> m_data;
+        std::uint32_t m_dataCrc = 0;
+        std::size_t m_peakDictMemory = 0;
+        bool m_earlyAborted = false;
+
+        PreparedFile() = default;
+
+    public:
+        const std::string& getFileName() const
+        {
+            return m_name;
+        }
+
+        std::uint64_t getCompressedFileSize() const
+        {
+            return m_data->size();
+        }
+
+        CompressionStrategy getCompressionStrg() const
+        {
+            return m_comps;
+        }
+
+        friend class ArchiveParser;
+    };
+
+    // Compresses file for the entry name the way addFile does, but into
+    // memory and, past spill.memoryLimit, a temporary file. No archive is
+    // involved, so any number of threads may prepare files at once and the
+    // archive only copies the result in with addPreparedFile.
+    static PreparedFile prepareFile(const char *name, std::istream &file, const CompressionStrategy &comps,
+                                    const EarlyAbortPolicy &earlyAbort, const SpillPolicy &spill);
+    void addPreparedFile(PreparedFile &&file);
     void addFolder(const char *name);
     void readFile(const char *name, std::ostream &out) const;
-    void deleteFile(const char *name);
+    void deleteFile(const char *name, bool reclaimSpace = false);
     fileType getFileType(const char *name) const;
 
     bool verify() const;
+
+    ArchiveStats getStats() const;
+
+    // Rewrites the entries back to back in list order, the payloads are
+    // copied as they are. An archive opened from a path is truncated after
+    // the last entry (and the central directory).
+    void compact();
+    // Writes a compacted copy of the archive into a new archive.
+    void compactTo(const char *archivePath) const;
+    void compactTo(std::iostream &archive) const;
+
+    // peak dictionary memory of the last file compressed or extracted
+    std::size_t getLastPeakDictMemory() const
+    {
+        return m_lastPeakDictMemory;
+    }
+
+    // shares the on-disk format
+    friend class ArchiveReader;
 };
 
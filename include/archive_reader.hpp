@@ -0,0 +1,167 @@
+#pragma once
+
+#include "archive_parser.hpp"
+
+#include <boost/optional.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Read-only handle to an archive whose const operations are thread safe.
+// The entry list is loaded once by the constructor, after that every read
+// is a positional pread on the file descriptor or a read of a read-only
+// mapping (see Backend): no seek position or buffer is shared, so any
+// number of threads may look up and extract entries at the same time.
+// An extraction waits until its decoder fits in MemoryBudget::global().
+// The archive must not be changed while the reader is open.
+// POSIX only.
+class ArchiveReader
+{
+public:
+    using fileType = ArchiveParser::fileType;
+    using CompressionStrategy = ArchiveParser::CompressionStrategy;
+
+    // How the archive is read.
+    // pread - positional reads into buffers of each call
+    // map - the whole archive is mapped read-only: headers and names are
+    //       decoded in place and payloads are handed to the decompressors
+    //       straight from the mapping. Truncating the file while it is
+    //       mapped makes reads of the lost pages fail with SIGBUS.
+    enum class Backend
+    {
+        pread,
+        map
+    };
+
+    // contiguous bytes of the archive, valid while the reader is alive
+    struct ByteView
+    {
+        const std::uint8_t *data;
+        std::size_t size;
+    };
+
+    class Entry
+    {
+    private:
+        const ArchiveReader *m_reader;
+        std::size_t m_index;
+
+        Entry(const ArchiveReader &reader, std::size_t index)
+            : m_reader(&reader), m_index(index)
+        { }
+
+    public:
+        const std::string& getFileName() const;
+        fileType getFileType() const;
+        std::uint64_t getCompressedFileSize() const;
+        CompressionStrategy getCompressionStrg() const;
+        // the contents of a stored (NONE) file without a copy, only with
+        // the map backend
+        boost::optional<ByteView> getStoredData() const;
+
+        void readFile(std::ostream &out) const
+        {
+            m_reader->readEntry(m_index, out);
+        }
+
+        // Writes the contents at the file position of outFd and moves it
+        // past them. Stored files are copied inside the kernel when outFd
+        // is a seekable file, see copyFileRange.
+        void readFile(int outFd) const
+        {
+            m_reader->readEntry(m_index, outFd);
+        }
+
+        bool verify() const
+        {
+            return m_reader->verifyEntry(m_index);
+        }
+
+        friend class ArchiveReader;
+    };
+
+private:
+    // what is loaded once and shared by reopened readers
+    struct Catalog
+    {
+        // every entry in list order
+        std::vector<ArchiveParser::DirectoryEntry> entries;
+        // name -> index in entries, the first entry if a name repeats
+        std::unordered_map<std::string, std::size_t> nameIndex;
+    };
+
+    int m_fd;
+    bool m_ownsFd;
+    // empty if the reader was opened from a file descriptor
+    std::string m_path;
+    Backend m_backend;
+    std::uint64_t m_archiveSize = 0;
+    // the whole archive with Backend::map, nullptr otherwise
+    const std::uint8_t *m_map = nullptr;
+    std::shared_ptr<const Catalog> m_catalog;
+    // see setBlockThreads
+    unsigned m_blockThreads = 0;
+
+    // a reader of other's archive through fd
+    ArchiveReader(const ArchiveReader &other, int fd);
+
+    void load();
+    void mapArchive();
+    void unmap();
+    // throws unless all size bytes at pos are read
+    void readAt(std::uint64_t pos, std::uint8_t *buf, std::size_t size) const;
+    // size bytes at pos, from the mapping or read into buf
+    const std::uint8_t* fetch(std::uint64_t pos, std::size_t size, std::vector<std::uint8_t> &buf) const;
+    // bytes of an entry handed to a decompressor or CRC at once
+    std::size_t chunkSize() const;
+    void readEntry(std::size_t index, std::ostream &out) const;
+    void readEntry(std::size_t index, int outFd) const;
+    void decompressEntry(std::size_t index, ByteSink &out) const;
+    bool verifyEntry(std::size_t index) const;
+
+public:
+    explicit ArchiveReader(const char *archivePath, Backend backend = Backend::pread);
+    // fd is not closed by the reader, it has to stay open while the reader is used
+    explicit ArchiveReader(int fd, Backend backend = Backend::pread);
+
+    ArchiveReader(const ArchiveReader&) = delete;
+    ArchiveReader& operator= (const ArchiveReader&) = delete;
+    ArchiveReader(ArchiveReader &&other) noexcept;
+    ArchiveReader& operator= (ArchiveReader&&) = delete;
+    ~ArchiveReader();
+
+    // Another reader of the same archive with its own file descriptor, so
+    // with its own kernel read-ahead, that shares the entry list. A reader
+    // opened from a descriptor gets a duplicate of it. Throws if the size
+    // of the archive changed.
+    ArchiveReader reopen() const;
+
+    // Threads that decompress the blocks of a BLOCK_LZW entry, 0 for one per
+    // hardware thread (see LZW_block.hpp). Callers that extract an entry per
+    // thread pass 1. Not thread safe, set it before reading.
+    void setBlockThreads(unsigned threads)
+    {
+        m_blockThreads = threads;
+    }
+
+    std::size_t size() const
+    {
+        return m_catalog->entries.size();
+    }
+
+    // the entries in list order
+    Entry operator[] (std::size_t index) const
+    {
+        return Entry(*this, index);
+    }
+
+    boost::optional<Entry> findFile(const char *name) const;
+    void readFile(const char *name, std::ostream &out) const;
+    fileType getFileType(const char *name) const;
+
+    bool verify() const;
+};
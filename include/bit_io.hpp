@@ -0,0 +1,158 @@
+#pragma once
+
+#include "compressor_base.hpp"
+
+#include <cassert>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// LSB first bit packing, the format of the LZW code stream.
+// Work only on little endian (the 64 bit words are copied with memcpy).
+
+// Packs codes into a block buffer and hands full blocks to a ByteSink.
+// Every put stores the whole 64 bit accumulator and then advances by the
+// number of complete bytes in it, so there is no per-byte loop.
+class BitPacker
+{
+private:
+    static constexpr std::size_t WORD_SIZE = sizeof(std::uint64_t);
+
+    ByteSink &out;
+    std::vector<std::uint8_t> block;
+    std::size_t blockPos = 0;
+    std::size_t blockSize;
+    std::uint64_t bitsBuffer = 0;
+    unsigned bitsBufferSize = 0; // always < 8 between calls
+
+    void storeWord()
+    {
+        std::memcpy(block.data() + blockPos, &bitsBuffer, WORD_SIZE);
+        // at most 7 + 32 bits are buffered, so this is at most 4 bytes
+        unsigned bytes = bitsBufferSize >> 3U;
+        blockPos += bytes;
+        bitsBuffer >>= bytes << 3U;
+        bitsBufferSize &= 7U;
+        if(blockPos >= blockSize)
+        {
+            flushBlock();
+        }
+    }
+
+public:
+    explicit BitPacker(ByteSink &_out, std::size_t _blockSize = 64 * 1024) // NOLINT
+        : out(_out), block(_blockSize + WORD_SIZE), blockSize(_blockSize)
+    { }
+
+    // bitsSize <= 32
+    void put(std::uint64_t bits, unsigned bitsSize)
+    {
+        assert(bitsSize <= 32 && (bits >> bitsSize) == 0); // NOLINT
+        bitsBuffer |= bits << bitsBufferSize;
+        bitsBufferSize += bitsSize;
+        storeWord();
+    }
+
+    template<unsigned BITS_SIZE>
+    void put(std::uint64_t bits)
+    {
+        static_assert(BITS_SIZE > 0 && BITS_SIZE <= 32, ""); // NOLINT
+        put(bits, BITS_SIZE);
+    }
+
+    // pads the last byte with zeroes
+    void finish()
+    {
+        if(bitsBufferSize != 0)
+        {
+            block[blockPos++] = static_cast<std::uint8_t>(bitsBuffer & 0xFFU);
+            bitsBuffer = 0; bitsBufferSize = 0;
+        }
+        flushBlock();
+    }
+
+    void flushBlock()
+    {
+        if(blockPos != 0)
+        {
+            out.write(block.data(), blockPos);
+            blockPos = 0;
+        }
+    }
+};
+
+// Reads codes from the buffers passed to attach(). While at least 8 bytes
+// are left the accumulator is refilled with one 64 bit load, only the tail
+// of a buffer is read byte by byte. Bits left over at the end of a buffer
+// stay in the accumulator for the next one.
+class BitUnpacker
+{
+private:
+    const std::uint8_t *cur = nullptr;
+    const std::uint8_t *end = nullptr;
+    std::uint64_t bitsBuffer = 0;
+    unsigned bitsBufferSize = 0;
+
+    void refill()
+    {
+        if(end - cur >= static_cast<std::ptrdiff_t>(sizeof(std::uint64_t)))
+        {
+            std::uint64_t word; // NOLINT
+            std::memcpy(&word, cur, sizeof(word));
+            unsigned bytes = (63U - bitsBufferSize) >> 3U; // NOLINT
+            std::uint64_t mask = (1ULL << (bytes << 3U)) - 1U;
+            bitsBuffer |= (word & mask) << bitsBufferSize;
+            cur += bytes; // NOLINT
+            bitsBufferSize += bytes << 3U;
+            return;
+        }
+        while(cur != end && bitsBufferSize <= 64 - 8) // NOLINT
+        {
+            bitsBuffer |= static_cast<std::uint64_t>(*cur++) << bitsBufferSize; // NOLINT
+            bitsBufferSize += 8;
+        }
+    }
+
+public:
+    void attach(const std::uint8_t *data, std::size_t size)
+    {
+        assert(cur == end);
+        cur = data;
+        end = data + size; // NOLINT
+    }
+
+    // true if a code of bitsSize bits can be read from what was attached
+    bool canGet(unsigned bitsSize)
+    {
+        if(bitsBufferSize < bitsSize)
+        {
+            refill();
+        }
+        return bitsBufferSize >= bitsSize;
+    }
+
+    // bitsSize <= 32, canGet(bitsSize) must be true
+    std::uint32_t get(unsigned bitsSize)
+    {
+        assert(bitsBufferSize >= bitsSize);
+        auto res = static_cast<std::uint32_t>(bitsBuffer & ((1ULL << bitsSize) - 1U));
+        bitsBuffer >>= bitsSize;
+        bitsBufferSize -= bitsSize;
+        return res;
+    }
+
+    template<unsigned BITS_SIZE>
+    std::uint32_t get()
+    {
+        static_assert(BITS_SIZE > 0 && BITS_SIZE <= 32, ""); // NOLINT
+        return get(BITS_SIZE);
+    }
+
+    // what is left once all input is consumed must be zero padding
+    bool onlyPaddingLeft() const
+    {
+        return cur == end && bitsBufferSize < 8 && bitsBuffer == 0;
+    }
+};
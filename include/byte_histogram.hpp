@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <vector>
+
+// Byte frequencies and the order-0 entropy estimate that
+// ArchiveParser uses to pick a compression algorithm.
+class ByteHistogram
+{
+private:
+    std::array<std::uint64_t, 256> counts{};
+    std::uint64_t total = 0;
+
+public:
+    // Four tables are counted separately and summed at the end, so runs of
+    // the same byte do not make every increment wait for the previous one.
+    void add(const std::uint8_t *data, std::size_t size)
+    {
+        std::array<std::array<std::uint32_t, 256>, 4> part{};
+        std::size_t i = 0;
+        // the 32 bit counters can not overflow in one batch
+        constexpr std::size_t BATCH = std::size_t(1) << 30U;
+        while(i < size)
+        {
+            std::size_t end = i + std::min(size - i, BATCH);
+            for(; i + 4 <= end; i += 4)
+            {
+                ++part[0][data[i]]; // NOLINT
+                ++part[1][data[i + 1]]; // NOLINT
+                ++part[2][data[i + 2]]; // NOLINT
+                ++part[3][data[i + 3]]; // NOLINT
+            }
+            for(; i < end; i++)
+            {
+                ++part[0][data[i]]; // NOLINT
+            }
+            for(unsigned chr=0; chr<256; chr++)
+            {
+                counts[chr] += static_cast<std::uint64_t>(part[0][chr]) + part[1][chr] + part[2][chr] + part[3][chr]; // NOLINT
+                part[0][chr] = part[1][chr] = part[2][chr] = part[3][chr] = 0; // NOLINT
+            }
+        }
+        total += size;
+    }
+
+    std::uint64_t count(std::uint8_t chr) const
+    {
+        return counts[chr]; // NOLINT
+    }
+
+    std::uint64_t size() const
+    {
+        return total;
+    }
+
+    // bits per byte, 0 for an empty histogram, at most 8
+    double entropy() const
+    {
+        if(total == 0)
+        {
+            return 0;
+        }
+        double res = 0;
+        for(std::uint64_t cnt : counts)
+        {
+            if(cnt != 0)
+            {
+                double prob = static_cast<double>(cnt) / static_cast<double>(total);
+                res -= prob * std::log2(prob);
+            }
+        }
+        return res;
+    }
+};
+
+constexpr std::size_t SAMPLE_CHUNK_SIZE = 4 * 1024;
+constexpr std::size_t SAMPLE_CHUNKS = 16;
+
+// Histogram of SAMPLE_CHUNKS chunks spread evenly over the first size bytes
+// of ins (all of them if the stream is that small). ins is left at the
+// beginning.
+inline ByteHistogram sampleStream(std::istream &ins, std::size_t size)
+{
+    ByteHistogram res;
+    std::vector<std::uint8_t> buf(std::min(size, SAMPLE_CHUNK_SIZE));
+    if(size <= SAMPLE_CHUNK_SIZE * SAMPLE_CHUNKS)
+    {
+        ins.seekg(0, std::istream::beg);
+        std::size_t left = size;
+        while(left > 0)
+        {
+            std::size_t cur = std::min(left, buf.size());
+            ins.read(reinterpret_cast<char*>(buf.data()), static_cast<std::streamsize>(cur)); // NOLINT
+            res.add(buf.data(), cur);
+            left -= cur;
+        }
+    }
+    else
+    {
+        std::size_t step = size / SAMPLE_CHUNKS;
+        for(std::size_t i=0; i<SAMPLE_CHUNKS; i++)
+        {
+            ins.seekg(static_cast<std::streamoff>(i * step), std::istream::beg);
+            ins.read(reinterpret_cast<char*>(buf.data()), static_cast<std::streamsize>(buf.size())); // NOLINT
+            res.add(buf.data(), buf.size());
+        }
+    }
+    ins.seekg(0, std::istream::beg);
+    return res;
+}
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
 #include <istream>
+#include <memory>
+#include <ostream>
+#include <vector>
 
 class Compressor
 {
@@ -13,6 +19,12 @@ public:
     virtual void operator() (std::istream &ins, std::size_t read_size) = 0;
 
     virtual void finish() = 0;
+
+    // peak memory of the codec's tables (dictionary etc.), 0 if it has none
+    virtual std::size_t peakMemoryUsage() const
+    {
+        return 0;
+    }
 };
 
 class Decompressor
@@ -23,4 +35,191 @@ public:
     virtual void operator() (std::istream &ins, std::size_t read_size) = 0;
 
     virtual void finish() = 0;
+
+    virtual std::size_t peakMemoryUsage() const
+    {
+        return 0;
+    }
+};
+
+// Buffer based API
+//
+// The codec is handed contiguous buffers with feed() and writes its output
+// to a ByteSink in whole blocks. flush() marks the end of the input: all
+// buffered output is written to the sink and no more feed() calls follow.
+
+class ByteSink
+{
+public:
+    virtual ~ByteSink() = default;
+
+    virtual void write(const std::uint8_t *data, std::size_t size) = 0;
+};
+
+class OstreamSink final : public ByteSink
+{
+private:
+    std::ostream &out;
+
+public:
+    explicit OstreamSink(std::ostream &_out) : out(_out) {}
+
+    void write(const std::uint8_t *data, std::size_t size) override
+    {
+        out.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size)); // NOLINT
+    }
+};
+
+class VectorSink final : public ByteSink
+{
+public:
+    std::vector<std::uint8_t> data;
+
+    void write(const std::uint8_t *_data, std::size_t size) override
+    {
+        data.insert(data.end(), _data, _data + size); // NOLINT
+    }
+};
+
+class PushCompressor
+{
+public:
+    virtual ~PushCompressor() = default;
+
+    virtual void feed(const std::uint8_t *data, std::size_t size) = 0;
+
+    virtual void flush() = 0;
+
+    // see Compressor::peakMemoryUsage
+    virtual std::size_t peakMemoryUsage() const
+    {
+        return 0;
+    }
+};
+
+class PushDecompressor
+{
+public:
+    virtual ~PushDecompressor() = default;
+
+    virtual void feed(const std::uint8_t *data, std::size_t size) = 0;
+
+    virtual void flush() = 0;
+
+    // see Compressor::peakMemoryUsage
+    virtual std::size_t peakMemoryUsage() const
+    {
+        return 0;
+    }
+};
+
+// Adapters from the istream API to the buffer API
+
+constexpr std::size_t CODEC_STREAM_BLOCK_SIZE = 64 * 1024;
+
+template<class Codec>
+void feedFromStream(Codec &codec, std::istream &ins, std::size_t read_size)
+{
+    std::vector<std::uint8_t> buf(std::min(read_size, CODEC_STREAM_BLOCK_SIZE));
+    while(read_size > 0)
+    {
+        std::size_t cur = std::min(read_size, buf.size());
+        ins.read(reinterpret_cast<char*>(buf.data()), static_cast<std::streamsize>(cur)); // NOLINT
+        codec.feed(buf.data(), cur);
+        read_size -= cur;
+    }
+}
+
+class PushCompressorAdapter final : public Compressor
+{
+private:
+    OstreamSink sink;
+    std::unique_ptr<PushCompressor> comp;
+    bool flushed = false;
+
+public:
+    // makeComp(ByteSink&) creates the wrapped compressor
+    template<class MakeComp>
+    PushCompressorAdapter(std::ostream &out, MakeComp makeComp)
+        : sink(out), comp(makeComp(sink))
+    { }
+
+    PushCompressorAdapter(const PushCompressorAdapter&) = delete;
+    PushCompressorAdapter& operator= (const PushCompressorAdapter&) = delete;
+    PushCompressorAdapter(PushCompressorAdapter&&) = delete;
+    PushCompressorAdapter& operator= (PushCompressorAdapter&&) = delete;
+
+    ~PushCompressorAdapter() override
+    {
+        if(flushed)
+        {
+            return;
+        }
+        try
+        {
+            comp->flush();
+        } catch(...)
+        {
+
+        }
+    }
+
+    void prepare(std::istream &ins, std::size_t read_size) override
+    {
+        (void) ins;
+        (void) read_size;
+    }
+
+    void operator() (std::istream &ins, std::size_t read_size) override
+    {
+        feedFromStream(*comp, ins, read_size);
+    }
+
+    void finish() override
+    {
+        if(!flushed)
+        {
+            flushed = true;
+            comp->flush();
+        }
+    }
+
+    std::size_t peakMemoryUsage() const override
+    {
+        return comp->peakMemoryUsage();
+    }
+};
+
+// operator() decompresses a whole entry, so it also flushes
+class PushDecompressorAdapter final : public Decompressor
+{
+private:
+    OstreamSink sink;
+    std::unique_ptr<PushDecompressor> decomp;
+
+public:
+    template<class MakeDecomp>
+    PushDecompressorAdapter(std::ostream &out, MakeDecomp makeDecomp)
+        : sink(out), decomp(makeDecomp(sink))
+    { }
+
+    PushDecompressorAdapter(const PushDecompressorAdapter&) = delete;
+    PushDecompressorAdapter& operator= (const PushDecompressorAdapter&) = delete;
+    PushDecompressorAdapter(PushDecompressorAdapter&&) = delete;
+    PushDecompressorAdapter& operator= (PushDecompressorAdapter&&) = delete;
+    ~PushDecompressorAdapter() override = default;
+
+    void operator() (std::istream &ins, std::size_t read_size) override
+    {
+        feedFromStream(*decomp, ins, read_size);
+        decomp->flush();
+    }
+
+    void finish() override
+    { }
+
+    std::size_t peakMemoryUsage() const override
+    {
+        return decomp->peakMemoryUsage();
+    }
 };
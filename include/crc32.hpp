@@ -30,8 +30,75 @@ class CRC32
 		}
     }
 
+    using GF2Matrix = std::array<std::uint32_t, 32>;
+
+    static std::uint32_t gf2MatrixTimes(const GF2Matrix &mat, std::uint32_t vec)
+    {
+        std::uint32_t sum = 0;
+        for(std::size_t i = 0; vec != 0; ++i, vec >>= 1U)
+        {
+            if((vec & 1U) != 0U)
+            {
+                sum ^= mat[i]; // NOLINT
+            }
+        }
+        return sum;
+    }
+
+    static void gf2MatrixSquare(GF2Matrix &square, const GF2Matrix &mat)
+    {
+        for(std::size_t i = 0; i < mat.size(); ++i)
+        {
+            square[i] = gf2MatrixTimes(mat, mat[i]); // NOLINT
+        }
+    }
+
 public:
 
+    // CRC of A followed by B from the CRCs of A and B and the length of B
+    // (the zlib crc32_combine method)
+    static std::uint32_t combine(std::uint32_t crcA, std::uint32_t crcB, std::uint64_t lenB)
+    {
+        if(lenB == 0)
+        {
+            return crcA;
+        }
+        GF2Matrix even; // NOLINT
+        GF2Matrix odd; // NOLINT
+        // operator for one zero bit
+        odd[0] = 0xEDB88320; // NOLINT
+        std::uint32_t row = 1;
+        for(std::size_t i = 1; i < odd.size(); ++i, row <<= 1U)
+        {
+            odd[i] = row; // NOLINT
+        }
+        gf2MatrixSquare(even, odd); // two zero bits
+        gf2MatrixSquare(odd, even); // four zero bits
+
+        // apply lenB zero bytes to crcA
+        do
+        {
+            gf2MatrixSquare(even, odd);
+            if((lenB & 1U) != 0U)
+            {
+                crcA = gf2MatrixTimes(even, crcA);
+            }
+            lenB >>= 1U;
+            if(lenB == 0)
+            {
+                break;
+            }
+            gf2MatrixSquare(odd, even);
+            if((lenB & 1U) != 0U)
+            {
+                crcA = gf2MatrixTimes(odd, crcA);
+            }
+            lenB >>= 1U;
+        } while(lenB != 0);
+
+        return crcA ^ crcB;
+    }
+
     CRC32() 
     {
         precomputeTable();
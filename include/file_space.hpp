@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Disk space of files and copies between them, for the parts the standard
+// library does not cover.
+
+// Gives the disk blocks under [offset, offset + size) of the file at path
+// back to the file system, the range reads as zeros afterwards and the file
+// size does not change. Returns false where this is not supported
+// (fallocate hole punching is Linux only and not every file system has it).
+bool punchFileHole(const std::string &path, std::uint64_t offset, std::uint64_t size);
+
+// Bytes the file at path takes on disk, its size where this is not known.
+std::uint64_t allocatedFileSize(const std::string &path);
+
+// Copies size bytes of inFd from inOffset to outFd at outOffset inside the
+// kernel where it can: copy_file_range, then sendfile, then a buffered copy.
+// Throws if the input ends early. The position of inFd is not used, the
+// one of outFd may be moved.
+void copyFileRange(int inFd, std::uint64_t inOffset, int outFd, std::uint64_t outOffset, std::uint64_t size);
+void copyFileRange(const std::string &inPath, std::uint64_t inOffset,
+                   const std::string &outPath, std::uint64_t outOffset, std::uint64_t size);
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <boost/optional.hpp>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <set>
+#include <utility>
+
+// Free extents of a file, indexed by offset to merge neighbours and by
+// size to find the best fit. Both operations are O(log n).
+class FreeSpaceMap
+{
+public:
+    using OffsetType = std::uint64_t;
+
+private:
+    // offset -> size
+    std::map<OffsetType, OffsetType> byOffset;
+    // (size, offset)
+    std::set<std::pair<OffsetType, OffsetType>> bySize;
+    OffsetType totalFree = 0;
+
+    void insert(OffsetType offset, OffsetType size)
+    {
+        byOffset.emplace(offset, size);
+        bySize.emplace(size, offset);
+        totalFree += size;
+    }
+
+    std::map<OffsetType, OffsetType>::iterator erase(std::map<OffsetType, OffsetType>::iterator it)
+    {
+        bySize.erase(std::make_pair(it->second, it->first));
+        totalFree -= it->second;
+        return byOffset.erase(it);
+    }
+
+public:
+    // Takes the smallest extent that fits size bytes, at the lowest offset
+    // among equal ones. What is left of it stays free.
+    boost::optional<OffsetType> allocate(OffsetType size)
+    {
+        auto fit = bySize.lower_bound(std::make_pair(size, OffsetType(0)));
+        if(size == 0 || fit == bySize.end())
+        {
+            return boost::none;
+        }
+        OffsetType offset = fit->second;
+        OffsetType extentSize = fit->first;
+        erase(byOffset.find(offset));
+        if(extentSize > size)
+        {
+            insert(offset + size, extentSize - size);
+        }
+        return offset;
+    }
+
+    // Marks [offset, offset + size) free, merging it with the extents it
+    // touches. The range must not overlap a free extent.
+    void release(OffsetType offset, OffsetType size)
+    {
+        if(size == 0)
+        {
+            return;
+        }
+        auto next = byOffset.lower_bound(offset);
+        if(next != byOffset.begin())
+        {
+            auto prev = std::prev(next);
+            if(prev->first + prev->second == offset)
+            {
+                offset = prev->first;
+                size += prev->second;
+                erase(prev);
+            }
+        }
+        if(next != byOffset.end() && offset + size == next->first)
+        {
+            size += next->second;
+            erase(next);
+        }
+        insert(offset, size);
+    }
+
+    // Removes the extent that ends at end if there is one and returns its
+    // offset, end otherwise. Used to give back free space at the end of a file.
+    OffsetType trimEnd(OffsetType end)
+    {
+        if(byOffset.empty())
+        {
+            return end;
+        }
+        auto last = std::prev(byOffset.end());
+        if(last->first + last->second != end)
+        {
+            return end;
+        }
+        OffsetType res = last->first;
+        erase(last);
+        return res;
+    }
+
+    void clear()
+    {
+        byOffset.clear();
+        bySize.clear();
+        totalFree = 0;
+    }
+
+    // the extents as (offset, size), ordered by offset
+    const std::map<OffsetType, OffsetType>& extents() const
+    {
+        return byOffset;
+    }
+
+    std::size_t size() const
+    {
+        return byOffset.size();
+    }
+
+    OffsetType freeBytes() const
+    {
+        return totalFree;
+    }
+};
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// Unsigned integers stored little endian in byte buffers, for the on-disk
+// formats. Independent of the byte order of the host.
+
+template<class T>
+inline void storeLE(std::uint8_t *pos, T val)
+{
+    static_assert(std::is_unsigned<T>::value, "storeLE takes unsigned integers");
+    for(unsigned i=0; i<sizeof(T); i++)
+    {
+        pos[i] = static_cast<std::uint8_t>(val >> (8U * i)); // NOLINT
+    }
+}
+
+template<class T>
+inline T loadLE(const std::uint8_t *pos)
+{
+    static_assert(std::is_unsigned<T>::value, "loadLE returns unsigned integers");
+    T res = 0;
+    for(unsigned i=0; i<sizeof(T); i++)
+    {
+        res = static_cast<T>(res | static_cast<T>(static_cast<T>(pos[i]) << (8U * i))); // NOLINT
+    }
+    return res;
+}
+
+// Sequential writer and reader over a buffer
+class LEWriter
+{
+private:
+    std::uint8_t *pos;
+
+public:
+    explicit LEWriter(std::uint8_t *_pos) : pos(_pos) {}
+
+    template<class T>
+    LEWriter& put(T val)
+    {
+        storeLE(pos, val);
+        pos += sizeof(T); // NOLINT
+        return *this;
+    }
+
+    std::uint8_t* position() const
+    {
+        return pos;
+    }
+};
+
+class LEReader
+{
+private:
+    const std::uint8_t *pos;
+
+public:
+    explicit LEReader(const std::uint8_t *_pos) : pos(_pos) {}
+
+    template<class T>
+    T get()
+    {
+        T res = loadLE<T>(pos);
+        pos += sizeof(T); // NOLINT
+        return res;
+    }
+
+    const std::uint8_t* position() const
+    {
+        return pos;
+    }
+};
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+constexpr std::size_t DEFAULT_MEMORY_BUDGET = 2ULL * 1024 * 1024 * 1024;
+
+// Memory shared by all codecs of the process.
+//
+// A codec reserves the most its dictionary can ever need before it starts.
+// Its own reservation never blocks: a thread may hold several codecs at
+// once, so waiting there could deadlock. New entries respect the budget
+// through their level instead: it is lowered until the dictionary fits in
+// what is still available, see ArchiveParser::CompressionStrategy::clampLevel.
+// An entry that is being extracted has a fixed level, so the extraction
+// waits with acquireWait until its decoder fits, see ArchiveReader.
+class MemoryBudget
+{
+private:
+    mutable std::mutex budgetMutex;
+    std::condition_variable released;
+    std::size_t limit;
+    std::size_t used = 0;
+    std::size_t peak = 0;
+
+public:
+    explicit MemoryBudget(std::size_t _limit = DEFAULT_MEMORY_BUDGET) : limit(_limit) {}
+
+    static MemoryBudget& global()
+    {
+        static MemoryBudget budget;
+        return budget;
+    }
+
+    void setLimit(std::size_t _limit)
+    {
+        {
+            std::lock_guard<std::mutex> lock(budgetMutex);
+            limit = _limit;
+        }
+        released.notify_all();
+    }
+
+    std::size_t getLimit() const
+    {
+        std::lock_guard<std::mutex> lock(budgetMutex);
+        return limit;
+    }
+
+    std::size_t getUsed() const
+    {
+        std::lock_guard<std::mutex> lock(budgetMutex);
+        return used;
+    }
+
+    std::size_t getPeak() const
+    {
+        std::lock_guard<std::mutex> lock(budgetMutex);
+        return peak;
+    }
+
+    std::size_t available() const
+    {
+        std::lock_guard<std::mutex> lock(budgetMutex);
+        return used < limit ? limit - used : 0;
+    }
+
+    void acquire(std::size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(budgetMutex);
+        used += bytes;
+        peak = std::max(peak, used);
+    }
+
+    // Waits until bytes fit next to what is already used. Throws if they
+    // are more than the whole limit, they would never fit. The caller must
+    // not hold other reservations while it waits.
+    void acquireWait(std::size_t bytes)
+    {
+        std::unique_lock<std::mutex> lock(budgetMutex);
+        released.wait(lock, [this, bytes]{ return bytes == 0 || bytes > limit || used <= limit - bytes; });
+        if(bytes > limit)
+        {
+            throw std::runtime_error("Needs " + std::to_string(bytes) + " bytes, more than the memory budget of "
+                                     + std::to_string(limit));
+        }
+        used += bytes;
+        peak = std::max(peak, used);
+    }
+
+    void release(std::size_t bytes)
+    {
+        {
+            std::lock_guard<std::mutex> lock(budgetMutex);
+            used -= bytes;
+        }
+        released.notify_all();
+    }
+};
+
+// RAII reservation in a MemoryBudget
+class MemoryReservation
+{
+private:
+    MemoryBudget *budget = nullptr;
+    std::size_t bytes = 0;
+
+public:
+    struct Wait
+    {
+    };
+
+    MemoryReservation() = default;
+
+    MemoryReservation(MemoryBudget &_budget, std::size_t _bytes) : budget(&_budget), bytes(_bytes)
+    {
+        budget->acquire(bytes);
+    }
+
+    // see MemoryBudget::acquireWait
+    MemoryReservation(MemoryBudget &_budget, std::size_t _bytes, Wait) : budget(&_budget), bytes(_bytes)
+    {
+        budget->acquireWait(bytes);
+    }
+
+    MemoryReservation(const MemoryReservation&) = delete;
+    MemoryReservation& operator= (const MemoryReservation&) = delete;
+
+    MemoryReservation(MemoryReservation &&other) noexcept
+        : budget(std::exchange(other.budget, nullptr)), bytes(std::exchange(other.bytes, 0))
+    { }
+
+    MemoryReservation& operator= (MemoryReservation &&other) noexcept
+    {
+        std::swap(budget, other.budget);
+        std::swap(bytes, other.bytes);
+        return *this;
+    }
+
+    ~MemoryReservation()
+    {
+        if(budget != nullptr)
+        {
+            budget->release(bytes);
+        }
+    }
+
+    std::size_t size() const
+    {
+        return bytes;
+    }
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "archive_parser.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Adds files to an archive with several threads. The caller walks the
+// input and hands over what it finds, compressor threads turn the files
+// into ArchiveParser::PreparedFile and a single committer thread copies
+// them into the archive and links them, so only that thread touches the
+// archive. Streams and folders are added by the committer as they come.
+// The archive must not be used otherwise until finish() returns.
+class ParallelIngest
+{
+public:
+    struct Options
+    {
+        // compressor threads, 0 for one per hardware thread
+        unsigned threads = 0;
+        // Entries are committed in the order they were added, so the same
+        // input always gives the same archive. Otherwise they are committed
+        // as soon as they are compressed.
+        bool deterministic = false;
+        // entries added and not committed yet before adding blocks,
+        // 0 for 4 per thread
+        std::size_t maxPending = 0;
+        // Compressed data held in memory by all pending entries together.
+        // Each gets an equal share, at most the memory limit of the spill
+        // policy of the archive, and spills the rest to a temporary file,
+        // so a slow entry at the head of the deterministic order does not
+        // pin maxPending full buffers.
+        std::size_t memoryLimit = 64 * 1024 * 1024;
+    };
+
+private:
+    enum class Kind
+    {
+        file,
+        stream,
+        folder
+    };
+
+    struct Job
+    {
+        std::uint64_t seq;
+        Kind kind;
+        std::string name;
+        std::string path;
+    };
+
+    struct Result
+    {
+        Job job;
+        // set for Kind::file
+        std::unique_ptr<ArchiveParser::PreparedFile> prepared;
+    };
+
+    ArchiveParser &m_archive;
+    ArchiveParser::CompressionStrategy m_comps;
+    ArchiveParser::EarlyAbortPolicy m_earlyAbort;
+    ArchiveParser::SpillPolicy m_spill;
+    bool m_deterministic;
+    std::size_t m_maxPending;
+
+    std::mutex m_mutex;
+    std::condition_variable m_jobCond;
+    std::condition_variable m_resultCond;
+    std::condition_variable m_spaceCond;
+    std::deque<Job> m_jobs;
+    // by seq
+    std::map<std::uint64_t, Result> m_results;
+    std::uint64_t m_nextSeq = 0;
+    std::uint64_t m_nextCommit = 0;
+    // added and not committed yet
+    std::size_t m_pending = 0;
+    bool m_closed = false;
+    bool m_failed = false;
+    std::exception_ptr m_error;
+
+    std::vector<std::thread> m_workers;
+    std::thread m_committer;
+
+    void add(Kind kind, const char *name, const char *path);
+    // records the first error and stops everything, m_mutex has to be held
+    void fail(std::exception_ptr error);
+    void workerLoop();
+    void committerLoop();
+    void commit(Result &result);
+    void stop();
+
+public:
+    explicit ParallelIngest(ArchiveParser &archive);
+    ParallelIngest(ArchiveParser &archive, const Options &options);
+
+    ParallelIngest(const ParallelIngest&) = delete;
+    ParallelIngest& operator= (const ParallelIngest&) = delete;
+    ParallelIngest(ParallelIngest&&) = delete;
+    ParallelIngest& operator= (ParallelIngest&&) = delete;
+    // drops what is not committed yet, see finish
+    ~ParallelIngest();
+
+    // Queue an entry, blocking while too many are pending. Rethrows the
+    // error of an earlier entry, after which nothing more is added.
+    // file at path, read with a known size, see ArchiveParser::addFile
+    void addFile(const char *name, const char *path);
+    // a pipe or device at path, see ArchiveParser::addFileStream
+    void addStream(const char *name, const char *path);
+    void addFolder(const char *name);
+
+    // Waits until everything queued is in the archive. Rethrows the first
+    // error; the entries committed before it stay in the archive.
+    void finish();
+};
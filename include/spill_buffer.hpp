@@ -0,0 +1,59 @@
+#pragma once
+
+#include "compressor_base.hpp"
+
+#include <boost/filesystem/path.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Temporary storage that stays in a growable memory buffer up to memoryLimit
+// bytes and only moves what comes after that to a temporary file. The file
+// is created on the first spill and removed by the destructor.
+// Past maxSize bytes nothing more is kept and overflowed() is true.
+class SpillBuffer final : public ByteSink
+{
+private:
+    std::vector<std::uint8_t> memory;
+    std::size_t memoryLimit;
+    std::uint64_t maxSize;
+    std::string tempDir;
+    boost::filesystem::path tempPath;
+    std::fstream tempFile;
+    std::uint64_t totalSize = 0;
+    bool overflow = false;
+
+    void openTempFile();
+
+public:
+    // tempDir - where the file is created, the system temp dir if empty
+    SpillBuffer(std::size_t _memoryLimit, std::uint64_t _maxSize, std::string _tempDir = "");
+
+    SpillBuffer(const SpillBuffer&) = delete;
+    SpillBuffer& operator= (const SpillBuffer&) = delete;
+    SpillBuffer(SpillBuffer&&) = delete;
+    SpillBuffer& operator= (SpillBuffer&&) = delete;
+    ~SpillBuffer() override;
+
+    void write(const std::uint8_t *data, std::size_t size) override;
+
+    // writes everything stored so far to out, in order
+    void readAll(ByteSink &out);
+
+    std::uint64_t size() const
+    {
+        return totalSize;
+    }
+
+    bool spilled() const
+    {
+        return !tempPath.empty();
+    }
+
+    bool overflowed() const
+    {
+        return overflow;
+    }
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Fixed size pool of worker threads with one shared FIFO queue.
+// The destructor runs every job that is already queued and then joins.
+class ThreadPool
+{
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex jobsMutex;
+    std::condition_variable jobsCond;
+    bool stopping = false;
+
+    void workerLoop()
+    {
+        while(true)
+        {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(jobsMutex);
+                jobsCond.wait(lock, [this]{ return stopping || !jobs.empty(); });
+                if(jobs.empty())
+                {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+public:
+    // 0 threads means one per hardware thread
+    explicit ThreadPool(unsigned threads = 0)
+    {
+        if(threads == 0)
+        {
+            threads = defaultThreadCount();
+        }
+        workers.reserve(threads);
+        for(unsigned i=0; i<threads; i++)
+        {
+            workers.emplace_back([this]{ workerLoop(); });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator= (const ThreadPool&) = delete;
+    ThreadPool(ThreadPool&&) = delete;
+    ThreadPool& operator= (ThreadPool&&) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(jobsMutex);
+            stopping = true;
+        }
+        jobsCond.notify_all();
+        for(std::thread &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    static unsigned defaultThreadCount()
+    {
+        unsigned res = std::thread::hardware_concurrency();
+        return res == 0 ? 1 : res;
+    }
+
+    // The pool the block codecs share, so an entry does not start its own
+    // threads. One thread per hardware thread. Its jobs must not wait for
+    // other jobs of it.
+    static ThreadPool& shared()
+    {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    std::size_t size() const
+    {
+        return workers.size();
+    }
+
+    // exceptions thrown by func are rethrown by the returned future
+    template<class Func>
+    auto submit(Func func) -> std::future<decltype(func())>
+    {
+        using ResType = decltype(func());
+        auto task = std::make_shared<std::packaged_task<ResType()>>(std::move(func));
+        std::future<ResType> res = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(jobsMutex);
+            jobs.emplace_back([task]{ (*task)(); });
+        }
+        jobsCond.notify_one();
+        return res;
+    }
+};
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "thread_pool.hpp"
+
+// Pool of worker threads for batches of independent jobs of uneven cost.
+// Every worker has its own queue: it takes jobs from the front of it and,
+// once it is empty, steals from the back of the queues of the others, so
+// no worker idles while jobs are left and the shared state is only touched
+// at the start and the end of a batch.
+class WorkStealingPool
+{
+private:
+    struct WorkerQueue
+    {
+        std::mutex mutex;
+        std::deque<std::size_t> jobs;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex stateMutex;
+    std::condition_variable stateCond;
+    std::function<void(unsigned, std::size_t)> batchJob;
+    std::uint64_t batch = 0;
+    unsigned busyWorkers = 0;
+    bool stopping = false;
+    std::exception_ptr error;
+    std::atomic<bool> failed{false};
+
+    bool takeJob(unsigned worker, std::size_t &index)
+    {
+        {
+            WorkerQueue &own = *queues[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if(!own.jobs.empty())
+            {
+                index = own.jobs.front();
+                own.jobs.pop_front();
+                return true;
+            }
+        }
+        for(std::size_t i=1; i<queues.size(); i++)
+        {
+            WorkerQueue &victim = *queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if(!victim.jobs.empty())
+            {
+                index = victim.jobs.back();
+                victim.jobs.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(unsigned worker)
+    {
+        std::uint64_t seenBatch = 0;
+        while(true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(stateMutex);
+                stateCond.wait(lock, [this, seenBatch]{ return stopping || batch != seenBatch; });
+                if(stopping)
+                {
+                    return;
+                }
+                seenBatch = batch;
+            }
+            std::size_t index = 0;
+            while(!failed && takeJob(worker, index))
+            {
+                try
+                {
+                    batchJob(worker, index);
+                } catch(...)
+                {
+                    std::lock_guard<std::mutex> lock(stateMutex);
+                    if(!error)
+                    {
+                        error = std::current_exception();
+                    }
+                    failed = true;
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(stateMutex);
+                --busyWorkers;
+            }
+            stateCond.notify_all();
+        }
+    }
+
+public:
+    // 0 threads means one per hardware thread
+    explicit WorkStealingPool(unsigned threads = 0)
+    {
+        if(threads == 0)
+        {
+            threads = ThreadPool::defaultThreadCount();
+        }
+        queues.reserve(threads);
+        workers.reserve(threads);
+        for(unsigned i=0; i<threads; i++)
+        {
+            queues.push_back(std::make_unique<WorkerQueue>());
+        }
+        for(unsigned i=0; i<threads; i++)
+        {
+            workers.emplace_back([this, i]{ workerLoop(i); });
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator= (const WorkStealingPool&) = delete;
+    WorkStealingPool(WorkStealingPool&&) = delete;
+    WorkStealingPool& operator= (WorkStealingPool&&) = delete;
+
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            stopping = true;
+        }
+        stateCond.notify_all();
+        for(std::thread &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    std::size_t size() const
+    {
+        return workers.size();
+    }
+
+    // Calls job(worker, index) for every index in [0, count) and returns
+    // once all calls are done; worker is in [0, size()) and no two calls
+    // with the same worker overlap. The indexes are dealt to the workers in
+    // turn, so lower indexes start first. The first exception a job throws
+    // drops the jobs that have not started and is rethrown here.
+    // One batch at a time.
+    template<class Job>
+    void run(std::size_t count, Job job)
+    {
+        for(std::size_t i=0; i<count; i++)
+        {
+            WorkerQueue &queue = *queues[i % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.jobs.push_back(i);
+        }
+        {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            batchJob = std::move(job);
+            error = nullptr;
+            failed = false;
+            busyWorkers = static_cast<unsigned>(workers.size());
+            ++batch;
+        }
+        stateCond.notify_all();
+
+        std::unique_lock<std::mutex> lock(stateMutex);
+        stateCond.wait(lock, [this]{ return busyWorkers == 0; });
+        batchJob = nullptr;
+        for(std::unique_ptr<WorkerQueue> &queue : queues)
+        {
+            std::lock_guard<std::mutex> queueLock(queue->mutex);
+            queue->jobs.clear();
+        }
+        if(error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+};
@@ -4,114 +4,223 @@
 #include <memory>
 #include <ostream>
 
-std::unique_ptr<Compressor> makeLZWCompressor(unsigned dictSize, std::ostream &out)
+std::unique_ptr<PushCompressor> makeLZWPushCompressor(unsigned dictSize, ByteSink &out, bool variableWidth, std::size_t sizeHint)
 {
     assert(9<= dictSize && dictSize <= 27);
     switch (dictSize) {
         case 9:
-            return std::make_unique<LZWCompressor<9>>(out);
+            return std::make_unique<LZWCompressor<9>>(out, variableWidth, sizeHint);
         case 10:
-            return std::make_unique<LZWCompressor<10>>(out);
+            return std::make_unique<LZWCompressor<10>>(out, variableWidth, sizeHint);
         case 11:
-            return std::make_unique<LZWCompressor<11>>(out);
+            return std::make_unique<LZWCompressor<11>>(out, variableWidth, sizeHint);
         case 12:
-            return std::make_unique<LZWCompressor<12>>(out);
+            return std::make_unique<LZWCompressor<12>>(out, variableWidth, sizeHint);
         case 13:
-            return std::make_unique<LZWCompressor<13>>(out);
+            return std::make_unique<LZWCompressor<13>>(out, variableWidth, sizeHint);
         case 14:
-            return std::make_unique<LZWCompressor<14>>(out);
+            return std::make_unique<LZWCompressor<14>>(out, variableWidth, sizeHint);
         case 15:
-            return std::make_unique<LZWCompressor<15>>(out);
+            return std::make_unique<LZWCompressor<15>>(out, variableWidth, sizeHint);
         case 16:
-            return std::make_unique<LZWCompressor<16>>(out);
+            return std::make_unique<LZWCompressor<16>>(out, variableWidth, sizeHint);
         case 17:
-            return std::make_unique<LZWCompressor<17>>(out);
+            return std::make_unique<LZWCompressor<17>>(out, variableWidth, sizeHint);
         case 18:
-            return std::make_unique<LZWCompressor<18>>(out);
+            return std::make_unique<LZWCompressor<18>>(out, variableWidth, sizeHint);
         case 19:
-            return std::make_unique<LZWCompressor<19>>(out);
+            return std::make_unique<LZWCompressor<19>>(out, variableWidth, sizeHint);
         case 20:
-            return std::make_unique<LZWCompressor<20>>(out);
+            return std::make_unique<LZWCompressor<20>>(out, variableWidth, sizeHint);
         case 21:
-            return std::make_unique<LZWCompressor<21>>(out);
+            return std::make_unique<LZWCompressor<21>>(out, variableWidth, sizeHint);
         case 22:
-            return std::make_unique<LZWCompressor<22>>(out);
+            return std::make_unique<LZWCompressor<22>>(out, variableWidth, sizeHint);
         case 23:
-            return std::make_unique<LZWCompressor<23>>(out);
+            return std::make_unique<LZWCompressor<23>>(out, variableWidth, sizeHint);
         case 24:
-            return std::make_unique<LZWCompressor<24>>(out);
+            return std::make_unique<LZWCompressor<24>>(out, variableWidth, sizeHint);
         case 25:
-            return std::make_unique<LZWCompressor<25>>(out);
+            return std::make_unique<LZWCompressor<25>>(out, variableWidth, sizeHint);
         case 26:
-            return std::make_unique<LZWCompressor<26>>(out);
+            return std::make_unique<LZWCompressor<26>>(out, variableWidth, sizeHint);
         case 27:
-            return std::make_unique<LZWCompressor<27>>(out);
+            return std::make_unique<LZWCompressor<27>>(out, variableWidth, sizeHint);
         /*case 28:
-            return std::make_unique<LZWCompressor<28>>(out);
+            return std::make_unique<LZWCompressor<28>>(out, variableWidth, sizeHint);
         case 29:
-            return std::make_unique<LZWCompressor<29>>(out);
+            return std::make_unique<LZWCompressor<29>>(out, variableWidth, sizeHint);
         case 30:
-            return std::make_unique<LZWCompressor<30>>(out);
+            return std::make_unique<LZWCompressor<30>>(out, variableWidth, sizeHint);
         case 31:
-            return std::make_unique<LZWCompressor<31>>(out);
+            return std::make_unique<LZWCompressor<31>>(out, variableWidth, sizeHint);
         case 32:
-            return std::make_unique<LZWCompressor<32>>(out);*/
+            return std::make_unique<LZWCompressor<32>>(out, variableWidth, sizeHint);*/
     }
     return nullptr;
 }
 
-std::unique_ptr<Decompressor> makeLZWDecompressor(unsigned dictSize, std::ostream &out)
+std::unique_ptr<PushDecompressor> makeLZWPushDecompressor(unsigned dictSize, ByteSink &out, bool variableWidth, std::size_t sizeHint,
+                                                          MemoryBudget &budget)
 {
     assert(9<= dictSize && dictSize <= 27);
     switch (dictSize) {
         case 9:
-            return std::make_unique<LZWDecompressor<9>>(out);
+            return std::make_unique<LZWDecompressor<9>>(out, variableWidth, sizeHint, budget);
         case 10:
-            return std::make_unique<LZWDecompressor<10>>(out);
+            return std::make_unique<LZWDecompressor<10>>(out, variableWidth, sizeHint, budget);
         case 11:
-            return std::make_unique<LZWDecompressor<11>>(out);
+            return std::make_unique<LZWDecompressor<11>>(out, variableWidth, sizeHint, budget);
         case 12:
-            return std::make_unique<LZWDecompressor<12>>(out);
+            return std::make_unique<LZWDecompressor<12>>(out, variableWidth, sizeHint, budget);
         case 13:
-            return std::make_unique<LZWDecompressor<13>>(out);
+            return std::make_unique<LZWDecompressor<13>>(out, variableWidth, sizeHint, budget);
         case 14:
-            return std::make_unique<LZWDecompressor<14>>(out);
+            return std::make_unique<LZWDecompressor<14>>(out, variableWidth, sizeHint, budget);
         case 15:
-            return std::make_unique<LZWDecompressor<15>>(out);
+            return std::make_unique<LZWDecompressor<15>>(out, variableWidth, sizeHint, budget);
         case 16:
-            return std::make_unique<LZWDecompressor<16>>(out);
+            return std::make_unique<LZWDecompressor<16>>(out, variableWidth, sizeHint, budget);
         case 17:
-            return std::make_unique<LZWDecompressor<17>>(out);
+            return std::make_unique<LZWDecompressor<17>>(out, variableWidth, sizeHint, budget);
         case 18:
-            return std::make_unique<LZWDecompressor<18>>(out);
+            return std::make_unique<LZWDecompressor<18>>(out, variableWidth, sizeHint, budget);
         case 19:
-            return std::make_unique<LZWDecompressor<19>>(out);
+            return std::make_unique<LZWDecompressor<19>>(out, variableWidth, sizeHint, budget);
         case 20:
-            return std::make_unique<LZWDecompressor<20>>(out);
+            return std::make_unique<LZWDecompressor<20>>(out, variableWidth, sizeHint, budget);
         case 21:
-            return std::make_unique<LZWDecompressor<21>>(out);
+            return std::make_unique<LZWDecompressor<21>>(out, variableWidth, sizeHint, budget);
         case 22:
-            return std::make_unique<LZWDecompressor<22>>(out);
+            return std::make_unique<LZWDecompressor<22>>(out, variableWidth, sizeHint, budget);
         case 23:
-            return std::make_unique<LZWDecompressor<23>>(out);
+            return std::make_unique<LZWDecompressor<23>>(out, variableWidth, sizeHint, budget);
         case 24:
-            return std::make_unique<LZWDecompressor<24>>(out);
+            return std::make_unique<LZWDecompressor<24>>(out, variableWidth, sizeHint, budget);
         case 25:
-            return std::make_unique<LZWDecompressor<25>>(out);
+            return std::make_unique<LZWDecompressor<25>>(out, variableWidth, sizeHint, budget);
         case 26:
-            return std::make_unique<LZWDecompressor<26>>(out);
+            return std::make_unique<LZWDecompressor<26>>(out, variableWidth, sizeHint, budget);
         case 27:
-            return std::make_unique<LZWDecompressor<27>>(out);
+            return std::make_unique<LZWDecompressor<27>>(out, variableWidth, sizeHint, budget);
         /*case 28:
-            return std::make_unique<LZWDecompressor<28>>(out);
+            return std::make_unique<LZWDecompressor<28>>(out, variableWidth, sizeHint, budget);
         case 29:
-            return std::make_unique<LZWDecompressor<29>>(out);
+            return std::make_unique<LZWDecompressor<29>>(out, variableWidth, sizeHint, budget);
         case 30:
-            return std::make_unique<LZWDecompressor<30>>(out);
+            return std::make_unique<LZWDecompressor<30>>(out, variableWidth, sizeHint, budget);
         case 31:
-            return std::make_unique<LZWDecompressor<31>>(out);
+            return std::make_unique<LZWDecompressor<31>>(out, variableWidth, sizeHint, budget);
         case 32:
-            return std::make_unique<LZWDecompressor<32>>(out);*/
+            return std::make_unique<LZWDecompressor<32>>(out, variableWidth, sizeHint);*/
     }
     return nullptr;
 }
+
+std::size_t LZWCompressorMemoryBound(unsigned dictSize, std::size_t sizeHint)
+{
+    assert(9<= dictSize && dictSize <= 27);
+    switch (dictSize) {
+        case 9:
+            return LZWCompressor<9>::dictMemoryBound(sizeHint);
+        case 10:
+            return LZWCompressor<10>::dictMemoryBound(sizeHint);
+        case 11:
+            return LZWCompressor<11>::dictMemoryBound(sizeHint);
+        case 12:
+            return LZWCompressor<12>::dictMemoryBound(sizeHint);
+        case 13:
+            return LZWCompressor<13>::dictMemoryBound(sizeHint);
+        case 14:
+            return LZWCompressor<14>::dictMemoryBound(sizeHint);
+        case 15:
+            return LZWCompressor<15>::dictMemoryBound(sizeHint);
+        case 16:
+            return LZWCompressor<16>::dictMemoryBound(sizeHint);
+        case 17:
+            return LZWCompressor<17>::dictMemoryBound(sizeHint);
+        case 18:
+            return LZWCompressor<18>::dictMemoryBound(sizeHint);
+        case 19:
+            return LZWCompressor<19>::dictMemoryBound(sizeHint);
+        case 20:
+            return LZWCompressor<20>::dictMemoryBound(sizeHint);
+        case 21:
+            return LZWCompressor<21>::dictMemoryBound(sizeHint);
+        case 22:
+            return LZWCompressor<22>::dictMemoryBound(sizeHint);
+        case 23:
+            return LZWCompressor<23>::dictMemoryBound(sizeHint);
+        case 24:
+            return LZWCompressor<24>::dictMemoryBound(sizeHint);
+        case 25:
+            return LZWCompressor<25>::dictMemoryBound(sizeHint);
+        case 26:
+            return LZWCompressor<26>::dictMemoryBound(sizeHint);
+        case 27:
+            return LZWCompressor<27>::dictMemoryBound(sizeHint);
+    }
+    return 0;
+}
+
+std::size_t LZWDecompressorMemoryBound(unsigned dictSize, std::size_t sizeHint)
+{
+    assert(9<= dictSize && dictSize <= 27);
+    switch (dictSize) {
+        case 9:
+            return LZWDecompressor<9>::dictMemoryBound(sizeHint);
+        case 10:
+            return LZWDecompressor<10>::dictMemoryBound(sizeHint);
+        case 11:
+            return LZWDecompressor<11>::dictMemoryBound(sizeHint);
+        case 12:
+            return LZWDecompressor<12>::dictMemoryBound(sizeHint);
+        case 13:
+            return LZWDecompressor<13>::dictMemoryBound(sizeHint);
+        case 14:
+            return LZWDecompressor<14>::dictMemoryBound(sizeHint);
+        case 15:
+            return LZWDecompressor<15>::dictMemoryBound(sizeHint);
+        case 16:
+            return LZWDecompressor<16>::dictMemoryBound(sizeHint);
+        case 17:
+            return LZWDecompressor<17>::dictMemoryBound(sizeHint);
+        case 18:
+            return LZWDecompressor<18>::dictMemoryBound(sizeHint);
+        case 19:
+            return LZWDecompressor<19>::dictMemoryBound(sizeHint);
+        case 20:
+            return LZWDecompressor<20>::dictMemoryBound(sizeHint);
+        case 21:
+            return LZWDecompressor<21>::dictMemoryBound(sizeHint);
+        case 22:
+            return LZWDecompressor<22>::dictMemoryBound(sizeHint);
+        case 23:
+            return LZWDecompressor<23>::dictMemoryBound(sizeHint);
+        case 24:
+            return LZWDecompressor<24>::dictMemoryBound(sizeHint);
+        case 25:
+            return LZWDecompressor<25>::dictMemoryBound(sizeHint);
+        case 26:
+            return LZWDecompressor<26>::dictMemoryBound(sizeHint);
+        case 27:
+            return LZWDecompressor<27>::dictMemoryBound(sizeHint);
+    }
+    return 0;
+}
+
+std::unique_ptr<Compressor> makeLZWCompressor(unsigned dictSize, std::ostream &out, bool variableWidth)
+{
+    return std::make_unique<PushCompressorAdapter>(out, [dictSize, variableWidth](ByteSink &sink)
+    {
+        return makeLZWPushCompressor(dictSize, sink, variableWidth);
+    });
+}
+
+std::unique_ptr<Decompressor> makeLZWDecompressor(unsigned dictSize, std::ostream &out, bool variableWidth)
+{
+    return std::make_unique<PushDecompressorAdapter>(out, [dictSize, variableWidth](ByteSink &sink)
+    {
+        return makeLZWPushDecompressor(dictSize, sink, variableWidth);
+    });
+}
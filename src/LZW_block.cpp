@@ -0,0 +1,279 @@
+#include "LZW_block.hpp"
+#include "LZW.hpp"
+#include "little_endian.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+// returns the whole frame, header included
+static LZWBlockResult compressBlock(const std::vector<std::uint8_t> &raw, unsigned dictSizePow, bool variableWidth)
+{
+    VectorSink sink;
+    sink.data.resize(LZW_BLOCK_FRAME_HEADER_SIZE);
+    std::unique_ptr<PushCompressor> comp = makeLZWPushCompressor(dictSizePow, sink, variableWidth, raw.size());
+    comp->feed(raw.data(), raw.size());
+    comp->flush();
+    storeLE(sink.data.data(), static_cast<std::uint32_t>(raw.size()));
+    storeLE(sink.data.data() + sizeof(std::uint32_t), static_cast<std::uint32_t>(sink.data.size() - LZW_BLOCK_FRAME_HEADER_SIZE)); // NOLINT
+    return {std::move(sink.data), comp->peakMemoryUsage()};
+}
+
+static LZWBlockResult decompressBlock(const std::vector<std::uint8_t> &frame, std::size_t rawSize,
+                                      unsigned dictSizePow, bool variableWidth, MemoryBudget &budget)
+{
+    VectorSink sink;
+    sink.data.reserve(rawSize);
+    std::size_t packedSize = frame.size() - LZW_BLOCK_FRAME_HEADER_SIZE;
+    std::unique_ptr<PushDecompressor> decomp = makeLZWPushDecompressor(dictSizePow, sink, variableWidth, packedSize, budget);
+    decomp->feed(frame.data() + LZW_BLOCK_FRAME_HEADER_SIZE, packedSize); // NOLINT
+    decomp->flush();
+    if(sink.data.size() != rawSize)
+    {
+        throw std::runtime_error("Archive is corrupted");
+    }
+    return {std::move(sink.data), decomp->peakMemoryUsage()};
+}
+
+unsigned blockLZWDictionaryCount(unsigned threads)
+{
+    // ThreadPool::shared() has one thread per hardware thread
+    unsigned poolThreads = ThreadPool::defaultThreadCount();
+    return threads == 0 ? poolThreads : std::min(threads, poolThreads);
+}
+
+BlockLZWCompressor::BlockLZWCompressor(ByteSink &_out, unsigned _dictSizePow, bool _variableWidth,
+                                       unsigned threads, std::size_t _blockSize)
+    : out(_out), dictSizePow(_dictSizePow), variableWidth(_variableWidth), blockSize(_blockSize)
+{
+    if(blockSize == 0 || blockSize > LZW_BLOCK_MAX_SIZE)
+    {
+        throw std::runtime_error("Invalid LZW block size");
+    }
+    if(threads == 0)
+    {
+        threads = ThreadPool::defaultThreadCount();
+    }
+    threadsUsed = blockLZWDictionaryCount(threads);
+    // two blocks per thread keep the workers busy while the oldest is written
+    maxBlocksInFlight = 2 * threads;
+    if(threads > 1)
+    {
+        pool = &ThreadPool::shared();
+    }
+    curBlock.reserve(blockSize);
+}
+
+void BlockLZWCompressor::writeBlock(const LZWBlockResult &block)
+{
+    out.write(block.data.data(), block.data.size());
+    maxBlockPeakMemory = std::max(maxBlockPeakMemory, block.peakMemory);
+    ++blocksDone;
+}
+
+void BlockLZWCompressor::writeOldestBlock()
+{
+    LZWBlockResult block = inFlight.front().get();
+    inFlight.pop_front();
+    writeBlock(block);
+}
+
+std::size_t BlockLZWCompressor::peakMemoryUsage() const
+{
+    return maxBlockPeakMemory * std::min<std::size_t>(threadsUsed, blocksDone);
+}
+
+void BlockLZWCompressor::submitBlock()
+{
+    if(!pool)
+    {
+        writeBlock(compressBlock(curBlock, dictSizePow, variableWidth));
+        curBlock.clear();
+        return;
+    }
+
+    while(inFlight.size() >= maxBlocksInFlight)
+    {
+        writeOldestBlock();
+    }
+    auto block = std::make_shared<std::vector<std::uint8_t>>(std::move(curBlock));
+    unsigned pow = dictSizePow;
+    bool varWidth = variableWidth;
+    inFlight.push_back(pool->submit([block, pow, varWidth]
+    {
+        return compressBlock(*block, pow, varWidth);
+    }));
+    curBlock = std::vector<std::uint8_t>();
+    curBlock.reserve(blockSize);
+}
+
+void BlockLZWCompressor::feed(const std::uint8_t *data, std::size_t size)
+{
+    while(size > 0)
+    {
+        std::size_t cur = std::min(size, blockSize - curBlock.size());
+        curBlock.insert(curBlock.end(), data, data + cur); // NOLINT
+        data += cur; // NOLINT
+        size -= cur;
+        if(curBlock.size() == blockSize)
+        {
+            submitBlock();
+        }
+    }
+}
+
+void BlockLZWCompressor::flush()
+{
+    if(flushed)
+    {
+        return;
+    }
+    flushed = true;
+    if(!curBlock.empty())
+    {
+        submitBlock();
+    }
+    while(!inFlight.empty())
+    {
+        writeOldestBlock();
+    }
+}
+
+BlockLZWDecompressor::BlockLZWDecompressor(ByteSink &_out, unsigned _dictSizePow, bool _variableWidth, unsigned threads,
+                                           MemoryBudget &_budget)
+    : out(_out), dictSizePow(_dictSizePow), variableWidth(_variableWidth), budget(_budget)
+{
+    if(threads == 0)
+    {
+        threads = ThreadPool::defaultThreadCount();
+    }
+    threadsUsed = blockLZWDictionaryCount(threads);
+    maxBlocksInFlight = 2 * threads;
+    if(threads > 1)
+    {
+        pool = &ThreadPool::shared();
+    }
+    curFrame.reserve(LZW_BLOCK_FRAME_HEADER_SIZE);
+}
+
+BlockLZWDecompressor::~BlockLZWDecompressor()
+{
+    // the blocks reserve their dictionaries in budget
+    for(std::future<LZWBlockResult> &block : inFlight)
+    {
+        block.wait();
+    }
+}
+
+void BlockLZWDecompressor::readFrameHeader()
+{
+    curRawSize = loadLE<std::uint32_t>(curFrame.data());
+    std::size_t packedSize = loadLE<std::uint32_t>(curFrame.data() + sizeof(std::uint32_t)); // NOLINT
+    // a block is never empty and its codes are at most 4 bytes per input byte
+    if(curRawSize == 0 || curRawSize > LZW_BLOCK_MAX_SIZE || packedSize == 0
+       || packedSize > 4 * curRawSize + 4)
+    {
+        throw std::runtime_error("Archive is corrupted");
+    }
+    curFrameSize = LZW_BLOCK_FRAME_HEADER_SIZE + packedSize;
+    curFrame.reserve(curFrameSize);
+}
+
+void BlockLZWDecompressor::writeBlock(const LZWBlockResult &block)
+{
+    out.write(block.data.data(), block.data.size());
+    maxBlockPeakMemory = std::max(maxBlockPeakMemory, block.peakMemory);
+    ++blocksDone;
+}
+
+void BlockLZWDecompressor::writeOldestBlock()
+{
+    LZWBlockResult block = inFlight.front().get();
+    inFlight.pop_front();
+    writeBlock(block);
+}
+
+std::size_t BlockLZWDecompressor::peakMemoryUsage() const
+{
+    return maxBlockPeakMemory * std::min<std::size_t>(threadsUsed, blocksDone);
+}
+
+void BlockLZWDecompressor::submitFrame()
+{
+    if(!pool)
+    {
+        writeBlock(decompressBlock(curFrame, curRawSize, dictSizePow, variableWidth, budget));
+    }
+    else
+    {
+        while(inFlight.size() >= maxBlocksInFlight)
+        {
+            writeOldestBlock();
+        }
+        auto frame = std::make_shared<std::vector<std::uint8_t>>(std::move(curFrame));
+        std::size_t rawSize = curRawSize;
+        unsigned pow = dictSizePow;
+        bool varWidth = variableWidth;
+        MemoryBudget *blockBudget = &budget;
+        inFlight.push_back(pool->submit([frame, rawSize, pow, varWidth, blockBudget]
+        {
+            return decompressBlock(*frame, rawSize, pow, varWidth, *blockBudget);
+        }));
+    }
+    curFrame = std::vector<std::uint8_t>();
+    curFrame.reserve(LZW_BLOCK_FRAME_HEADER_SIZE);
+    curFrameSize = LZW_BLOCK_FRAME_HEADER_SIZE;
+}
+
+void BlockLZWDecompressor::feed(const std::uint8_t *data, std::size_t size)
+{
+    while(size > 0)
+    {
+        std::size_t cur = std::min(size, curFrameSize - curFrame.size());
+        curFrame.insert(curFrame.end(), data, data + cur); // NOLINT
+        data += cur; // NOLINT
+        size -= cur;
+        if(curFrame.size() < curFrameSize)
+        {
+            continue;
+        }
+        if(curFrameSize == LZW_BLOCK_FRAME_HEADER_SIZE)
+        {
+            readFrameHeader();
+        }
+        else
+        {
+            submitFrame();
+        }
+    }
+}
+
+void BlockLZWDecompressor::flush()
+{
+    if(flushed)
+    {
+        return;
+    }
+    flushed = true;
+    while(!inFlight.empty())
+    {
+        writeOldestBlock();
+    }
+    if(!curFrame.empty())
+    {
+        throw std::runtime_error("Archive is corrupted");
+    }
+}
+
+std::unique_ptr<PushCompressor> makeBlockLZWPushCompressor(unsigned dictSize, ByteSink &out,
+                                                           bool variableWidth, unsigned threads)
+{
+    return std::make_unique<BlockLZWCompressor>(out, dictSize, variableWidth, threads);
+}
+
+std::unique_ptr<PushDecompressor> makeBlockLZWPushDecompressor(unsigned dictSize, ByteSink &out,
+                                                               bool variableWidth, unsigned threads, MemoryBudget &budget)
+{
+    return std::make_unique<BlockLZWDecompressor>(out, dictSize, variableWidth, threads, budget);
+}
@@ -7,16 +7,94 @@
 #include <istream>
 #include <memory>
 #include <mutex>
-#include <random>
 #include <stdexcept>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/operations.hpp>
+#include <map>
 #include <vector>
 
 #include "LZW.hpp"
+#include "LZW_block.hpp"
+#include "memory_budget.hpp"
 #include "compressor_base.hpp"
 #include "crc32.hpp"
+#include "file_space.hpp"
+#include "little_endian.hpp"
 #include "noop_copressor.hpp"
+#include "spill_buffer.hpp"
+
+// LZW options: the low nibble is the level, the rest are flags
+static bool validLZWOptions(unsigned options)
+{
+    constexpr unsigned LEVEL_MASK = 0x0FU;
+    constexpr unsigned KNOWN_FLAGS = ArchiveParser::CompressionStrategy::LZW_VARIABLE_WIDTH;
+    return (options & LEVEL_MASK) < 10 && (options & ~(LEVEL_MASK | KNOWN_FLAGS)) == 0;
+}
+
+static unsigned lzwDictSize(std::uint8_t options)
+{
+    constexpr std::array<unsigned, 10> LEVEL_DICT_SIZE = {9, 10, 11, 13, 14, 16, 18, 21, 24, 26}; // NOLINT
+    return LEVEL_DICT_SIZE.at(options & 0x0FU);
+}
+
+ArchiveParser::CompressionStrategy ArchiveParser::CompressionStrategy::resolve(const ByteHistogram &sample) const
+{
+    // order-0 entropy in bits per byte
+    constexpr double STORE_ENTROPY = 7.5;
+    constexpr double LOW_LEVEL_ENTROPY = 6.0;
+    constexpr unsigned LOW_LEVEL = 3;
+    if(m_alg != Algorithm::automatic)
+    {
+        return *this;
+    }
+    double entropy = sample.entropy();
+    if(entropy >= STORE_ENTROPY)
+    {
+        return CompressionStrategy("NONE", 0);
+    }
+    unsigned level = m_algOptions & 0x0FU;
+    // close to random data gains little from a large dictionary
+    if(entropy >= LOW_LEVEL_ENTROPY)
+    {
+        level = std::min(level, LOW_LEVEL);
+    }
+    CompressionStrategy res("LZW", (m_algOptions & ~0x0FU) | level);
+    res.m_concurrentEntries = m_concurrentEntries;
+    return res;
+}
+
+ArchiveParser::CompressionStrategy ArchiveParser::CompressionStrategy::clampLevel(std::uint64_t fileSize, std::size_t memoryBudget) const
+{
+    if(m_alg != Algorithm::LZW && m_alg != Algorithm::blockLZW)
+    {
+        return *this;
+    }
+    // bytes that go through one dictionary and how many dictionaries are alive
+    std::uint64_t dictInput = fileSize;
+    std::size_t dictCount = m_concurrentEntries;
+    if(m_alg == Algorithm::blockLZW)
+    {
+        dictInput = std::min<std::uint64_t>(fileSize, LZW_BLOCK_SIZE);
+        dictCount *= blockLZWDictionaryCount(m_threads);
+    }
+
+    unsigned flags = m_algOptions & ~0x0FU;
+    unsigned level = m_algOptions & 0x0FU;
+    // every byte adds at most one string, so below this size the dictionary
+    // is never reset and a larger one only makes the codes wider
+    while(level > 0 && (1ULL << lzwDictSize(static_cast<std::uint8_t>(level - 1))) - 1 - 256 > dictInput)
+    {
+        --level;
+    }
+    while(level > 0 && dictCount * LZWCompressorMemoryBound(lzwDictSize(static_cast<std::uint8_t>(level)), dictInput) > memoryBudget)
+    {
+        --level;
+    }
+
+    CompressionStrategy res = *this;
+    res.m_algOptions = static_cast<std::uint8_t>(flags | level);
+    return res;
+}
 
 ArchiveParser::CompressionStrategy::CompressionStrategy(const char *alg, unsigned options)
 {
@@ -28,7 +106,25 @@ ArchiveParser::CompressionStrategy::CompressionStrategy(const char *alg, unsigne
     else if(std::strcmp(alg, "LZW")==0)
     {
         m_alg = Algorithm::LZW;
-        if(options >= 10)
+        if(!validLZWOptions(options))
+        {
+            throw std::runtime_error("Invalid LZW options");
+        }
+        m_algOptions = static_cast<std::uint8_t>(options);
+    }
+    else if(std::strcmp(alg, "BLOCK_LZW")==0)
+    {
+        m_alg = Algorithm::blockLZW;
+        if(!validLZWOptions(options))
+        {
+            throw std::runtime_error("Invalid LZW options");
+        }
+        m_algOptions = static_cast<std::uint8_t>(options);
+    }
+    else if(std::strcmp(alg, "AUTO")==0)
+    {
+        m_alg = Algorithm::automatic;
+        if(!validLZWOptions(options))
         {
             throw std::runtime_error("Invalid LZW options");
         }
@@ -50,7 +146,16 @@ ArchiveParser::CompressionStrategy::CompressionStrategy(std::uint8_t alg, unsign
     else if(alg == static_cast<std::uint8_t>(Algorithm::LZW))
     {
         m_alg = Algorithm::LZW;
-        if(options >= 10)
+        if(!validLZWOptions(options))
+        {
+            throw std::runtime_error("Invalid LZW options");
+        }
+        m_algOptions = static_cast<std::uint8_t>(options);
+    }
+    else if(alg == static_cast<std::uint8_t>(Algorithm::blockLZW))
+    {
+        m_alg = Algorithm::blockLZW;
+        if(!validLZWOptions(options))
         {
             throw std::runtime_error("Invalid LZW options");
         }
@@ -68,11 +173,15 @@ const char* ArchiveParser::CompressionStrategy::getAlgStr() const
         return "NONE";
     case Algorithm::LZW:
         return "LZW";
+    case Algorithm::blockLZW:
+        return "BLOCK_LZW";
+    case Algorithm::automatic:
+        return "AUTO";
     }
     return nullptr;
 }
 
-std::unique_ptr<Compressor> ArchiveParser::CompressionStrategy::getCompressor(std::ostream &out) const
+std::unique_ptr<PushCompressor> ArchiveParser::CompressionStrategy::getPushCompressor(ByteSink &out, std::size_t sizeHint) const
 {
     if(m_alg == Algorithm::none)
     {
@@ -80,35 +189,22 @@ std::unique_ptr<Compressor> ArchiveParser::CompressionStrategy::getCompressor(st
     }
     else if(m_alg == Algorithm::LZW)
     {
-        unsigned dict_size;
-        switch(m_algOptions)
-        {
-            case 0:
-                dict_size = 9; break;
-            case 1:
-                dict_size = 10; break;
-            case 2:
-                dict_size = 11; break;
-            case 3:
-                dict_size = 13; break;
-            case 4:
-                dict_size = 14; break;
-            case 5:
-                dict_size = 16; break;
-            case 6:
-                dict_size = 18; break;
-            case 7:
-                dict_size = 21; break;
-            case 8:
-                dict_size = 24; break;
-            case 9:
-                dict_size = 26; break;
-        }
-        return makeLZWCompressor(dict_size, out);
+        bool variableWidth = (m_algOptions & LZW_VARIABLE_WIDTH) != 0;
+        return makeLZWPushCompressor(lzwDictSize(m_algOptions), out, variableWidth, sizeHint);
+    }
+    else if(m_alg == Algorithm::blockLZW)
+    {
+        bool variableWidth = (m_algOptions & LZW_VARIABLE_WIDTH) != 0;
+        return makeBlockLZWPushCompressor(lzwDictSize(m_algOptions), out, variableWidth, m_threads);
+    }
+    else if(m_alg == Algorithm::automatic)
+    {
+        throw std::runtime_error("AUTO compression must be resolved before compressing");
     }
     return nullptr;
 }
-std::unique_ptr<Decompressor> ArchiveParser::CompressionStrategy::getDecompressor(std::ostream &out) const
+std::unique_ptr<PushDecompressor> ArchiveParser::CompressionStrategy::getPushDecompressor(ByteSink &out, std::size_t sizeHint,
+                                                                                        MemoryBudget &budget) const
 {
     if(m_alg == Algorithm::none)
     {
@@ -116,92 +212,76 @@ std::unique_ptr<Decompressor> ArchiveParser::CompressionStrategy::getDecompresso
     }
     else if(m_alg == Algorithm::LZW)
     {
-        unsigned dict_size;
-        switch(m_algOptions)
-        {
-            case 0:
-                dict_size = 9; break;
-            case 1:
-                dict_size = 10; break;
-            case 2:
-                dict_size = 11; break;
-            case 3:
-                dict_size = 13; break;
-            case 4:
-                dict_size = 14; break;
-            case 5:
-                dict_size = 16; break;
-            case 6:
-                dict_size = 18; break;
-            case 7:
-                dict_size = 21; break;
-            case 8:
-                dict_size = 24; break;
-            case 9:
-                dict_size = 26; break;
-        }
-        return makeLZWDecompressor(dict_size, out);
+        bool variableWidth = (m_algOptions & LZW_VARIABLE_WIDTH) != 0;
+        return makeLZWPushDecompressor(lzwDictSize(m_algOptions), out, variableWidth, sizeHint, budget);
+    }
+    else if(m_alg == Algorithm::blockLZW)
+    {
+        bool variableWidth = (m_algOptions & LZW_VARIABLE_WIDTH) != 0;
+        return makeBlockLZWPushDecompressor(lzwDictSize(m_algOptions), out, variableWidth, m_threads, budget);
     }
     return nullptr;
 }
 
+std::size_t ArchiveParser::CompressionStrategy::decompressorMemoryBound(std::uint64_t compressedSize) const
+{
+    if(m_alg == Algorithm::LZW)
+    {
+        return LZWDecompressorMemoryBound(lzwDictSize(m_algOptions), compressedSize);
+    }
+    else if(m_alg == Algorithm::blockLZW)
+    {
+        // a block dictionary sees one frame, at most 4 bytes per raw byte of
+        // an LZW_BLOCK_SIZE block, as the compressor writes them
+        std::uint64_t frameSize = std::min<std::uint64_t>(compressedSize, 4 * LZW_BLOCK_SIZE + 4);
+        return blockLZWDictionaryCount(m_threads) * LZWDecompressorMemoryBound(lzwDictSize(m_algOptions), frameSize);
+    }
+    return 0;
+}
+
+std::unique_ptr<Compressor> ArchiveParser::CompressionStrategy::getCompressor(std::ostream &out, std::size_t sizeHint) const
+{
+    return std::make_unique<PushCompressorAdapter>(out, [this, sizeHint](ByteSink &sink)
+    {
+        return getPushCompressor(sink, sizeHint);
+    });
+}
+std::unique_ptr<Decompressor> ArchiveParser::CompressionStrategy::getDecompressor(std::ostream &out, std::size_t sizeHint) const
+{
+    return std::make_unique<PushDecompressorAdapter>(out, [this, sizeHint](ByteSink &sink)
+    {
+        return getPushDecompressor(sink, sizeHint);
+    });
+}
+
 ArchiveParser::ArchiveParser(const char *archivePath)
     : m_archiveStrg(archivePath, std::fstream::in | std::fstream::out | std::fstream::binary),
       m_archive(m_archiveStrg),
+      m_archivePath(archivePath),
       m_archiveHeader()
 {
     m_archive.get().exceptions(std::iostream::failbit | std::iostream::badbit);
-    m_archive.get().seekg(0, std::iostream::beg);
-    std::array<char, M_MAGIC_SIZE> curFileMagic; // NOLINT
-    m_archive.get().read(curFileMagic.data(), M_MAGIC_SIZE);
-    bool magicOk = std::equal(M_FORMAT_MAGIC.begin(), M_FORMAT_MAGIC.end(), 
-                                curFileMagic.begin());
-    if(!magicOk)
-    {
-        throw std::runtime_error("ArchiveParser: file magic does not match");
-    }
-
     readArchiveHeader();
-    if(m_archiveHeader.header_version != 0)
-    {
-        throw std::runtime_error("Unknown header format");
-    }
+    loadDirectory();
 }
 
 ArchiveParser::ArchiveParser(std::iostream &archive)
     : m_archive(archive), m_archiveHeader()
 {
     m_archive.get().exceptions(std::iostream::failbit | std::iostream::badbit);
-    m_archive.get().seekg(0, std::iostream::beg);
-    std::array<char, M_MAGIC_SIZE> curFileMagic; // NOLINT
-    m_archive.get().read(curFileMagic.data(), M_MAGIC_SIZE);
-    bool magicOk = std::equal(M_FORMAT_MAGIC.begin(), M_FORMAT_MAGIC.end(), 
-                                curFileMagic.begin());
-    if(!magicOk)
-    {
-        throw std::runtime_error("ArchiveParser: file magic does not match");
-    }
-
     readArchiveHeader();
-    if(m_archiveHeader.header_version != 0)
-    {
-        throw std::runtime_error("Unknown header format");
-    }
+    loadDirectory();
 }
 
 ArchiveParser ArchiveParser::MakeArchive(const char *archivePath)
 {
     std::fstream archiveFile(archivePath, std::fstream::out | std::fstream::binary | std::fstream::trunc);
     archiveFile.exceptions(std::fstream::badbit | std::fstream::failbit);
-    archiveFile.seekp(0, std::fstream::beg);
-    archiveHeader arcHead;
-    arcHead.header_version = 0;
-    arcHead.first_file_pos = 0;
-    arcHead._reserved = 0;
-    archiveFile.write(M_FORMAT_MAGIC.data(), M_FORMAT_MAGIC.size());
-    archiveFile.write(reinterpret_cast<char*>(&arcHead.header_version), sizeof(arcHead.header_version)); // NOLINT
-    archiveFile.write(reinterpret_cast<char*>(&arcHead._reserved), sizeof(arcHead._reserved)); // NOLINT
-    archiveFile.write(reinterpret_cast<char*>(&arcHead.first_file_pos), sizeof(arcHead.first_file_pos)); // NOLINT
+    archiveHeader arcHead{};
+    arcHead.header_version = M_LATEST_VERSION;
+    std::array<std::uint8_t, archiveHeader::V1_SIZE> buf; // NOLINT
+    std::size_t size = encodeArchiveHeader(arcHead, buf.data());
+    archiveFile.write(reinterpret_cast<const char*>(buf.data()), static_cast<std::streamsize>(size)); // NOLINT
     archiveFile.close();
 
     return ArchiveParser(archivePath);
@@ -210,103 +290,572 @@ ArchiveParser ArchiveParser::MakeArchive(const char *archivePath)
 ArchiveParser ArchiveParser::MakeArchive(std::iostream &archive)
 {
     archive.exceptions(std::fstream::badbit | std::fstream::failbit);
+    archiveHeader arcHead{};
+    arcHead.header_version = M_LATEST_VERSION;
+    std::array<std::uint8_t, archiveHeader::V1_SIZE> buf; // NOLINT
+    std::size_t size = encodeArchiveHeader(arcHead, buf.data());
     archive.seekp(0, std::fstream::beg);
-    archiveHeader arcHead;
-    arcHead.header_version = 0;
-    arcHead.first_file_pos = 0;
-    arcHead._reserved = 0;
-    archive.write(M_FORMAT_MAGIC.data(), M_FORMAT_MAGIC.size());
-    archive.write(reinterpret_cast<char*>(&arcHead.header_version), sizeof(arcHead.header_version)); // NOLINT
-    archive.write(reinterpret_cast<char*>(&arcHead._reserved), sizeof(arcHead._reserved)); // NOLINT
-    archive.write(reinterpret_cast<char*>(&arcHead.first_file_pos), sizeof(arcHead.first_file_pos)); // NOLINT
+    archive.write(reinterpret_cast<const char*>(buf.data()), static_cast<std::streamsize>(size)); // NOLINT
     archive.sync();
 
     return ArchiveParser(archive);
 }
 
+// All integers on disk are little endian.
+// archive header: magic, u16 version, u16 reserved, u64 first entry,
+//                 since version 1 also u64 directory position and size
+std::size_t ArchiveParser::encodeArchiveHeader(const archiveHeader &head, std::uint8_t *buf)
+{
+    std::copy(M_FORMAT_MAGIC.begin(), M_FORMAT_MAGIC.end(), buf);
+    LEWriter out(buf + M_MAGIC_SIZE); // NOLINT
+    out.put(head.header_version).put(head._reserved).put(head.first_file_pos);
+    if(head.header_version >= 1)
+    {
+        out.put(head.directory_pos).put(head.directory_size);
+    }
+    return static_cast<std::size_t>(out.position() - buf);
+}
+
+ArchiveParser::archiveHeader ArchiveParser::decodeArchiveHeader(const std::uint8_t *buf, std::size_t size)
+{
+    bool magicOk = size >= M_MAGIC_SIZE &&
+                   std::equal(M_FORMAT_MAGIC.begin(), M_FORMAT_MAGIC.end(), buf);
+    if(!magicOk)
+    {
+        throw std::runtime_error("ArchiveParser: file magic does not match");
+    }
+
+    archiveHeader res{};
+    LEReader in(buf + M_MAGIC_SIZE); // NOLINT
+    res.header_version = in.get<std::uint16_t>();
+    res._reserved = in.get<std::uint16_t>();
+    res.first_file_pos = in.get<FileOffsetType>();
+    if(res.header_version > M_LATEST_VERSION)
+    {
+        throw std::runtime_error("Unknown header format");
+    }
+    if(size < (res.header_version == 0 ? archiveHeader::V0_SIZE : archiveHeader::V1_SIZE))
+    {
+        throw std::runtime_error("Archive is corrupted!");
+    }
+    if(res.header_version >= 1)
+    {
+        res.directory_pos = in.get<FileOffsetType>();
+        res.directory_size = in.get<FileOffsetType>();
+    }
+    return res;
+}
+
 void ArchiveParser::readArchiveHeader()
 {
-    std::streamoff old_off = m_archive.get().tellg();
-    m_archive.get().seekg(M_MAGIC_SIZE, std::iostream::beg);
-    m_archive.get().read(reinterpret_cast<char*>(&m_archiveHeader.header_version), sizeof(m_archiveHeader.header_version)); // NOLINT
-    m_archive.get().read(reinterpret_cast<char*>(&m_archiveHeader._reserved), sizeof(m_archiveHeader._reserved)); // NOLINT
-    m_archive.get().read(reinterpret_cast<char*>(&m_archiveHeader.first_file_pos), sizeof(m_archiveHeader.first_file_pos)); // NOLINT
-    m_archive.get().seekg(old_off);
+    // one read of the longest header, a version 0 archive may be shorter
+    std::array<std::uint8_t, archiveHeader::V1_SIZE> buf{};
+    std::streambuf &strg = *m_archive.get().rdbuf();
+    if(strg.pubseekpos(0, std::ios::in) != std::streampos(0))
+    {
+        throw std::runtime_error("ArchiveParser: can not read the archive header");
+    }
+    std::streamsize got = strg.sgetn(reinterpret_cast<char*>(buf.data()), buf.size()); // NOLINT
+    m_archiveHeader = decodeArchiveHeader(buf.data(), static_cast<std::size_t>(std::max<std::streamsize>(got, 0)));
 }
 
 void ArchiveParser::writeArchiveHeader()
 {
-    std::streamoff old_off = m_archive.get().tellp();
-    m_archive.get().seekp(M_MAGIC_SIZE, std::iostream::beg);
-    m_archive.get().write(reinterpret_cast<const char*>(&m_archiveHeader.header_version), sizeof(m_archiveHeader.header_version)); // NOLINT
-    m_archive.get().write(reinterpret_cast<const char*>(&m_archiveHeader._reserved), sizeof(m_archiveHeader._reserved)); // NOLINT
-    m_archive.get().write(reinterpret_cast<const char*>(&m_archiveHeader.first_file_pos), sizeof(m_archiveHeader.first_file_pos)); // NOLINT
-    m_archive.get().seekp(old_off);
+    if(m_batch)
+    {
+        m_batch->headerDirty = true;
+        return;
+    }
+    std::array<std::uint8_t, archiveHeader::V1_SIZE> buf; // NOLINT
+    std::size_t size = encodeArchiveHeader(m_archiveHeader, buf.data());
+    m_archive.get().seekp(0, std::iostream::beg);
+    m_archive.get().write(reinterpret_cast<const char*>(buf.data()), static_cast<std::streamsize>(size)); // NOLINT
 }
 
-ArchiveParser::FileHeader ArchiveParser::readFileHeader(FileOffsetType file_pos) const
+// file header: u64 size, u64 next entry, u32 CRC32, u16 name size,
+//              u8 type, u8 compression algorithm, u8 algorithm options
+void ArchiveParser::encodeFileHeader(const FileHeader &fih, std::uint8_t *buf)
 {
-    std::iostream &archive = const_cast<std::iostream&>(m_archive.get()); // NOLINT
-    
+    LEWriter(buf).put(fih.file_size).put(fih.next_file_pos).put(fih.checksum).put(fih.name_size)
+                 .put(static_cast<std::uint8_t>(fih.file_type))
+                 .put(fih.compression_alg).put(fih.compression_alg_args);
+}
+
+ArchiveParser::FileHeader ArchiveParser::decodeFileHeader(const std::uint8_t *buf, FileOffsetType file_pos)
+{
+    LEReader in(buf);
     FileHeader res; // NOLINT
-    std::streamoff old_off = archive.tellg();
-    archive.seekg(file_pos, std::iostream::beg); // NOLINT
-    archive.read(reinterpret_cast<char*>(&res.file_size), sizeof(res.file_size)); // NOLINT
-    archive.read(reinterpret_cast<char*>(&res.next_file_pos), sizeof(res.next_file_pos)); // NOLINT
-    archive.read(reinterpret_cast<char*>(&res.checksum), sizeof(res.checksum)); // NOLINT
-    archive.read(reinterpret_cast<char*>(&res.name_size), sizeof(res.name_size)); // NOLINT
-    archive.read(reinterpret_cast<char*>(&res.file_type), sizeof(res.file_type)); // NOLINT
-    archive.read(reinterpret_cast<char*>(&res.compression_alg), sizeof(res.compression_alg)); // NOLINT
-    archive.read(reinterpret_cast<char*>(&res.compression_alg_args), sizeof(res.compression_alg_args)); // NOLINT
-    archive.seekg(old_off);
     res.cur_file_pos = file_pos;
+    res.file_size = in.get<FileOffsetType>();
+    res.next_file_pos = in.get<FileOffsetType>();
+    res.checksum = in.get<std::uint32_t>();
+    res.name_size = in.get<std::uint16_t>();
+    res.file_type = static_cast<fileType>(in.get<std::uint8_t>());
+    res.compression_alg = in.get<std::uint8_t>();
+    res.compression_alg_args = in.get<std::uint8_t>();
 
     return res;
 }
 
+// bytes read at once when a header is not in the window yet
+static constexpr std::size_t HEADER_READ_AHEAD_SIZE = 64 * 1024;
+
+// Reads headers and names through a window of the archive. Entries that
+// are close to each other are decoded from one read instead of a seek and
+// eight reads each. Nothing may be written to the archive while it is alive.
+class ArchiveParser::HeaderReadAhead
+{
+private:
+    std::iostream &archive;
+    std::streamoff oldOff;
+    FileOffsetType archiveSize;
+    std::vector<std::uint8_t> window;
+    FileOffsetType windowPos = 0;
+
+    const std::uint8_t* fetch(FileOffsetType pos, std::size_t size)
+    {
+        if(pos >= windowPos && pos - windowPos + size <= window.size())
+        {
+            return window.data() + (pos - windowPos); // NOLINT
+        }
+        if(pos > archiveSize || size > archiveSize - pos)
+        {
+            throw std::runtime_error("Archive is corrupted!");
+        }
+        window.resize(static_cast<std::size_t>(std::min<FileOffsetType>(std::max(size, HEADER_READ_AHEAD_SIZE), archiveSize - pos)));
+        windowPos = pos;
+        archive.seekg(static_cast<std::streamoff>(pos), std::iostream::beg);
+        archive.read(reinterpret_cast<char*>(window.data()), static_cast<std::streamsize>(window.size())); // NOLINT
+        return window.data();
+    }
+
+public:
+    explicit HeaderReadAhead(std::iostream &_archive) : archive(_archive), oldOff(_archive.tellg())
+    {
+        archive.seekg(0, std::iostream::end);
+        archiveSize = static_cast<FileOffsetType>(archive.tellg());
+    }
+
+    HeaderReadAhead(const HeaderReadAhead&) = delete;
+    HeaderReadAhead& operator= (const HeaderReadAhead&) = delete;
+    HeaderReadAhead(HeaderReadAhead&&) = delete;
+    HeaderReadAhead& operator= (HeaderReadAhead&&) = delete;
+
+    ~HeaderReadAhead()
+    {
+        archive.seekg(oldOff);
+    }
+
+    DirectoryEntry read(FileOffsetType file_pos)
+    {
+        DirectoryEntry res;
+        res.header = decodeFileHeader(fetch(file_pos, FileHeader::HEADER_SIZE), file_pos);
+        const std::uint8_t *name = fetch(file_pos + FileHeader::HEADER_SIZE, res.header.name_size);
+        res.name.assign(name, name + res.header.name_size); // NOLINT
+        return res;
+    }
+};
+
 void ArchiveParser::writeFileHeader(const FileHeader &fih)
 {
+    if(m_batch)
+    {
+        // written by commit from m_directory
+        m_batch->dirtyHeaders.insert(fih.cur_file_pos);
+        return;
+    }
+    std::array<std::uint8_t, FileHeader::HEADER_SIZE> buf; // NOLINT
+    encodeFileHeader(fih, buf.data());
+    m_archive.get().seekp(static_cast<std::streamoff>(fih.cur_file_pos), std::iostream::beg);
+    m_archive.get().write(reinterpret_cast<const char*>(buf.data()), buf.size()); // NOLINT
+}
+
+ArchiveParser::~ArchiveParser()
+{
+    try
+    {
+        if(m_batch)
+        {
+            abort();
+        }
+        flush();
+    } catch(...)
+    {
+
+    }
+}
+
+void ArchiveParser::flush()
+{
+    if(m_archiveHeader.header_version >= 1 && !m_directoryOnDisk && !m_batch)
+    {
+        writeDirectory();
+    }
+    m_archive.get().flush();
+}
+
+void ArchiveParser::beginBatch()
+{
+    if(m_batch)
+    {
+        throw std::runtime_error("A batch is already open");
+    }
+    auto batch = std::make_unique<Batch>();
+    batch->header = m_archiveHeader;
+    batch->directory = m_directory;
+    batch->directoryOnDisk = m_directoryOnDisk;
+    batch->dataEnd = m_dataEnd;
+    batch->archiveSize = 0;
+    if(!m_archivePath.empty())
+    {
+        m_archive.get().flush();
+        batch->archiveSize = boost::filesystem::file_size(m_archivePath);
+    }
+    // the central directory stays valid until commit
+    batch->base = m_dataEnd;
+    if(m_archiveHeader.header_version >= 1 && m_directoryOnDisk)
+    {
+        batch->base = std::max(m_dataEnd, m_archiveHeader.directory_pos + m_archiveHeader.directory_size);
+    }
+    m_dataEnd = batch->base;
+    m_batch = std::move(batch);
+}
+
+void ArchiveParser::commit()
+{
+    if(!m_batch)
+    {
+        throw std::runtime_error("There is no batch to commit");
+    }
+    std::unique_ptr<Batch> batch = std::move(m_batch);
+    // the new entries are complete before anything links to them
+    m_archive.get().flush();
+
+    std::vector<const FileHeader*> headers;
+    for(const DirectoryEntry &entry : m_directory)
+    {
+        if(batch->dirtyHeaders.count(entry.header.cur_file_pos) != 0)
+        {
+            headers.push_back(&entry.header);
+        }
+    }
+    std::sort(headers.begin(), headers.end(), [](const FileHeader *a, const FileHeader *b)
+    {
+        return a->cur_file_pos < b->cur_file_pos;
+    });
+    // the archive header comes first, it drops the central directory
+    if(batch->headerDirty)
+    {
+        writeArchiveHeader();
+    }
+    for(const FileHeader *fih : headers)
+    {
+        writeFileHeader(*fih);
+    }
+
+    if(m_dataEnd == batch->base)
+    {
+        m_dataEnd = batch->dataEnd;
+    }
+    else
+    {
+        // where the old central directory was
+        releaseFileEntrySpace(batch->dataEnd, batch->base - batch->dataEnd);
+    }
+    for(const std::pair<FileOffsetType, FileOffsetType> &range : batch->released)
+    {
+        releaseFileEntrySpace(range.first, range.second);
+    }
+    if(!batch->punched.empty())
+    {
+        m_archive.get().flush();
+        for(const std::pair<FileOffsetType, FileOffsetType> &range : batch->punched)
+        {
+            if(punchFileHole(m_archivePath, range.first, range.second))
+            {
+                m_punchedBytes += range.second;
+            }
+        }
+    }
+}
+
+void ArchiveParser::abort()
+{
+    if(!m_batch)
+    {
+        throw std::runtime_error("There is no batch to abort");
+    }
+    std::unique_ptr<Batch> batch = std::move(m_batch);
+    m_archiveHeader = batch->header;
+    m_directory = std::move(batch->directory);
+    m_directoryOnDisk = batch->directoryOnDisk;
+    m_dataEnd = batch->dataEnd;
+    rebuildNameIndex();
+    // only what was behind the data has been written
+    m_archive.get().flush();
+    if(!m_archivePath.empty() && boost::filesystem::file_size(m_archivePath) > batch->archiveSize)
+    {
+        boost::filesystem::resize_file(m_archivePath, batch->archiveSize);
+    }
+}
+
+namespace
+{
+// fixed size part of an entry in the central directory
+constexpr std::size_t DIRECTORY_ENTRY_SIZE = 2 * sizeof(std::uint64_t) + sizeof(std::uint32_t) +
+                                             sizeof(std::uint16_t) + 3 * sizeof(std::uint8_t);
+
+template<class T>
+void putValue(std::vector<std::uint8_t> &buf, T val)
+{
+    buf.resize(buf.size() + sizeof(T));
+    storeLE(buf.data() + buf.size() - sizeof(T), val); // NOLINT
+}
+
+template<class T>
+T getValue(const std::uint8_t *&pos)
+{
+    T res = loadLE<T>(pos);
+    pos += sizeof(T); // NOLINT
+    return res;
+}
+} // namespace
+
+// The central directory is written behind the last entry:
+//
+//     uint64 entry count | entries | uint64 hole count | holes | uint32 CRC32
+//
+// every entry being the FileHeader without next_file_pos, cur_file_pos
+// first, followed by the name, every hole an uint64 offset and size. The
+// CRC covers everything before it. The entries are in list order. It is only
+// written by flush(); the first change after that clears directory_pos, so
+// a directory that is not up to date is never read.
+void ArchiveParser::writeDirectory()
+{
+    std::vector<std::uint8_t> buf;
+    putValue<std::uint64_t>(buf, m_directory.size());
+    for(const DirectoryEntry &entry : m_directory)
+    {
+        const FileHeader &fih = entry.header;
+        putValue(buf, fih.cur_file_pos);
+        putValue(buf, fih.file_size);
+        putValue(buf, fih.checksum);
+        putValue(buf, fih.name_size);
+        putValue(buf, static_cast<std::uint8_t>(fih.file_type));
+        putValue(buf, fih.compression_alg);
+        putValue(buf, fih.compression_alg_args);
+        buf.insert(buf.end(), entry.name.begin(), entry.name.end());
+    }
+    putValue<std::uint64_t>(buf, m_freeSpace.size());
+    for(const std::pair<const FileOffsetType, FileOffsetType> &hole : m_freeSpace.extents())
+    {
+        putValue(buf, hole.first);
+        putValue(buf, hole.second);
+    }
+    CRC32 crc;
+    crc(buf.data(), buf.size());
+    putValue(buf, crc.getResult());
+
+    FileOffsetType dirPos = m_dataEnd;
     std::streamoff old_off = m_archive.get().tellp();
-    m_archive.get().seekp(fih.cur_file_pos, std::iostream::beg); // NOLINT
-    m_archive.get().write(reinterpret_cast<const char*>(&fih.file_size), sizeof(fih.file_size)); // NOLINT
-    m_archive.get().write(reinterpret_cast<const char*>(&fih.next_file_pos), sizeof(fih.next_file_pos)); // NOLINT
-    m_archive.get().write(reinterpret_cast<const char*>(&fih.checksum), sizeof(fih.checksum)); // NOLINT
-    m_archive.get().write(reinterpret_cast<const char*>(&fih.name_size), sizeof(fih.name_size)); // NOLINT
-    m_archive.get().write(reinterpret_cast<const char*>(&fih.file_type), sizeof(fih.file_type)); // NOLINT
-    m_archive.get().write(reinterpret_cast<const char*>(&fih.compression_alg), sizeof(fih.compression_alg)); // NOLINT
-    m_archive.get().write(reinterpret_cast<const char*>(&fih.compression_alg_args), sizeof(fih.compression_alg_args)); // NOLINT
+    m_archive.get().seekp(static_cast<std::streamoff>(dirPos), std::iostream::beg);
+    m_archive.get().write(reinterpret_cast<const char*>(buf.data()), static_cast<std::streamsize>(buf.size())); // NOLINT
     m_archive.get().seekp(old_off);
+    // the directory has to be complete before the header points to it
+    m_archive.get().flush();
+
+    m_archiveHeader.directory_pos = dirPos;
+    m_archiveHeader.directory_size = buf.size();
+    writeArchiveHeader();
+    m_directoryOnDisk = true;
 }
 
-ArchiveParser::FileOffsetType ArchiveParser::getLastFilePos() const
+// false if the directory is missing or damaged
+bool ArchiveParser::readDirectory()
 {
-    if(m_archiveHeader.first_file_pos == 0) 
+    FileOffsetType dirPos = m_archiveHeader.directory_pos;
+    FileOffsetType dirSize = m_archiveHeader.directory_size;
+    if(dirPos == 0 || dirSize < sizeof(std::uint64_t) + sizeof(std::uint32_t))
     {
-        return 0; // no last file
+        return false;
     }
-    if(m_lastFilePosValid)
+    std::iostream &archive = m_archive.get(); // NOLINT
+    std::streamoff old_off = archive.tellg();
+    archive.seekg(0, std::iostream::end);
+    FileOffsetType archiveSize = static_cast<FileOffsetType>(archive.tellg());
+    if(dirPos > archiveSize || dirSize > archiveSize - dirPos)
     {
-        return m_lastFilePos;
+        archive.seekg(old_off);
+        return false;
     }
-    FileHeader cur_file; // NOLINT
-    FileOffsetType next_file = m_archiveHeader.first_file_pos;
+    std::vector<std::uint8_t> buf(dirSize);
+    archive.seekg(static_cast<std::streamoff>(dirPos), std::iostream::beg);
+    archive.read(reinterpret_cast<char*>(buf.data()), static_cast<std::streamsize>(buf.size())); // NOLINT
+    archive.seekg(old_off);
+
+    std::vector<DirectoryEntry> entries;
+    FreeSpaceMap holes;
+    if(!decodeDirectory(buf, m_archiveHeader.first_file_pos, entries, holes))
+    {
+        return false;
+    }
+    m_directory = std::move(entries);
+    m_freeSpace = std::move(holes);
+    m_dataEnd = archiveHeader::V1_SIZE;
+    for(const DirectoryEntry &entry : m_directory)
+    {
+        m_dataEnd = std::max(m_dataEnd, entry.header.cur_file_pos + calculateFileEntrySize(entry.header.name_size, entry.header.file_size));
+    }
+    return true;
+}
+
+bool ArchiveParser::decodeDirectory(const std::vector<std::uint8_t> &buf, FileOffsetType first_file_pos,
+                                    std::vector<DirectoryEntry> &entries, FreeSpaceMap &holes)
+{
+    if(buf.size() < sizeof(std::uint64_t) + sizeof(std::uint32_t))
+    {
+        return false;
+    }
+    const std::uint8_t *end = buf.data() + buf.size() - sizeof(std::uint32_t); // NOLINT
+    const std::uint8_t *pos = end;
+    CRC32 crc;
+    crc(buf.data(), buf.size() - sizeof(std::uint32_t));
+    if(getValue<std::uint32_t>(pos) != crc.getResult())
+    {
+        return false;
+    }
+    pos = buf.data();
+    std::uint64_t count = getValue<std::uint64_t>(pos);
+    std::vector<DirectoryEntry> res;
+    for(std::uint64_t i=0; i<count; i++)
+    {
+        if(static_cast<std::size_t>(end - pos) < DIRECTORY_ENTRY_SIZE)
+        {
+            return false;
+        }
+        DirectoryEntry entry;
+        FileHeader &fih = entry.header;
+        fih.cur_file_pos = getValue<FileOffsetType>(pos);
+        fih.file_size = getValue<FileOffsetType>(pos);
+        fih.checksum = getValue<std::uint32_t>(pos);
+        fih.name_size = getValue<std::uint16_t>(pos);
+        fih.file_type = static_cast<fileType>(getValue<std::uint8_t>(pos));
+        fih.compression_alg = getValue<std::uint8_t>(pos);
+        fih.compression_alg_args = getValue<std::uint8_t>(pos);
+        fih.next_file_pos = 0;
+        if(static_cast<std::size_t>(end - pos) < fih.name_size)
+        {
+            return false;
+        }
+        entry.name.assign(pos, pos + fih.name_size); // NOLINT
+        pos += fih.name_size; // NOLINT
+        if(!res.empty())
+        {
+            res.back().header.next_file_pos = fih.cur_file_pos;
+        }
+        res.push_back(std::move(entry));
+    }
+    if(static_cast<std::size_t>(end - pos) < sizeof(std::uint64_t))
+    {
+        return false;
+    }
+    std::uint64_t holeCount = getValue<std::uint64_t>(pos);
+    if(static_cast<std::size_t>(end - pos) / (2 * sizeof(FileOffsetType)) < holeCount)
+    {
+        return false;
+    }
+    FreeSpaceMap resHoles;
+    for(std::uint64_t i=0; i<holeCount; i++)
+    {
+        FileOffsetType holePos = getValue<FileOffsetType>(pos);
+        FileOffsetType holeSize = getValue<FileOffsetType>(pos);
+        resHoles.release(holePos, holeSize);
+    }
+    FileOffsetType first = res.empty() ? 0 : res.front().header.cur_file_pos;
+    if(pos != end || first != first_file_pos)
+    {
+        return false;
+    }
+    entries = std::move(res);
+    holes = std::move(resHoles);
+    return true;
+}
+
+void ArchiveParser::loadDirectory()
+{
+    m_directory.clear();
+    m_directoryOnDisk = m_archiveHeader.header_version >= 1 && readDirectory();
+    FileOffsetType next_file = m_directoryOnDisk ? 0 : m_archiveHeader.first_file_pos;
+    HeaderReadAhead reader(m_archive.get());
     while(next_file != 0)
     {
-        cur_file = readFileHeader(next_file);
-        next_file = cur_file.next_file_pos;
+        DirectoryEntry entry = reader.read(next_file);
+        next_file = entry.header.next_file_pos;
+        m_directory.push_back(std::move(entry));
     }
-    return cur_file.cur_file_pos;
+    if(!m_directoryOnDisk)
+    {
+        rebuildFreeSpace();
+    }
+    rebuildNameIndex();
 }
 
-void ArchiveParser::updateLastFilePos(FileOffsetType new_last)
+void ArchiveParser::rebuildNameIndex()
 {
-    if(m_archiveHeader.first_file_pos == 0)
+    m_nameIndex.clear();
+    m_nameIndex.reserve(m_directory.size());
+    m_repeatedNames = false;
+    for(std::size_t i=0; i<m_directory.size(); i++)
     {
-        m_archiveHeader.first_file_pos = new_last;
-        writeArchiveHeader();
+        m_directory[i].seq = i;
+        if(!m_nameIndex.emplace(m_directory[i].name, i).second)
+        {
+            m_repeatedNames = true;
+        }
+    }
+    m_nextSeq = m_directory.size();
+}
+
+std::size_t ArchiveParser::entryIndex(std::uint64_t seq) const
+{
+    auto found = std::lower_bound(m_directory.begin(), m_directory.end(), seq,
+                                  [](const DirectoryEntry &entry, std::uint64_t val){ return entry.seq < val; });
+    assert(found != m_directory.end() && found->seq == seq);
+    return static_cast<std::size_t>(found - m_directory.begin());
+}
+
+void ArchiveParser::invalidateDirectory()
+{
+    if(m_archiveHeader.header_version == 0 || !m_directoryOnDisk)
+    {
+        return;
+    }
+    m_archiveHeader.directory_pos = 0;
+    m_archiveHeader.directory_size = 0;
+    writeArchiveHeader();
+    m_directoryOnDisk = false;
+}
+
+void ArchiveParser::rebuildFreeSpace()
+{
+    std::vector<std::pair<FileOffsetType, FileOffsetType> > distPairs;
+    for(const DirectoryEntry &entry : m_directory)
+    {
+        FileOffsetType beg = entry.header.cur_file_pos;
+        distPairs.emplace_back(beg, beg + calculateFileEntrySize(entry.header.name_size, entry.header.file_size));
+    }
+    std::sort(distPairs.begin(), distPairs.end());
+    m_freeSpace.clear();
+    m_dataEnd = m_archiveHeader.header_version == 0 ? archiveHeader::V0_SIZE : archiveHeader::V1_SIZE;
+    for(const std::pair<FileOffsetType, FileOffsetType> &entry : distPairs)
+    {
+        // overlapping entries are left to verify()
+        if(entry.first > m_dataEnd)
+        {
+            m_freeSpace.release(m_dataEnd, entry.first - m_dataEnd);
+        }
+        m_dataEnd = std::max(m_dataEnd, entry.second);
     }
-    m_lastFilePos = new_last;
-    m_lastFilePosValid = true;
 }
 
 
@@ -320,80 +869,55 @@ ArchiveParser::FileOffsetType ArchiveParser::calculateFileEntrySize(std::size_t
     return res;
 }
 
-ArchiveParser::FileOffsetType ArchiveParser::allocateFileEntrySpace(std::size_t file_entry_size) const
+ArchiveParser::FileOffsetType ArchiveParser::allocateFileEntrySpace(FileOffsetType file_entry_size)
 {
-    /*
-    // TODO: use interval tree or smth other to find holes in file
-    // for now, just return the end of the file
-    (void) file_entry_size;
-
-    std::iostream &archive = m_archive.get(); // NOLINT
-    std::size_t old_pos = static_cast<FileOffsetType>(archive.tellp());
-    archive.seekp(0, std::iostream::end);
-    std::size_t end_pos = static_cast<FileOffsetType>(archive.tellp());
-    archive.seekp(static_cast<std::streamsize>(old_pos));
-    return end_pos;
-    */
-
-    // Find a suitable hole
+    // a batch lays its entries out back to back, the holes are still in use
+    // by the archive on disk
+    boost::optional<FileOffsetType> hole;
+    if(!m_batch)
+    {
+        hole = m_freeSpace.allocate(file_entry_size);
+    }
+    if(hole)
+    {
+        return *hole;
+    }
+    // what is behind the last entry is the old central directory at most
+    FileOffsetType res = m_dataEnd;
+    m_dataEnd += file_entry_size;
+    return res;
+}
 
-    std::vector<std::pair<FileOffsetType, FileOffsetType> > distPairs;
-    for(const FileInfo &file : *this)
+void ArchiveParser::releaseFileEntrySpace(FileOffsetType pos, FileOffsetType size)
+{
+    if(size == 0)
     {
-        distPairs.push_back(file.getEntryBeginEnd());
+        return;
     }
-    std::size_t best_pos = distPairs.size();
-    if(!distPairs.empty())
+    if(m_batch)
     {
-        std::sort(distPairs.begin(), distPairs.end());
-        for(std::size_t i=0; i<distPairs.size()-1; i++)
+        if(pos >= m_batch->base && pos + size == m_dataEnd)
         {
-            if(distPairs[i+1].first < distPairs[i].second)
-            {
-                throw std::runtime_error("Archive is corrupted!");
-            }
-            std::size_t cur_dist = distPairs[i+1].first - distPairs[i].second;
-            if(cur_dist == 0)
-            {
-                continue;
-            }
-            if(cur_dist == file_entry_size)
-            {
-                best_pos = i;
-                break;
-            }
-            if(cur_dist >= file_entry_size)
-            {
-                if(best_pos == distPairs.size())
-                {
-                    best_pos = i;
-                }
-                else
-                {
-                    std::size_t best_dist = distPairs[best_pos+1].first - distPairs[best_pos].second;
-                    if(best_dist > cur_dist)
-                    {
-                        best_pos = i;
-                    }
-                }
-            }
+            m_dataEnd = pos;
         }
+        else
+        {
+            m_batch->released.emplace_back(pos, size);
+        }
+        return;
     }
-
-    if(best_pos == distPairs.size())
+    if(pos + size == m_dataEnd)
     {
-        std::iostream &archive = m_archive.get(); // NOLINT
-        std::size_t old_pos = static_cast<FileOffsetType>(archive.tellp());
-        archive.seekp(0, std::iostream::end);
-        std::size_t end_pos = static_cast<FileOffsetType>(archive.tellp());
-        archive.seekp(static_cast<std::streamsize>(old_pos));
-        return end_pos;
+        m_dataEnd = m_freeSpace.trimEnd(pos);
+    }
+    else
+    {
+        m_freeSpace.release(pos, size);
     }
-    return distPairs[best_pos].second;
 }
 
 
-void ArchiveParser::calcCrcFileEntry(FileHeader &header, const char *name, std::istream &file, std::size_t file_size)
+void ArchiveParser::calcCrcFileEntry(FileHeader &header, const char *name, std::uint32_t data_crc)
 {
     CRC32 crc;
     crc(header.file_size);
@@ -402,11 +926,8 @@ void ArchiveParser::calcCrcFileEntry(FileHeader &header, const char *name, std::
     crc(header.compression_alg);
     crc(header.compression_alg_args);
     crc(name, name+std::strlen(name)); // NOLINT
-    std::streamoff old_off = file.tellg();
-    crc(file, file_size);
-    file.seekg(old_off, std::istream::beg);
 
-    header.checksum = crc.getResult();
+    header.checksum = CRC32::combine(crc.getResult(), data_crc, header.file_size);
 }
 
 void ArchiveParser::calcCrcFolderEntry(FileHeader &header, const char *name)
@@ -437,76 +958,48 @@ bool ArchiveParser::verifyCrcFileEntry(const FileHeader &header) const
     crc(m_archive.get(), header.name_size);
     crc(m_archive.get(), header.file_size);
 
-    m_archive.get().seekg(old_off, std::iostream::beg);
-
-    return crc.getResult() == header.checksum;
-}
-
-static void stream_dd(std::istream &ins, std::size_t size, std::ostream &outs)
-{
-    constexpr std::size_t BUFFER_SIZE = 1024;
-    std::array<char, BUFFER_SIZE> buf; // NOLINT
-    while(size > BUFFER_SIZE)
-    {
-        ins.read(buf.data(), BUFFER_SIZE);
-        outs.write(buf.data(), BUFFER_SIZE);
-        size -= BUFFER_SIZE;
-    }
+    m_archive.get().seekg(old_off, std::iostream::beg);
 
-    ins.read(buf.data(), size);   // NOLINT
-    outs.write(buf.data(), size); // NOLINT
+    return crc.getResult() == header.checksum;
 }
 
-void ArchiveParser::writeFileEntry (const FileHeader &header, const char *name, std::istream &file, std::size_t file_size)
+void ArchiveParser::linkFileEntry (const FileHeader &header, const char *name)
 {
-    writeFileHeader(header);
-    std::streamoff old_pos = m_archive.get().tellp();
-    m_archive.get().seekp(header.cur_file_pos+FileHeader::HEADER_SIZE, std::iostream::beg); // NOLINT
-    m_archive.get().write(name, std::strlen(name)); // NOLINT
-    stream_dd(file, file_size, m_archive);
-
-    m_archive.get().seekp(old_pos);
-
-    FileOffsetType last_file_pos = getLastFilePos();
-    if(last_file_pos != 0)
+    assert(header.next_file_pos == 0);
+    if(!m_directory.empty())
     {
-        FileHeader fih = readFileHeader(last_file_pos);
-        assert(fih.next_file_pos == 0);
-        fih.next_file_pos = header.cur_file_pos;
-        writeFileHeader(fih);
+        FileHeader &last = m_directory.back().header;
+        assert(last.next_file_pos == 0);
+        last.next_file_pos = header.cur_file_pos;
+        writeFileHeader(last);
     }
-    else // last_file_pos = 0
+    else
     {
         m_archiveHeader.first_file_pos = header.cur_file_pos;
         writeArchiveHeader();
     }
-    updateLastFilePos(header.cur_file_pos);
+    std::uint64_t seq = m_nextSeq++;
+    if(!m_nameIndex.emplace(name, seq).second)
+    {
+        m_repeatedNames = true;
+    }
+    m_directory.push_back(DirectoryEntry{header, name, seq});
 }
 
 void ArchiveParser::writeFolderEntry (const FileHeader &header, const char *name)
 {
     assert(header.file_size == 0);
-    writeFileHeader(header);
+    // one write front to back, so it can extend the archive
+    std::vector<std::uint8_t> buf(FileHeader::HEADER_SIZE + header.name_size);
+    encodeFileHeader(header, buf.data());
+    std::memcpy(buf.data() + FileHeader::HEADER_SIZE, name, header.name_size); // NOLINT
     std::streamoff old_pos = m_archive.get().tellp();
-    m_archive.get().seekp(header.cur_file_pos+FileHeader::HEADER_SIZE, std::iostream::beg); // NOLINT
-    m_archive.get().write(name, std::strlen(name)); // NOLINT
+    m_archive.get().seekp(static_cast<std::streamoff>(header.cur_file_pos), std::iostream::beg);
+    m_archive.get().write(reinterpret_cast<const char*>(buf.data()), static_cast<std::streamsize>(buf.size())); // NOLINT
 
     m_archive.get().seekp(old_pos);
 
-    FileOffsetType last_file_pos = getLastFilePos();
-    if(last_file_pos != 0)
-    {
-        FileHeader fih = readFileHeader(last_file_pos);
-        assert(fih.next_file_pos == 0);
-        fih.next_file_pos = header.cur_file_pos;
-        writeFileHeader(fih);
-    }
-    else // last_file_pos = 0
-    {
-        m_archiveHeader.first_file_pos = header.cur_file_pos;
-        writeArchiveHeader();
-    }
-    updateLastFilePos(header.cur_file_pos);
+    linkFileEntry(header, name);
 }
 
 // true - OK
@@ -517,6 +1010,33 @@ bool ArchiveParser::checkArchiveConsistency() const
     {
         distPairs.push_back(file.getEntryBeginEnd());
     }
+    // the list in the file has to match the directory
+    FileOffsetType next_file = m_archiveHeader.first_file_pos;
+    HeaderReadAhead reader(m_archive.get());
+    for(const DirectoryEntry &entry : m_directory)
+    {
+        if(next_file != entry.header.cur_file_pos)
+        {
+            return false;
+        }
+        // in a batch the header is checked as commit will write it
+        bool pending = m_batch && m_batch->dirtyHeaders.count(next_file) != 0;
+        DirectoryEntry onDisk = pending ? entry : reader.read(next_file);
+        const FileHeader &fih = onDisk.header;
+        if(fih.file_size != entry.header.file_size || fih.checksum != entry.header.checksum
+           || fih.name_size != entry.header.name_size || fih.file_type != entry.header.file_type
+           || fih.compression_alg != entry.header.compression_alg
+           || fih.compression_alg_args != entry.header.compression_alg_args
+           || onDisk.name != entry.name)
+        {
+            return false;
+        }
+        next_file = fih.next_file_pos;
+    }
+    if(next_file != 0)
+    {
+        return false;
+    }
     if(!distPairs.empty())
     {
         std::sort(distPairs.begin(), distPairs.end());
@@ -533,58 +1053,149 @@ bool ArchiveParser::checkArchiveConsistency() const
 
 void ArchiveParser::addFile(const char *name, std::istream &file, const CompressionStrategy &comps, const char *tempFilePath)
 {
-    std::array<char, 7> tempSuffix;
+    // the entry is written straight into the archive, no temporary file is needed
+    (void) tempFilePath;
+    ingestFile(name, file, comps);
+}
+
+void ArchiveParser::addFileFromPath(const char *name, const char *filePath, const CompressionStrategy &comps)
+{
+    std::ifstream file(filePath, std::ifstream::in | std::ifstream::binary);
+    if(!file.is_open())
+    {
+        throw std::runtime_error(std::string("Can not open ") + filePath);
+    }
+    file.exceptions(std::ifstream::badbit | std::ifstream::failbit);
+    ingestFile(name, file, comps, filePath);
+}
+
+void ArchiveParser::addFile(const char *name, std::istream &file, const CompressionStrategy &comps, std::iostream &temp_file)
+{
+    (void) temp_file;
+    ingestFile(name, file, comps);
+}
+
+namespace
+{
+// Writes the data of an entry into the space allocated for it, computing
+// its CRC on the way. Writes that do not fit are dropped and set overflow.
+class EntryDataSink final : public ByteSink
+{
+private:
+    // set when writing to a stream
+    std::unique_ptr<OstreamSink> streamOut;
+    ByteSink &out;
+    std::size_t capacity;
+    CRC32 crc;
+
+public:
+    std::size_t written = 0;
+    bool overflow = false;
+
+    EntryDataSink(std::ostream &_out, std::size_t _capacity)
+        : streamOut(std::make_unique<OstreamSink>(_out)), out(*streamOut), capacity(_capacity)
+    { }
+
+    EntryDataSink(ByteSink &_out, std::size_t _capacity)
+        : out(_out), capacity(_capacity)
+    { }
+
+    void write(const std::uint8_t *data, std::size_t size) override
+    {
+        if(overflow || size > capacity - written)
+        {
+            overflow = true;
+            return;
+        }
+        out.write(data, size);
+        crc(data, size);
+        written += size;
+    }
 
-    std::random_device rdev;
-    std::mt19937 gen(rdev());
-    std::uniform_int_distribution<unsigned> dist(0, 61);
+    // size bytes with the CRC data_crc that were written to the archive
+    // some other way
+    void countCopied(std::uint32_t data_crc, std::size_t size)
+    {
+        crc = CRC32(CRC32::combine(crc.getResult(), data_crc, size));
+        written += size;
+    }
 
-    for(unsigned i=0; i<tempSuffix.size()-1; ++i)
+    std::uint32_t getCrc() const
+    {
+        return crc.getResult();
+    }
+};
+} // namespace
+
+// false if the compression was given up, see EarlyAbortPolicy
+// input_crc - if not nullptr, gets the CRC of the input read
+static bool compressFileContents (std::istream &file, std::size_t file_size, const ArchiveParser::CompressionStrategy &comps,
+                                  const ArchiveParser::EarlyAbortPolicy &policy, EntryDataSink &sink, std::size_t &peak_memory,
+                                  CRC32 *input_crc = nullptr)
+{
+    std::unique_ptr<PushCompressor> comp = comps.getPushCompressor(sink, file_size);
+    std::vector<std::uint8_t> buf(std::min(file_size, CODEC_STREAM_BLOCK_SIZE));
+    std::size_t read = 0;
+    while(read < file_size)
     {
-        unsigned code = dist(gen);
-        char chr;
-        if(code < 26)
+        std::size_t cur = std::min(file_size - read, buf.size());
+        file.read(reinterpret_cast<char*>(buf.data()), static_cast<std::streamsize>(cur)); // NOLINT
+        comp->feed(buf.data(), cur);
+        if(input_crc != nullptr)
         {
-            chr = static_cast<char>(code - 0 + 'A');
+            (*input_crc)(buf.data(), cur);
         }
-        else if(code < 26+26)
+        read += cur;
+        if(sink.overflow)
         {
-            chr = static_cast<char>(code - 26 + 'a');
+            return false;
         }
-        else 
+        // the compressor buffers some output, so this errs towards going on
+        if(policy.probeWindow != 0 && read >= policy.probeWindow
+           && static_cast<double>(sink.written) > policy.maxRatio * static_cast<double>(read))
         {
-            chr = static_cast<char>(code - (26+26) + '0');
+            return false;
         }
-        tempSuffix[i] = chr;
     }
-    tempSuffix.back()='\0';
-
-    std::string tempFileName = std::string(tempFilePath) + std::string(name) + ".temp." + tempSuffix.data();
+    comp->flush();
+    peak_memory = comp->peakMemoryUsage();
+    return !sink.overflow;
+}
 
-    if(boost::filesystem::exists(tempFileName))
+static void copyFileContents (std::istream &file, std::size_t file_size, ByteSink &sink)
+{
+    std::vector<std::uint8_t> buf(std::min(file_size, CODEC_STREAM_BLOCK_SIZE));
+    while(file_size > 0)
     {
-        throw std::runtime_error("Temporary file with name: " + tempFileName + " exists!");
+        std::size_t cur = std::min(file_size, buf.size());
+        file.read(reinterpret_cast<char*>(buf.data()), static_cast<std::streamsize>(cur)); // NOLINT
+        sink.write(buf.data(), cur);
+        file_size -= cur;
     }
+}
 
-    std::fstream temp_file(tempFileName, 
-                std::fstream::in | std::fstream::out | std::fstream::trunc | std::fstream::binary); // no option O_CREAT :(
+// What the dictionaries of a new entry are clamped to. Entries compressed
+// at the same time are already counted by clampLevel, so they clamp to the
+// whole limit instead of to what their peers leave at the moment: the level
+// then does not depend on timing and the same input gives the same archive.
+static std::size_t clampBudget(const ArchiveParser::CompressionStrategy &comps)
+{
+    const MemoryBudget &budget = MemoryBudget::global();
+    return comps.m_concurrentEntries > 1 ? budget.getLimit() : budget.available();
+}
 
-    try
-    {
-        addFile(name, file, comps, temp_file);
-    }
-    catch(...)
+static ArchiveParser::CompressionStrategy resolveFileStrategy(std::istream &file, std::size_t file_size,
+                                                              const ArchiveParser::CompressionStrategy &requested_comps)
+{
+    ArchiveParser::CompressionStrategy comps = requested_comps;
+    if(comps.m_alg == ArchiveParser::CompressionStrategy::Algorithm::automatic)
     {
-        temp_file.close();
-        boost::filesystem::remove(tempFileName);
-        throw;
+        comps = comps.resolve(sampleStream(file, file_size));
     }
-
-    temp_file.close();
-    boost::filesystem::remove(tempFileName);
+    return comps.clampLevel(file_size, clampBudget(comps));
 }
 
-void ArchiveParser::addFile(const char *name, std::istream &file, const CompressionStrategy &comps, std::iostream &temp_file)
+std::size_t ArchiveParser::checkNewFileName(const char *name) const
 {
     std::size_t nameSize = std::strlen(name);
     if(nameSize > std::numeric_limits<uint16_t>::max() - 1)
@@ -595,78 +1206,346 @@ void ArchiveParser::addFile(const char *name, std::istream &file, const Compress
     {
         throw std::runtime_error(std::string("File with the name \"") + name + "\" already exits");
     }
+    return nameSize;
+}
 
-    temp_file.exceptions(std::iostream::badbit | std::iostream::failbit);
+void ArchiveParser::ingestFile(const char *name, std::istream &file, const CompressionStrategy &requested_comps,
+                               const char *sourcePath)
+{
+    std::size_t nameSize = checkNewFileName(name);
 
-    std::unique_ptr<Compressor> comp = comps.getCompressor(temp_file);
-    Compressor &com = *comp;
-    //LZWCompressor<16> lzwC(temp_file); //NOLINT
     file.seekg(0, std::istream::end);
     std::size_t file_size = static_cast<std::size_t>(file.tellg());
     file.seekg(0, std::istream::beg);
-    com(file, file_size);
-    com.finish();
 
-    temp_file.seekg(0, std::istream::end);
-    std::size_t compressed_file_size = static_cast<std::size_t>(temp_file.tellg());
-    temp_file.seekg(0, std::istream::beg);
+    CompressionStrategy comps = resolveFileStrategy(file, file_size, requested_comps);
+
+    // The space is allocated for the uncompressed size, the stored fallback
+    // has to fit in it too. What compression saves stays free after the entry.
+    invalidateDirectory();
+    FileOffsetType allocated = calculateFileEntrySize(nameSize, file_size);
+    FileOffsetType newEntryPos = allocateFileEntrySpace(allocated);
+    FileOffsetType dataPos = newEntryPos + FileHeader::HEADER_SIZE + nameSize;
 
-    if(compressed_file_size >= file_size)
+    std::iostream &archive = m_archive.get(); // NOLINT
+    std::streamoff old_pos = archive.tellp();
+    std::unique_ptr<EntryDataSink> sink;
+    try
+    {
+        // the entry is written front to back, so it can extend the archive;
+        // the header is a placeholder until the size and checksum are known
+        archive.seekp(static_cast<std::streamoff>(newEntryPos), std::iostream::beg);
+        std::array<char, FileHeader::HEADER_SIZE> placeholder{};
+        archive.write(placeholder.data(), placeholder.size());
+        archive.write(name, static_cast<std::streamsize>(nameSize));
+
+        m_lastPeakDictMemory = 0;
+        sink = std::make_unique<EntryDataSink>(archive, file_size);
+        bool store = comps.m_alg == CompressionStrategy::Algorithm::none;
+        // a stored entry can be copied inside the kernel only when the CRC
+        // of the source is known from a complete compression pass,
+        // otherwise the buffered copy computes it
+        bool kernelCopy = sourcePath != nullptr && !m_archivePath.empty();
+        CRC32 inputCrc;
+        bool inputCrcKnown = false;
+        if(!store)
+        {
+            bool completed = compressFileContents(file, file_size, comps, m_earlyAbort, *sink, m_lastPeakDictMemory,
+                                                  kernelCopy ? &inputCrc : nullptr);
+            if(!completed && !sink->overflow)
+            {
+                ++m_earlyAbortCount;
+            }
+            inputCrcKnown = completed;
+            // compressed data that is not smaller than the input is not kept
+            store = !completed || sink->written >= file_size;
+        }
+        if(store)
+        {
+            comps = CompressionStrategy("NONE", 0);
+            file.seekg(0, std::istream::beg);
+            archive.seekp(static_cast<std::streamoff>(dataPos), std::iostream::beg);
+            sink = std::make_unique<EntryDataSink>(archive, file_size);
+            if(kernelCopy && inputCrcKnown)
+            {
+                // the stream has nothing buffered for the entry after this
+                archive.flush();
+                copyFileRange(sourcePath, 0, m_archivePath, dataPos, file_size);
+                sink->countCopied(inputCrc.getResult(), file_size);
+            }
+            else
+            {
+                copyFileContents(file, file_size, *sink);
+            }
+        }
+    } catch(...)
     {
+        releaseFileEntrySpace(newEntryPos, allocated);
+        throw;
+    }
+    archive.seekp(old_pos);
 
-        std::size_t entrySize = calculateFileEntrySize(nameSize, file_size);
-        FileOffsetType newEntryPos = allocateFileEntrySpace(entrySize);
+    FileHeader fih; // NOLINT
+    fih.cur_file_pos = newEntryPos;
+    fih.next_file_pos = 0;
+    fih.file_size = sink->written;
+    fih.name_size = static_cast<std::uint16_t>(nameSize);
+    fih.file_type = fileType::file;
+    fih.compression_alg = comps.getAlgVal();
+    fih.compression_alg_args = comps.getAlgOptionsVal();
+    calcCrcFileEntry(fih, name, sink->getCrc());
+
+    writeFileHeader(fih);
+    linkFileEntry(fih, name);
+    // what compression saved
+    FileOffsetType used = calculateFileEntrySize(nameSize, fih.file_size);
+    releaseFileEntrySpace(newEntryPos + used, allocated - used);
+}
 
-        CompressionStrategy nocomp ("NONE", 0);
+ArchiveParser::PreparedFile ArchiveParser::prepareFile(const char *name, std::istream &file, const CompressionStrategy &requested_comps,
+                                                       const EarlyAbortPolicy &earlyAbort, const SpillPolicy &spill)
+{
+    PreparedFile res;
+    res.m_name = name;
+    if(res.m_name.size() > std::numeric_limits<uint16_t>::max() - 1)
+    {
+        throw std::runtime_error(std::string("Name: \"") + name + "\" too large!");
+    }
 
-        FileHeader fih; // NOLINT
-        fih.cur_file_pos = newEntryPos;
-        fih.next_file_pos = 0;
-        fih.file_size = file_size;
-        fih.name_size = static_cast<std::uint16_t>(nameSize);
-        fih.file_type = fileType::file;
-        fih.compression_alg = nocomp.getAlgVal();
-        fih.compression_alg_args = nocomp.getAlgOptionsVal();
+    file.seekg(0, std::istream::end);
+    std::size_t file_size = static_cast<std::size_t>(file.tellg());
+    file.seekg(0, std::istream::beg);
 
-        file.seekg(0, std::istream::beg);
-        calcCrcFileEntry(fih, name, file, file_size);
+    CompressionStrategy comps = resolveFileStrategy(file, file_size, requested_comps);
 
+    // nothing larger than the file is kept, it is stored instead
+    res.m_data = std::make_unique<SpillBuffer>(spill.memoryLimit, file_size, spill.tempDir);
+    auto sink = std::make_unique<EntryDataSink>(*res.m_data, file_size);
+    bool store = comps.m_alg == CompressionStrategy::Algorithm::none;
+    if(!store)
+    {
+        bool completed = compressFileContents(file, file_size, comps, earlyAbort, *sink, res.m_peakDictMemory);
+        res.m_earlyAborted = !completed && !sink->overflow;
+        store = !completed || sink->written >= file_size;
+    }
+    if(store)
+    {
+        comps = CompressionStrategy("NONE", 0);
         file.seekg(0, std::istream::beg);
-        writeFileEntry(fih, name, file, file_size);
+        sink.reset();
+        res.m_data = std::make_unique<SpillBuffer>(spill.memoryLimit, file_size, spill.tempDir);
+        sink = std::make_unique<EntryDataSink>(*res.m_data, file_size);
+        copyFileContents(file, file_size, *sink);
     }
-    else
+    res.m_comps = comps;
+    res.m_dataCrc = sink->getCrc();
+    return res;
+}
+
+void ArchiveParser::addPreparedFile(PreparedFile &&file)
+{
+    const char *name = file.m_name.c_str();
+    std::size_t nameSize = checkNewFileName(name);
+
+    invalidateDirectory();
+    FileOffsetType dataSize = file.m_data->size();
+    FileOffsetType entrySize = calculateFileEntrySize(nameSize, dataSize);
+    FileOffsetType newEntryPos = allocateFileEntrySpace(entrySize);
+
+    std::iostream &archive = m_archive.get(); // NOLINT
+    std::streamoff old_pos = archive.tellp();
+    try
     {
-        std::size_t entrySize = calculateFileEntrySize(nameSize, compressed_file_size);
-        FileOffsetType newEntryPos = allocateFileEntrySpace(entrySize);
+        archive.seekp(static_cast<std::streamoff>(newEntryPos), std::iostream::beg);
+        std::array<char, FileHeader::HEADER_SIZE> placeholder{};
+        archive.write(placeholder.data(), placeholder.size());
+        archive.write(name, static_cast<std::streamsize>(nameSize));
+        OstreamSink out(archive);
+        file.m_data->readAll(out);
+    } catch(...)
+    {
+        releaseFileEntrySpace(newEntryPos, entrySize);
+        throw;
+    }
+    archive.seekp(old_pos);
 
-        FileHeader fih; // NOLINT
-        fih.cur_file_pos = newEntryPos;
-        fih.next_file_pos = 0;
-        fih.file_size = compressed_file_size;
-        fih.name_size = static_cast<std::uint16_t>(nameSize);
-        fih.file_type = fileType::file;
-        fih.compression_alg = comps.getAlgVal();
-        fih.compression_alg_args = comps.getAlgOptionsVal();
+    FileHeader fih; // NOLINT
+    fih.cur_file_pos = newEntryPos;
+    fih.next_file_pos = 0;
+    fih.file_size = dataSize;
+    fih.name_size = static_cast<std::uint16_t>(nameSize);
+    fih.file_type = fileType::file;
+    fih.compression_alg = file.m_comps.getAlgVal();
+    fih.compression_alg_args = file.m_comps.getAlgOptionsVal();
+    calcCrcFileEntry(fih, name, file.m_dataCrc);
+
+    writeFileHeader(fih);
+    linkFileEntry(fih, name);
+    m_lastPeakDictMemory = file.m_peakDictMemory;
+    if(file.m_earlyAborted)
+    {
+        ++m_earlyAbortCount;
+    }
+    // removes the temporary file if there is one
+    file.m_data.reset();
+}
+
+namespace
+{
+// reading up to the end of a stream sets failbit, which callers often
+// turn into exceptions; only badbit throws while this is alive
+class StreamExceptionsGuard
+{
+private:
+    std::istream &ins;
+    std::ios::iostate oldExceptions;
+
+public:
+    explicit StreamExceptionsGuard(std::istream &_ins) : ins(_ins), oldExceptions(_ins.exceptions())
+    {
+        ins.exceptions(std::ios::badbit);
+    }
+
+    StreamExceptionsGuard(const StreamExceptionsGuard&) = delete;
+    StreamExceptionsGuard& operator= (const StreamExceptionsGuard&) = delete;
+    StreamExceptionsGuard(StreamExceptionsGuard&&) = delete;
+    StreamExceptionsGuard& operator= (StreamExceptionsGuard&&) = delete;
 
-        temp_file.seekg(0, std::istream::beg);
-        calcCrcFileEntry(fih, name, temp_file, compressed_file_size);
+    ~StreamExceptionsGuard()
+    {
+        ins.clear();
+        try
+        {
+            ins.exceptions(oldExceptions);
+        } catch(...)
+        {
 
-        temp_file.seekg(0, std::istream::beg);
-        writeFileEntry(fih, name, temp_file, compressed_file_size);
+        }
     }
+};
+} // namespace
+
+// reads until size bytes or the end of the stream, returns what was read
+static std::size_t readUpTo(std::istream &ins, std::uint8_t *buf, std::size_t size)
+{
+    ins.read(reinterpret_cast<char*>(buf), static_cast<std::streamsize>(size)); // NOLINT
+    return static_cast<std::size_t>(ins.gcount());
 }
 
-std::string ArchiveParser::readFileName (const FileHeader &header) const
+void ArchiveParser::addFileStream(const char *name, std::istream &file, const CompressionStrategy &requested_comps)
 {
+    std::size_t nameSize = checkNewFileName(name);
+    StreamExceptionsGuard guard(file);
+
+    // The head of the stream is kept in memory: AUTO looks at it and the
+    // early abort decides on it. Up to m_spill.maxSize of the input is kept
+    // as well, so the entry can still be stored when compression does not
+    // pay off after the head.
+    std::vector<std::uint8_t> head(std::max(m_earlyAbort.probeWindow, CODEC_STREAM_BLOCK_SIZE));
+    std::size_t headSize = readUpTo(file, head.data(), head.size());
+    bool wholeInHead = headSize < head.size();
+
+    CompressionStrategy comps = requested_comps;
+    if(comps.m_alg == CompressionStrategy::Algorithm::automatic)
+    {
+        ByteHistogram sample;
+        sample.add(head.data(), headSize);
+        comps = comps.resolve(sample);
+    }
+    std::uint64_t sizeBound = wholeInHead ? headSize : std::numeric_limits<std::uint64_t>::max();
+    comps = comps.clampLevel(sizeBound, clampBudget(comps));
+
     std::iostream &archive = m_archive.get(); // NOLINT
-    std::streamoff old_off = archive.tellg();
-    archive.seekg(header.cur_file_pos+FileHeader::HEADER_SIZE, std::iostream::beg); // NOLINT
-    std::string res;
-    res.resize(header.name_size);
-    archive.read(const_cast<char*>(res.data()), header.name_size); // NOLINT
-    archive.seekg(old_off);
+    std::streamoff old_pos = archive.tellp();
+    invalidateDirectory();
+    // the size is not known, so the entry goes behind the last one; the
+    // header and the name are claimed up front and m_dataEnd moves past the
+    // data once it is complete
+    FileOffsetType newEntryPos = m_dataEnd;
+    FileOffsetType claimed = calculateFileEntrySize(nameSize, 0);
+    m_dataEnd += claimed;
+    FileOffsetType dataPos = newEntryPos + FileHeader::HEADER_SIZE + nameSize;
+
+    std::unique_ptr<EntryDataSink> sink;
+    try
+    {
+        archive.seekp(static_cast<std::streamoff>(newEntryPos), std::iostream::beg);
+        std::array<char, FileHeader::HEADER_SIZE> placeholder{};
+        archive.write(placeholder.data(), placeholder.size());
+        archive.write(name, static_cast<std::streamsize>(nameSize));
+
+        std::vector<std::uint8_t> buf(CODEC_STREAM_BLOCK_SIZE);
+        m_lastPeakDictMemory = 0;
+        sink = std::make_unique<EntryDataSink>(archive, std::numeric_limits<std::size_t>::max());
+        bool store = comps.m_alg == CompressionStrategy::Algorithm::none;
+        // what is read past the head while compressing
+        std::unique_ptr<SpillBuffer> rest;
+        if(!store)
+        {
+            std::unique_ptr<PushCompressor> comp = comps.getPushCompressor(*sink, wholeInHead ? headSize : 0);
+            comp->feed(head.data(), headSize);
+            if(wholeInHead)
+            {
+                comp->flush();
+                store = sink->written >= headSize;
+            }
+            else if(m_earlyAbort.probeWindow != 0
+                    && static_cast<double>(sink->written) > m_earlyAbort.maxRatio * static_cast<double>(headSize))
+            {
+                ++m_earlyAbortCount;
+                store = true;
+            }
+            else
+            {
+                rest = std::make_unique<SpillBuffer>(m_spill.memoryLimit, m_spill.maxSize, m_spill.tempDir);
+                std::size_t cur = 0;
+                while((cur = readUpTo(file, buf.data(), buf.size())) != 0)
+                {
+                    comp->feed(buf.data(), cur);
+                    rest->write(buf.data(), cur);
+                }
+                comp->flush();
+                // past maxSize there is no way back to storing the entry
+                store = !rest->overflowed() && sink->written >= headSize + rest->size();
+            }
+            m_lastPeakDictMemory = comp->peakMemoryUsage();
+        }
+        if(store)
+        {
+            comps = CompressionStrategy("NONE", 0);
+            archive.seekp(static_cast<std::streamoff>(dataPos), std::iostream::beg);
+            sink = std::make_unique<EntryDataSink>(archive, std::numeric_limits<std::size_t>::max());
+            sink->write(head.data(), headSize);
+            if(rest)
+            {
+                rest->readAll(*sink);
+            }
+            std::size_t cur = 0;
+            while(!wholeInHead && (cur = readUpTo(file, buf.data(), buf.size())) != 0)
+            {
+                sink->write(buf.data(), cur);
+            }
+        }
+    } catch(...)
+    {
+        releaseFileEntrySpace(newEntryPos, claimed);
+        throw;
+    }
+    archive.seekp(old_pos);
 
-    return res;
+    FileHeader fih; // NOLINT
+    fih.cur_file_pos = newEntryPos;
+    fih.next_file_pos = 0;
+    fih.file_size = sink->written;
+    fih.name_size = static_cast<std::uint16_t>(nameSize);
+    fih.file_type = fileType::file;
+    fih.compression_alg = comps.getAlgVal();
+    fih.compression_alg_args = comps.getAlgOptionsVal();
+    calcCrcFileEntry(fih, name, sink->getCrc());
+
+    writeFileHeader(fih);
+    m_dataEnd = newEntryPos + calculateFileEntrySize(nameSize, fih.file_size);
+    linkFileEntry(fih, name);
 }
 
 void ArchiveParser::readAndDecompressFileContents (const FileHeader &header, std::ostream &out) const
@@ -679,85 +1558,108 @@ void ArchiveParser::readAndDecompressFileContents (const FileHeader &header, std
     archive.seekg(newOff, std::iostream::beg);
     //LZWDecompressor<16> lzwD(out); // TODO: this
     CompressionStrategy comps(header.compression_alg, header.compression_alg_args);
-    std::unique_ptr<Decompressor> decp = comps.getDecompressor(out);
+    std::unique_ptr<Decompressor> decp = comps.getDecompressor(out, header.file_size);
     Decompressor &dec = *decp;
     dec(archive, header.file_size);
+    m_lastPeakDictMemory = dec.peakMemoryUsage();
     archive.seekg(oldOff);
 }
 
 ArchiveParser::const_iterator ArchiveParser::cbefore_begin() const
 {
-    return FileIterator(*this, archiveHeader::FIRST_FILE_FIELD_POS);
+    return FileIterator(*this, FileIterator::BEFORE_BEGIN);
 }
 
 ArchiveParser::const_iterator ArchiveParser::cbegin() const
 {
-    return FileIterator(*this, m_archiveHeader.first_file_pos);
+    return FileIterator(*this, 0);
 }
 
 ArchiveParser::const_iterator ArchiveParser::cend() const
 {
-    return FileIterator(*this, 0);
+    return FileIterator(*this, m_directory.size());
 }
 
 ArchiveParser::FileIterator& ArchiveParser::FileIterator::operator++()
 {
-    assert(m_filePos != 0);
+    assert(m_index != m_archive.m_directory.size());
 
-    if(m_filePos == archiveHeader::FIRST_FILE_FIELD_POS)
-    {
-        m_filePos = m_archive.m_archiveHeader.first_file_pos;
-    }
-    else
-    {
-        FileHeader fih = m_archive.readFileHeader(m_filePos);
-        m_filePos = fih.next_file_pos;
-    }
+    m_index = m_index == BEFORE_BEGIN ? 0 : m_index + 1;
     return *this;
 }
 
 ArchiveParser::FileInfo& ArchiveParser::FileIterator::operator*()
 {
-    assert(m_filePos != archiveHeader::FIRST_FILE_FIELD_POS);
-    m_fileInfo = FileInfo(m_archive, m_filePos);
+    assert(m_index < m_archive.m_directory.size());
+    m_fileInfo = FileInfo(m_archive, m_archive.m_directory[m_index]);
 
     return m_fileInfo;
 }
 
 ArchiveParser::const_iterator ArchiveParser::findFile(const char *name) const
 {
-    for(const_iterator it=this->cbegin(); it != this->cend(); ++it)
+    auto found = m_nameIndex.find(name);
+    if(found == m_nameIndex.end())
     {
-        if(it->getFileName() == name)
-        {
-            return it;
-        }
+        return this->cend();
     }
-
-    return this->cend();
+    return FileIterator(*this, entryIndex(found->second));
 }
 
-void ArchiveParser::deleteAfter(const_iterator pos)
+void ArchiveParser::deleteAfter(const_iterator pos, bool reclaimSpace)
 {
-    if(pos.m_filePos == 0)
+    std::size_t index = pos.m_index == FileIterator::BEFORE_BEGIN ? 0 : pos.m_index + 1;
+    if(pos.m_index == m_directory.size() || index == m_directory.size())
     {
         return;
     }
-    FileHeader prevFileHeader = readFileHeader(pos.m_filePos);
-    if(prevFileHeader.next_file_pos == 0)
+    invalidateDirectory();
+    FileOffsetType nextFileOff = m_directory[index].header.next_file_pos;
+    if(index == 0)
     {
-        return;
+        m_archiveHeader.first_file_pos = nextFileOff;
+        writeArchiveHeader();
+    }
+    else
+    {
+        FileHeader &prevFileHeader = m_directory[index - 1].header;
+        prevFileHeader.next_file_pos = nextFileOff;
+        writeFileHeader(prevFileHeader);
     }
-    FileHeader curFileHeader = readFileHeader(prevFileHeader.next_file_pos);
-    FileOffsetType nextFileOff = curFileHeader.next_file_pos;
-    prevFileHeader.next_file_pos = nextFileOff;
-    writeFileHeader(prevFileHeader);
-    if(getLastFilePos() == curFileHeader.cur_file_pos)
+    std::string name = std::move(m_directory[index].name);
+    std::uint64_t seq = m_directory[index].seq;
+    FileOffsetType entryPos = m_directory[index].header.cur_file_pos;
+    FileOffsetType entrySize = calculateFileEntrySize(m_directory[index].header.name_size, m_directory[index].header.file_size);
+    m_directory.erase(m_directory.begin() + static_cast<std::ptrdiff_t>(index));
+    releaseFileEntrySpace(entryPos, entrySize);
+    auto found = m_nameIndex.find(name);
+    if(found != m_nameIndex.end() && found->second == seq)
     {
-        updateLastFilePos(prevFileHeader.cur_file_pos);
+        m_nameIndex.erase(found);
+        // a repeated name now maps to its next entry
+        for(std::size_t i=index; m_repeatedNames && i<m_directory.size(); i++)
+        {
+            if(m_directory[i].name == name)
+            {
+                m_nameIndex.emplace(name, m_directory[i].seq);
+                break;
+            }
+        }
     }
 
-    // TODO: punch POSIX hole in the file
+    if(reclaimSpace && !m_archivePath.empty() && m_batch)
+    {
+        m_batch->punched.emplace_back(entryPos, entrySize);
+    }
+    else if(reclaimSpace && !m_archivePath.empty())
+    {
+        // buffered writes to the range would allocate it again
+        m_archive.get().flush();
+        if(punchFileHole(m_archivePath, entryPos, entrySize))
+        {
+            m_punchedBytes += entrySize;
+        }
+    }
 }
 
 void ArchiveParser::readFile(const char *name, std::ostream &out) const
@@ -770,21 +1672,15 @@ void ArchiveParser::readFile(const char *name, std::ostream &out) const
     itf->readFile(out);
 }
 
-void ArchiveParser::deleteFile(const char *name)
+void ArchiveParser::deleteFile(const char *name, bool reclaimSpace)
 {
-    const_iterator prev = cbefore_begin();
-    const_iterator cur = cbegin();
-
-    while(cur != cend())
+    auto found = m_nameIndex.find(name);
+    if(found == m_nameIndex.end())
     {
-        if(cur->getFileName() == name)
-        {
-            deleteAfter(prev);
-            return;
-        }
-
-        ++prev; ++cur;
+        return;
     }
+    std::size_t index = entryIndex(found->second);
+    deleteAfter(FileIterator(*this, index == 0 ? FileIterator::BEFORE_BEGIN : index - 1), reclaimSpace);
 }
 
 ArchiveParser::fileType ArchiveParser::getFileType(const char *name) const
@@ -811,6 +1707,7 @@ void ArchiveParser::addFolder(const char *name)
 
     std::size_t entrySize = calculateFileEntrySize(nameSize, 0);
 
+    invalidateDirectory();
     FileOffsetType newEntryPos = allocateFileEntrySpace(entrySize);
 
     CompressionStrategy nocomp("NONE", 0);
@@ -845,3 +1742,163 @@ bool ArchiveParser::verify() const
 
     return true;
 }
+
+ArchiveParser::ArchiveStats ArchiveParser::getStats() const
+{
+    std::iostream &archive = m_archive.get(); // NOLINT
+    archive.flush();
+    std::streamoff old_off = archive.tellg();
+    archive.seekg(0, std::iostream::end);
+    FileOffsetType size = static_cast<FileOffsetType>(archive.tellg());
+    archive.seekg(old_off);
+
+    ArchiveStats res{};
+    res.entries = m_directory.size();
+    res.logicalSize = size;
+    res.physicalSize = m_archivePath.empty() ? size : allocatedFileSize(m_archivePath);
+    res.freeBytes = m_freeSpace.freeBytes();
+    res.holes = m_freeSpace.size();
+    res.punchedBytes = m_punchedBytes;
+    return res;
+}
+
+// entries are moved in pieces of this size
+static constexpr std::size_t COMPACT_BUFFER_SIZE = 1024 * 1024;
+
+// copies size bytes from srcPos of src to dstPos of dst, front to back
+static void copyArchiveRange(std::istream &src, std::uint64_t srcPos, std::ostream &dst, std::uint64_t dstPos,
+                             std::uint64_t size, std::vector<std::uint8_t> &buf)
+{
+    std::uint64_t done = 0;
+    while(done < size)
+    {
+        std::size_t cur = static_cast<std::size_t>(std::min<std::uint64_t>(size - done, buf.size()));
+        src.seekg(static_cast<std::streamoff>(srcPos + done), std::istream::beg);
+        src.read(reinterpret_cast<char*>(buf.data()), static_cast<std::streamsize>(cur)); // NOLINT
+        dst.seekp(static_cast<std::streamoff>(dstPos + done), std::ostream::beg);
+        dst.write(reinterpret_cast<const char*>(buf.data()), static_cast<std::streamsize>(cur)); // NOLINT
+        done += cur;
+    }
+}
+
+void ArchiveParser::moveFileEntry(std::size_t index, FileOffsetType newPos, std::vector<std::uint8_t> &buf)
+{
+    std::iostream &archive = m_archive.get(); // NOLINT
+    FileHeader &fih = m_directory[index].header;
+    std::streamoff old_g = archive.tellg();
+    std::streamoff old_p = archive.tellp();
+    copyArchiveRange(archive, fih.cur_file_pos, archive, newPos, calculateFileEntrySize(fih.name_size, fih.file_size), buf);
+    archive.seekg(old_g);
+    archive.seekp(old_p);
+    fih.cur_file_pos = newPos;
+    // the old copy stays linked until here
+    if(index == 0)
+    {
+        m_archiveHeader.first_file_pos = newPos;
+        writeArchiveHeader();
+    }
+    else
+    {
+        FileHeader &prev = m_directory[index - 1].header;
+        prev.next_file_pos = newPos;
+        writeFileHeader(prev);
+    }
+}
+
+// The entries are placed in list order from the start of the data. Before
+// one is copied to its place, the entries that are not placed yet and are
+// in the way are moved behind the data end, so the list in the file stays
+// valid after every step. Every entry that is not placed yet lies after
+// the placed ones, so an entry only ever moves towards the start and can be
+// copied front to back.
+void ArchiveParser::compact()
+{
+    if(m_batch)
+    {
+        throw std::runtime_error("An archive can not be compacted in a batch");
+    }
+    invalidateDirectory();
+    std::vector<std::uint8_t> buf(COMPACT_BUFFER_SIZE);
+    // position -> index of the entries that are not placed yet
+    std::map<FileOffsetType, std::size_t> unplaced;
+    for(std::size_t i=0; i<m_directory.size(); i++)
+    {
+        unplaced.emplace(m_directory[i].header.cur_file_pos, i);
+    }
+    FileOffsetType target = m_archiveHeader.header_version == 0 ? archiveHeader::V0_SIZE : archiveHeader::V1_SIZE;
+    for(std::size_t i=0; i<m_directory.size(); i++)
+    {
+        const FileHeader &fih = m_directory[i].header;
+        FileOffsetType size = calculateFileEntrySize(fih.name_size, fih.file_size);
+        unplaced.erase(fih.cur_file_pos);
+        if(fih.cur_file_pos != target)
+        {
+            auto blocker = unplaced.lower_bound(target);
+            while(blocker != unplaced.end() && blocker->first < target + size)
+            {
+                std::size_t blockerIndex = blocker->second;
+                const FileHeader &bih = m_directory[blockerIndex].header;
+                FileOffsetType blockerSize = calculateFileEntrySize(bih.name_size, bih.file_size);
+                FileOffsetType newPos = m_dataEnd;
+                moveFileEntry(blockerIndex, newPos, buf);
+                m_dataEnd += blockerSize;
+                unplaced.erase(blocker);
+                unplaced.emplace(newPos, blockerIndex);
+                blocker = unplaced.lower_bound(target);
+            }
+            moveFileEntry(i, target, buf);
+        }
+        target += size;
+    }
+    m_dataEnd = target;
+    m_freeSpace.clear();
+    flush();
+
+    if(!m_archivePath.empty())
+    {
+        FileOffsetType end = m_archiveHeader.header_version == 0 ? m_dataEnd
+                                 : m_archiveHeader.directory_pos + m_archiveHeader.directory_size;
+        boost::filesystem::resize_file(m_archivePath, end);
+    }
+}
+
+void ArchiveParser::compactTo(const char *archivePath) const
+{
+    ArchiveParser dest = MakeArchive(archivePath);
+    copyEntriesTo(dest);
+}
+
+void ArchiveParser::compactTo(std::iostream &archive) const
+{
+    ArchiveParser dest = MakeArchive(archive);
+    copyEntriesTo(dest);
+}
+
+void ArchiveParser::copyEntriesTo(ArchiveParser &dest) const
+{
+    assert(dest.m_directory.empty());
+    std::iostream &src = m_archive.get(); // NOLINT
+    std::streamoff old_g = src.tellg();
+    std::vector<std::uint8_t> buf(COMPACT_BUFFER_SIZE);
+    FileOffsetType target = archiveHeader::V1_SIZE;
+    for(std::size_t i=0; i<m_directory.size(); i++)
+    {
+        DirectoryEntry entry = m_directory[i];
+        FileHeader &fih = entry.header;
+        FileOffsetType size = calculateFileEntrySize(fih.name_size, fih.file_size);
+        FileOffsetType srcPos = fih.cur_file_pos;
+        fih.cur_file_pos = target;
+        fih.next_file_pos = i + 1 < m_directory.size() ? target + size : 0;
+        dest.writeFileHeader(fih);
+        copyArchiveRange(src, srcPos + FileHeader::HEADER_SIZE, dest.m_archive.get(), target + FileHeader::HEADER_SIZE,
+                         size - FileHeader::HEADER_SIZE, buf);
+        dest.m_directory.push_back(std::move(entry));
+        target += size;
+    }
+    src.seekg(old_g);
+    dest.m_archiveHeader.first_file_pos = m_directory.empty() ? 0 : archiveHeader::V1_SIZE;
+    dest.writeArchiveHeader();
+    dest.m_dataEnd = target;
+    dest.rebuildNameIndex();
+    dest.flush();
+}
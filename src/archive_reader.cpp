@@ -0,0 +1,425 @@
+#include "archive_reader.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compressor_base.hpp"
+#include "crc32.hpp"
+#include "file_space.hpp"
+#include "memory_budget.hpp"
+
+// name bytes read together with an entry header when walking the list
+static constexpr std::size_t NAME_READ_AHEAD_SIZE = 256;
+
+ArchiveReader::ArchiveReader(const char *archivePath, Backend backend)
+    : m_fd(::open(archivePath, O_RDONLY | O_CLOEXEC)), m_ownsFd(true), m_path(archivePath), m_backend(backend) // NOLINT
+{
+    if(m_fd < 0)
+    {
+        throw std::runtime_error(std::string("Can not open ") + archivePath);
+    }
+    try
+    {
+        load();
+    } catch(...)
+    {
+        unmap();
+        ::close(m_fd);
+        throw;
+    }
+}
+
+ArchiveReader::ArchiveReader(int fd, Backend backend)
+    : m_fd(fd), m_ownsFd(false), m_backend(backend)
+{
+    try
+    {
+        load();
+    } catch(...)
+    {
+        unmap();
+        throw;
+    }
+}
+
+ArchiveReader::ArchiveReader(const ArchiveReader &other, int fd)
+    : m_fd(fd), m_ownsFd(true), m_path(other.m_path), m_backend(other.m_backend),
+      m_archiveSize(other.m_archiveSize), m_catalog(other.m_catalog), m_blockThreads(other.m_blockThreads)
+{
+    try
+    {
+        struct stat st{};
+        if(::fstat(m_fd, &st) != 0 || static_cast<std::uint64_t>(st.st_size) != m_archiveSize)
+        {
+            throw std::runtime_error("The archive changed since it was opened");
+        }
+        mapArchive();
+    } catch(...)
+    {
+        unmap();
+        ::close(m_fd);
+        throw;
+    }
+}
+
+ArchiveReader ArchiveReader::reopen() const
+{
+    int fd = m_path.empty() ? ::fcntl(m_fd, F_DUPFD_CLOEXEC, 0) : ::open(m_path.c_str(), O_RDONLY | O_CLOEXEC); // NOLINT
+    if(fd < 0)
+    {
+        throw std::runtime_error("Can not reopen the archive");
+    }
+    return ArchiveReader(*this, fd);
+}
+
+ArchiveReader::ArchiveReader(ArchiveReader &&other) noexcept
+    : m_fd(std::exchange(other.m_fd, -1)),
+      m_ownsFd(std::exchange(other.m_ownsFd, false)),
+      m_path(std::move(other.m_path)),
+      m_backend(other.m_backend),
+      m_archiveSize(other.m_archiveSize),
+      m_map(std::exchange(other.m_map, nullptr)),
+      m_catalog(std::move(other.m_catalog)),
+      m_blockThreads(other.m_blockThreads)
+{
+}
+
+ArchiveReader::~ArchiveReader()
+{
+    unmap();
+    if(m_ownsFd)
+    {
+        ::close(m_fd);
+    }
+}
+
+void ArchiveReader::readAt(std::uint64_t pos, std::uint8_t *buf, std::size_t size) const
+{
+    while(size > 0)
+    {
+        ssize_t got = ::pread(m_fd, buf, size, static_cast<off_t>(pos));
+        if(got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(got < 0)
+        {
+            throw std::runtime_error("Can not read the archive");
+        }
+        if(got == 0)
+        {
+            throw std::runtime_error("Archive is corrupted!");
+        }
+        buf += got; // NOLINT
+        pos += static_cast<std::uint64_t>(got);
+        size -= static_cast<std::size_t>(got);
+    }
+}
+
+void ArchiveReader::unmap()
+{
+    if(m_map != nullptr)
+    {
+        ::munmap(const_cast<std::uint8_t*>(m_map), m_archiveSize); // NOLINT
+        m_map = nullptr;
+    }
+}
+
+const std::uint8_t* ArchiveReader::fetch(std::uint64_t pos, std::size_t size, std::vector<std::uint8_t> &buf) const
+{
+    if(pos > m_archiveSize || size > m_archiveSize - pos)
+    {
+        throw std::runtime_error("Archive is corrupted!");
+    }
+    if(m_map != nullptr)
+    {
+        return m_map + pos; // NOLINT
+    }
+    buf.resize(size);
+    readAt(pos, buf.data(), size);
+    return buf.data();
+}
+
+std::size_t ArchiveReader::chunkSize() const
+{
+    // the mapping is handed over whole
+    return m_map != nullptr ? std::numeric_limits<std::size_t>::max() : CODEC_STREAM_BLOCK_SIZE;
+}
+
+void ArchiveReader::mapArchive()
+{
+    if(m_backend != Backend::map || m_archiveSize == 0)
+    {
+        return;
+    }
+    void *map = ::mmap(nullptr, m_archiveSize, PROT_READ, MAP_SHARED, m_fd, 0); // NOLINT
+    if(map == MAP_FAILED) // NOLINT
+    {
+        throw std::runtime_error("Can not map the archive");
+    }
+    m_map = static_cast<const std::uint8_t*>(map);
+}
+
+void ArchiveReader::load()
+{
+    using FileHeader = ArchiveParser::FileHeader;
+    using archiveHeader = ArchiveParser::archiveHeader;
+
+    struct stat st{};
+    if(::fstat(m_fd, &st) != 0)
+    {
+        throw std::runtime_error("Can not read the archive");
+    }
+    m_archiveSize = static_cast<std::uint64_t>(st.st_size);
+    mapArchive();
+    auto catalog = std::make_shared<Catalog>();
+    std::vector<ArchiveParser::DirectoryEntry> &entries = catalog->entries;
+
+    std::vector<std::uint8_t> buf;
+    std::size_t headSize = static_cast<std::size_t>(std::min<std::uint64_t>(m_archiveSize, archiveHeader::V1_SIZE));
+    archiveHeader head = ArchiveParser::decodeArchiveHeader(fetch(0, headSize, buf), headSize);
+
+    bool fromDirectory = false;
+    if(head.header_version >= 1 && head.directory_pos != 0 &&
+       head.directory_pos <= m_archiveSize && head.directory_size <= m_archiveSize - head.directory_pos)
+    {
+        const std::uint8_t *dir = fetch(head.directory_pos, head.directory_size, buf);
+        std::vector<std::uint8_t> dirBuf(dir, dir + head.directory_size); // NOLINT
+        FreeSpaceMap holes;
+        fromDirectory = ArchiveParser::decodeDirectory(dirBuf, head.first_file_pos, entries, holes);
+    }
+
+    std::uint64_t next_file = fromDirectory ? 0 : head.first_file_pos;
+    while(next_file != 0)
+    {
+        // a list longer than this has a loop
+        if(next_file > m_archiveSize || m_archiveSize - next_file < FileHeader::HEADER_SIZE ||
+           entries.size() > m_archiveSize / FileHeader::HEADER_SIZE)
+        {
+            throw std::runtime_error("Archive is corrupted!");
+        }
+        // the header and a short name come in one read
+        std::size_t got = static_cast<std::size_t>(std::min<std::uint64_t>(FileHeader::HEADER_SIZE + NAME_READ_AHEAD_SIZE,
+                                                                           m_archiveSize - next_file));
+        const std::uint8_t *data = fetch(next_file, got, buf);
+        ArchiveParser::DirectoryEntry entry;
+        entry.header = ArchiveParser::decodeFileHeader(data, next_file);
+        std::size_t nameSize = entry.header.name_size;
+        if(nameSize > got - FileHeader::HEADER_SIZE)
+        {
+            data = fetch(next_file, FileHeader::HEADER_SIZE + nameSize, buf);
+        }
+        entry.name.assign(data + FileHeader::HEADER_SIZE, data + FileHeader::HEADER_SIZE + nameSize); // NOLINT
+        next_file = entry.header.next_file_pos;
+        entries.push_back(std::move(entry));
+    }
+
+    catalog->nameIndex.reserve(entries.size());
+    for(std::size_t i=0; i<entries.size(); i++)
+    {
+        catalog->nameIndex.emplace(entries[i].name, i);
+    }
+    m_catalog = std::move(catalog);
+}
+
+namespace
+{
+class FdSink final : public ByteSink
+{
+private:
+    int fd;
+
+public:
+    explicit FdSink(int _fd) : fd(_fd) {}
+
+    void write(const std::uint8_t *data, std::size_t size) override
+    {
+        while(size > 0)
+        {
+            ssize_t res = ::write(fd, data, size);
+            if(res < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(res < 0)
+            {
+                throw std::runtime_error("Can not write the extracted file");
+            }
+            data += res; // NOLINT
+            size -= static_cast<std::size_t>(res);
+        }
+    }
+};
+} // namespace
+
+void ArchiveReader::readEntry(std::size_t index, std::ostream &out) const
+{
+    OstreamSink sink(out);
+    decompressEntry(index, sink);
+}
+
+void ArchiveReader::readEntry(std::size_t index, int outFd) const
+{
+    const ArchiveParser::FileHeader &header = m_catalog->entries.at(index).header;
+    bool stored = header.file_type == fileType::file &&
+                  CompressionStrategy(header.compression_alg, header.compression_alg_args).m_alg == CompressionStrategy::Algorithm::none;
+    off_t outPos = stored ? ::lseek(outFd, 0, SEEK_CUR) : -1;
+    if(outPos < 0)
+    {
+        FdSink sink(outFd);
+        decompressEntry(index, sink);
+        return;
+    }
+    std::uint64_t dataPos = header.cur_file_pos + ArchiveParser::FileHeader::HEADER_SIZE + header.name_size;
+    if(dataPos > m_archiveSize || header.file_size > m_archiveSize - dataPos)
+    {
+        throw std::runtime_error("Archive is corrupted!");
+    }
+    copyFileRange(m_fd, dataPos, outFd, static_cast<std::uint64_t>(outPos), header.file_size);
+    if(::lseek(outFd, outPos + static_cast<off_t>(header.file_size), SEEK_SET) < 0)
+    {
+        throw std::runtime_error("Can not write the extracted file");
+    }
+}
+
+void ArchiveReader::decompressEntry(std::size_t index, ByteSink &sink) const
+{
+    const ArchiveParser::FileHeader &header = m_catalog->entries.at(index).header;
+    if(header.file_type == fileType::folder)
+    {
+        throw std::runtime_error("A folder has no contents");
+    }
+    CompressionStrategy comps(header.compression_alg, header.compression_alg_args);
+    comps.m_threads = m_blockThreads;
+    // Concurrent extractions wait here until the decoder fits in the process
+    // budget. The decoder reserves its dictionaries in entryBudget, so they
+    // are counted once, by this reservation.
+    MemoryReservation memory(MemoryBudget::global(), comps.decompressorMemoryBound(header.file_size),
+                             MemoryReservation::Wait());
+    MemoryBudget entryBudget(memory.size());
+    std::unique_ptr<PushDecompressor> dec = comps.getPushDecompressor(sink, header.file_size, entryBudget);
+
+    std::uint64_t pos = header.cur_file_pos + ArchiveParser::FileHeader::HEADER_SIZE + header.name_size;
+    std::uint64_t left = header.file_size;
+    std::vector<std::uint8_t> buf;
+    while(left > 0)
+    {
+        std::size_t cur = static_cast<std::size_t>(std::min<std::uint64_t>(left, chunkSize()));
+        dec->feed(fetch(pos, cur, buf), cur);
+        pos += cur;
+        left -= cur;
+    }
+    dec->flush();
+}
+
+bool ArchiveReader::verifyEntry(std::size_t index) const
+{
+    const ArchiveParser::FileHeader &header = m_catalog->entries.at(index).header;
+    CRC32 crc;
+    crc(header.file_size);
+    crc(header.name_size);
+    crc(header.file_type);
+    crc(header.compression_alg);
+    crc(header.compression_alg_args);
+
+    // the name and the data follow the header
+    std::uint64_t pos = header.cur_file_pos + ArchiveParser::FileHeader::HEADER_SIZE;
+    std::uint64_t left = header.name_size + header.file_size;
+    std::vector<std::uint8_t> buf;
+    while(left > 0)
+    {
+        std::size_t cur = static_cast<std::size_t>(std::min<std::uint64_t>(left, chunkSize()));
+        crc(fetch(pos, cur, buf), cur);
+        pos += cur;
+        left -= cur;
+    }
+    return crc.getResult() == header.checksum;
+}
+
+boost::optional<ArchiveReader::Entry> ArchiveReader::findFile(const char *name) const
+{
+    auto found = m_catalog->nameIndex.find(name);
+    if(found == m_catalog->nameIndex.end())
+    {
+        return boost::none;
+    }
+    return Entry(*this, found->second);
+}
+
+void ArchiveReader::readFile(const char *name, std::ostream &out) const
+{
+    boost::optional<Entry> entry = findFile(name);
+    if(!entry)
+    {
+        throw std::runtime_error("File not found in archive");
+    }
+    entry->readFile(out);
+}
+
+ArchiveReader::fileType ArchiveReader::getFileType(const char *name) const
+{
+    boost::optional<Entry> entry = findFile(name);
+    if(!entry)
+    {
+        throw std::runtime_error("No file with this name found!");
+    }
+    return entry->getFileType();
+}
+
+bool ArchiveReader::verify() const
+{
+    for(std::size_t i=0; i<m_catalog->entries.size(); i++)
+    {
+        if(!verifyEntry(i))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+const std::string& ArchiveReader::Entry::getFileName() const
+{
+    return m_reader->m_catalog->entries[m_index].name;
+}
+
+ArchiveReader::fileType ArchiveReader::Entry::getFileType() const
+{
+    return m_reader->m_catalog->entries[m_index].header.file_type;
+}
+
+std::uint64_t ArchiveReader::Entry::getCompressedFileSize() const
+{
+    return m_reader->m_catalog->entries[m_index].header.file_size;
+}
+
+ArchiveReader::CompressionStrategy ArchiveReader::Entry::getCompressionStrg() const
+{
+    const ArchiveParser::FileHeader &header = m_reader->m_catalog->entries[m_index].header;
+    return CompressionStrategy(header.compression_alg, header.compression_alg_args);
+}
+
+boost::optional<ArchiveReader::ByteView> ArchiveReader::Entry::getStoredData() const
+{
+    const ArchiveParser::FileHeader &header = m_reader->m_catalog->entries[m_index].header;
+    bool stored = header.file_type == fileType::file &&
+                  getCompressionStrg().m_alg == CompressionStrategy::Algorithm::none;
+    if(m_reader->m_map == nullptr || !stored)
+    {
+        return boost::none;
+    }
+    std::vector<std::uint8_t> unused;
+    std::uint64_t pos = header.cur_file_pos + ArchiveParser::FileHeader::HEADER_SIZE + header.name_size;
+    std::size_t size = static_cast<std::size_t>(header.file_size);
+    return ByteView{m_reader->fetch(pos, size, unused), size};
+}
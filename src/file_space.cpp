@@ -0,0 +1,173 @@
+#include "file_space.hpp"
+
+#include <algorithm>
+#include <array>
+#include <boost/filesystem/operations.hpp>
+#include <cerrno>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/falloc.h>
+#include <sys/sendfile.h>
+#endif
+
+bool punchFileHole(const std::string &path, std::uint64_t offset, std::uint64_t size)
+{
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    if(size == 0)
+    {
+        return true;
+    }
+    int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC); // NOLINT
+    if(fd < 0)
+    {
+        throw std::runtime_error("Can not open " + path);
+    }
+    int res = ::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, // NOLINT
+                          static_cast<off_t>(offset), static_cast<off_t>(size));
+    ::close(fd);
+    return res == 0;
+#else
+    (void) path;
+    (void) offset;
+    (void) size;
+    return false;
+#endif
+}
+
+std::uint64_t allocatedFileSize(const std::string &path)
+{
+#if defined(__linux__)
+    struct stat st{};
+    if(::stat(path.c_str(), &st) != 0)
+    {
+        throw std::runtime_error("Can not stat " + path);
+    }
+    // st_blocks is in 512 byte units whatever the block size is
+    constexpr std::uint64_t STAT_BLOCK_SIZE = 512;
+    return static_cast<std::uint64_t>(st.st_blocks) * STAT_BLOCK_SIZE;
+#else
+    return boost::filesystem::file_size(path);
+#endif
+}
+
+// bytes a buffered copy moves at once
+static constexpr std::size_t COPY_BUFFER_SIZE = 64 * 1024;
+
+static bool copyNotSupported(int err)
+{
+    return err == ENOSYS || err == EINVAL || err == EXDEV || err == EOPNOTSUPP || err == EBADF;
+}
+
+void copyFileRange(int inFd, std::uint64_t inOffset, int outFd, std::uint64_t outOffset, std::uint64_t size)
+{
+#if defined(__linux__)
+    // both fail for some pairs of files (older kernels, other file
+    // systems, pipes), what is left is copied by the next method
+    while(size > 0)
+    {
+        off64_t inOff = static_cast<off64_t>(inOffset);
+        off64_t outOff = static_cast<off64_t>(outOffset);
+        ssize_t res = ::copy_file_range(inFd, &inOff, outFd, &outOff, size, 0);
+        if(res < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(res < 0 && copyNotSupported(errno))
+        {
+            break;
+        }
+        if(res <= 0)
+        {
+            throw std::runtime_error(res == 0 ? "The input of a copy ended early" : "Can not copy file data");
+        }
+        inOffset += static_cast<std::uint64_t>(res);
+        outOffset += static_cast<std::uint64_t>(res);
+        size -= static_cast<std::uint64_t>(res);
+    }
+    // sendfile writes at the position of outFd
+    while(size > 0 && ::lseek(outFd, static_cast<off_t>(outOffset), SEEK_SET) >= 0)
+    {
+        off_t inOff = static_cast<off_t>(inOffset);
+        ssize_t res = ::sendfile(outFd, inFd, &inOff, size);
+        if(res < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(res < 0 && copyNotSupported(errno))
+        {
+            break;
+        }
+        if(res <= 0)
+        {
+            throw std::runtime_error(res == 0 ? "The input of a copy ended early" : "Can not copy file data");
+        }
+        inOffset += static_cast<std::uint64_t>(res);
+        outOffset += static_cast<std::uint64_t>(res);
+        size -= static_cast<std::uint64_t>(res);
+    }
+#endif
+    std::array<std::uint8_t, COPY_BUFFER_SIZE> buf; // NOLINT
+    while(size > 0)
+    {
+        std::size_t cur = static_cast<std::size_t>(std::min<std::uint64_t>(size, buf.size()));
+        ssize_t got = ::pread(inFd, buf.data(), cur, static_cast<off_t>(inOffset));
+        if(got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(got <= 0)
+        {
+            throw std::runtime_error(got == 0 ? "The input of a copy ended early" : "Can not copy file data");
+        }
+        std::size_t done = 0;
+        while(done < static_cast<std::size_t>(got))
+        {
+            ssize_t put = ::pwrite(outFd, buf.data() + done, static_cast<std::size_t>(got) - done, // NOLINT
+                                   static_cast<off_t>(outOffset + done));
+            if(put < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(put < 0)
+            {
+                throw std::runtime_error("Can not copy file data");
+            }
+            done += static_cast<std::size_t>(put);
+        }
+        inOffset += done;
+        outOffset += done;
+        size -= done;
+    }
+}
+
+void copyFileRange(const std::string &inPath, std::uint64_t inOffset,
+                   const std::string &outPath, std::uint64_t outOffset, std::uint64_t size)
+{
+    int inFd = ::open(inPath.c_str(), O_RDONLY | O_CLOEXEC); // NOLINT
+    if(inFd < 0)
+    {
+        throw std::runtime_error("Can not open " + inPath);
+    }
+    int outFd = ::open(outPath.c_str(), O_WRONLY | O_CLOEXEC); // NOLINT
+    if(outFd < 0)
+    {
+        ::close(inFd);
+        throw std::runtime_error("Can not open " + outPath);
+    }
+    try
+    {
+        copyFileRange(inFd, inOffset, outFd, outOffset, size);
+    } catch(...)
+    {
+        ::close(inFd);
+        ::close(outFd);
+        throw;
+    }
+    ::close(inFd);
+    ::close(outFd);
+}
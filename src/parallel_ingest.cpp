@@ -0,0 +1,248 @@
+#include "parallel_ingest.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <utility>
+
+ParallelIngest::ParallelIngest(ArchiveParser &archive)
+    : ParallelIngest(archive, Options())
+{ }
+
+ParallelIngest::ParallelIngest(ArchiveParser &archive, const Options &options)
+    : m_archive(archive), m_comps(archive.getDefaultCompressionStrategy()),
+      m_earlyAbort(archive.getEarlyAbortPolicy()), m_spill(archive.getSpillPolicy()),
+      m_deterministic(options.deterministic), m_maxPending(options.maxPending)
+{
+    unsigned threads = options.threads == 0 ? ThreadPool::defaultThreadCount() : options.threads;
+    // the entries are coded in parallel, so the blocks of an entry are coded
+    // on its worker, and clampLevel counts the dictionaries of every worker
+    // and of the committer, which compresses the streams
+    m_comps.m_threads = 1;
+    m_comps.m_concurrentEntries = threads + 1;
+    if(m_maxPending == 0)
+    {
+        m_maxPending = 4 * static_cast<std::size_t>(threads);
+    }
+    m_spill.memoryLimit = std::min(m_spill.memoryLimit, options.memoryLimit / m_maxPending);
+    try
+    {
+        m_workers.reserve(threads);
+        for(unsigned i=0; i<threads; i++)
+        {
+            m_workers.emplace_back([this]{ workerLoop(); });
+        }
+        m_committer = std::thread([this]{ committerLoop(); });
+    } catch(...)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_failed = true;
+        }
+        stop();
+        throw;
+    }
+}
+
+ParallelIngest::~ParallelIngest()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_failed = true;
+        m_jobs.clear();
+    }
+    stop();
+}
+
+void ParallelIngest::fail(std::exception_ptr error)
+{
+    if(!m_error)
+    {
+        m_error = std::move(error);
+    }
+    m_failed = true;
+    m_jobs.clear();
+    m_jobCond.notify_all();
+    m_resultCond.notify_all();
+    m_spaceCond.notify_all();
+}
+
+void ParallelIngest::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+    }
+    m_jobCond.notify_all();
+    m_resultCond.notify_all();
+    for(std::thread &worker : m_workers)
+    {
+        if(worker.joinable())
+        {
+            worker.join();
+        }
+    }
+    if(m_committer.joinable())
+    {
+        m_committer.join();
+    }
+}
+
+void ParallelIngest::add(Kind kind, const char *name, const char *path)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_spaceCond.wait(lock, [this]{ return m_failed || m_pending < m_maxPending; });
+    if(m_failed)
+    {
+        std::rethrow_exception(m_error);
+    }
+    if(m_closed)
+    {
+        throw std::runtime_error("Entries can not be added after finish");
+    }
+    Job job{m_nextSeq++, kind, name, path != nullptr ? path : ""};
+    ++m_pending;
+    if(kind == Kind::file)
+    {
+        m_jobs.push_back(std::move(job));
+        lock.unlock();
+        m_jobCond.notify_one();
+    }
+    else
+    {
+        // nothing to compress ahead, the committer adds it in its turn
+        std::uint64_t seq = job.seq;
+        m_results.emplace(seq, Result{std::move(job), nullptr});
+        lock.unlock();
+        m_resultCond.notify_one();
+    }
+}
+
+void ParallelIngest::addFile(const char *name, const char *path)
+{
+    add(Kind::file, name, path);
+}
+
+void ParallelIngest::addStream(const char *name, const char *path)
+{
+    add(Kind::stream, name, path);
+}
+
+void ParallelIngest::addFolder(const char *name)
+{
+    add(Kind::folder, name, nullptr);
+}
+
+void ParallelIngest::workerLoop()
+{
+    while(true)
+    {
+        Result result;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_jobCond.wait(lock, [this]{ return m_failed || m_closed || !m_jobs.empty(); });
+            if(m_failed || m_jobs.empty())
+            {
+                return;
+            }
+            result.job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+        }
+        try
+        {
+            std::ifstream file(result.job.path, std::ifstream::in | std::ifstream::binary);
+            if(!file.is_open())
+            {
+                throw std::runtime_error("Can not open " + result.job.path);
+            }
+            file.exceptions(std::ifstream::badbit | std::ifstream::failbit);
+            result.prepared = std::make_unique<ArchiveParser::PreparedFile>(
+                ArchiveParser::prepareFile(result.job.name.c_str(), file, m_comps, m_earlyAbort, m_spill));
+        } catch(...)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            fail(std::current_exception());
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            std::uint64_t seq = result.job.seq;
+            m_results.emplace(seq, std::move(result));
+        }
+        m_resultCond.notify_one();
+    }
+}
+
+void ParallelIngest::committerLoop()
+{
+    auto ready = [this]
+    {
+        return !m_results.empty() && (!m_deterministic || m_results.begin()->first == m_nextCommit);
+    };
+    while(true)
+    {
+        Result result;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_resultCond.wait(lock, [this, &ready]{ return m_failed || ready() || (m_closed && m_pending == 0); });
+            if(m_failed || !ready())
+            {
+                return;
+            }
+            auto it = m_results.begin();
+            result = std::move(it->second);
+            m_results.erase(it);
+        }
+        try
+        {
+            commit(result);
+        } catch(...)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            fail(std::current_exception());
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_nextCommit;
+            --m_pending;
+        }
+        m_spaceCond.notify_one();
+    }
+}
+
+void ParallelIngest::commit(Result &result)
+{
+    const char *name = result.job.name.c_str();
+    switch(result.job.kind)
+    {
+    case Kind::file:
+        m_archive.addPreparedFile(std::move(*result.prepared));
+        break;
+    case Kind::stream:
+        {
+            std::fstream file(result.job.path, std::fstream::in | std::fstream::binary);
+            if(!file.is_open())
+            {
+                throw std::runtime_error("Can not open " + result.job.path);
+            }
+            file.exceptions(std::fstream::badbit);
+            m_archive.addFileStream(name, file, m_comps);
+        }
+        break;
+    case Kind::folder:
+        m_archive.addFolder(name);
+        break;
+    }
+}
+
+void ParallelIngest::finish()
+{
+    stop();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_error)
+    {
+        std::rethrow_exception(m_error);
+    }
+}
@@ -0,0 +1,83 @@
+#include "spill_buffer.hpp"
+
+#include <algorithm>
+#include <boost/filesystem/operations.hpp>
+#include <ios>
+#include <stdexcept>
+#include <utility>
+
+SpillBuffer::SpillBuffer(std::size_t _memoryLimit, std::uint64_t _maxSize, std::string _tempDir)
+    : memoryLimit(_memoryLimit), maxSize(_maxSize), tempDir(std::move(_tempDir))
+{ }
+
+SpillBuffer::~SpillBuffer()
+{
+    if(!spilled())
+    {
+        return;
+    }
+    tempFile.close();
+    boost::system::error_code err;
+    boost::filesystem::remove(tempPath, err);
+}
+
+void SpillBuffer::openTempFile()
+{
+    boost::filesystem::path dir = tempDir.empty() ? boost::filesystem::temp_directory_path()
+                                                  : boost::filesystem::path(tempDir);
+    tempPath = dir / boost::filesystem::unique_path("pacozip-%%%%-%%%%-%%%%-%%%%.spill");
+    tempFile.open(tempPath.string(), std::fstream::in | std::fstream::out | std::fstream::trunc | std::fstream::binary);
+    if(!tempFile.is_open())
+    {
+        tempPath.clear();
+        throw std::runtime_error("Can not create a temporary file in " + dir.string());
+    }
+    tempFile.exceptions(std::fstream::badbit | std::fstream::failbit);
+}
+
+void SpillBuffer::write(const std::uint8_t *data, std::size_t size)
+{
+    if(overflow || size > maxSize - totalSize)
+    {
+        overflow = true;
+        return;
+    }
+    totalSize += size;
+    if(memory.size() < memoryLimit)
+    {
+        std::size_t cur = std::min(size, memoryLimit - memory.size());
+        memory.insert(memory.end(), data, data + cur); // NOLINT
+        data += cur; // NOLINT
+        size -= cur;
+    }
+    if(size == 0)
+    {
+        return;
+    }
+    if(!spilled())
+    {
+        openTempFile();
+    }
+    tempFile.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size)); // NOLINT
+}
+
+void SpillBuffer::readAll(ByteSink &out)
+{
+    out.write(memory.data(), memory.size());
+    if(!spilled())
+    {
+        return;
+    }
+    tempFile.flush();
+    tempFile.seekg(0, std::fstream::beg);
+    std::vector<std::uint8_t> buf(CODEC_STREAM_BLOCK_SIZE);
+    std::uint64_t left = totalSize - memory.size();
+    while(left > 0)
+    {
+        std::size_t cur = static_cast<std::size_t>(std::min<std::uint64_t>(left, buf.size()));
+        tempFile.read(reinterpret_cast<char*>(buf.data()), static_cast<std::streamsize>(cur)); // NOLINT
+        out.write(buf.data(), cur);
+        left -= cur;
+    }
+    tempFile.seekp(0, std::fstream::end);
+}
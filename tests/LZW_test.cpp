@@ -1,12 +1,25 @@
 #include <catch2/catch.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <cstdlib>
 #include <iostream> // TODO: remove
 #include <memory>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
+#include "bit_io.hpp"
 #include "compressor_base.hpp"
 #include "LZW.hpp"
+#include "LZW_block.hpp"
+#include "memory_budget.hpp"
+#include "thread_pool.hpp"
+#include "work_stealing_pool.hpp"
 
 TEST_CASE("Empty LZW compress and decompress")
 {
@@ -219,3 +232,359 @@ TEST_CASE("Large binary strings")
 
     CHECK(str == oss2.str());
 }
+
+template<unsigned DICT_SIZE_POW, class Dict>
+static std::string compress_with(const std::string &str)
+{
+    std::ostringstream oss;
+    OstreamSink sink(oss);
+    LZWCompressor<DICT_SIZE_POW, Dict> lzc(sink);
+    lzc.feed(reinterpret_cast<const std::uint8_t*>(str.data()), str.size()); // NOLINT
+    lzc.flush();
+    return oss.str();
+}
+
+template<unsigned DICT_SIZE_POW>
+static void check_dictionaries_match(const std::string &str)
+{
+    std::string reference = compress_with<DICT_SIZE_POW, LZWMapDictionary<DICT_SIZE_POW>>(str);
+    if(DICT_SIZE_POW <= 13) // NOLINT
+    {
+        CHECK(compress_with<DICT_SIZE_POW, LZWDenseDictionary<DICT_SIZE_POW>>(str) == reference);
+    }
+    CHECK(compress_with<DICT_SIZE_POW, LZWHashDictionary<DICT_SIZE_POW>>(str) == reference);
+}
+
+TEST_CASE("Dictionary engines produce the same stream")
+{
+    unsigned seed_val = GENERATE(13U, 8, 420);
+    std::string str = generate_large_rnd_str(seed_val) + generate_rnd_str(seed_val) + generate_rnd_str(seed_val);
+
+    check_dictionaries_match<9>(str);
+    check_dictionaries_match<10>(str);
+    check_dictionaries_match<12>(str);
+    check_dictionaries_match<13>(str);
+    check_dictionaries_match<16>(str);
+}
+
+TEST_CASE("Variable width LZW compress and decompress")
+{
+    unsigned dict_size = GENERATE(9U, 10, 12, 13, 16, 17, 23, 24, 27);
+    unsigned seed_val = GENERATE(13U, 8, 420);
+    std::string str = GENERATE_COPY(std::string(), std::string("P"), std::string(300, 'P'),
+                                    generate_rnd_str(seed_val), generate_large_rnd_str(seed_val));
+    std::istringstream iss(str);
+
+    std::ostringstream oss;
+    std::unique_ptr<Compressor> lzcm = makeLZWCompressor(dict_size, oss, true);
+    Compressor &lzc = *lzcm;
+    lzc(iss, str.size());
+    lzc.finish();
+
+    std::istringstream iss2(oss.str());
+
+    std::ostringstream oss2;
+    std::unique_ptr<Decompressor> lzdm = makeLZWDecompressor(dict_size, oss2, true);
+    Decompressor &lzd = *lzdm;
+    lzd(iss2, oss.str().size());
+
+    CHECK(str == oss2.str());
+
+    std::istringstream iss3(str);
+    std::ostringstream oss3;
+    std::unique_ptr<Compressor> fixedm = makeLZWCompressor(dict_size, oss3);
+    (*fixedm)(iss3, str.size());
+    fixedm->finish();
+
+    CHECK(oss.str().size() <= oss3.str().size());
+}
+
+class StringSink final : public ByteSink
+{
+public:
+    std::string str;
+    std::size_t writes = 0;
+
+    void write(const std::uint8_t *data, std::size_t size) override
+    {
+        str.append(reinterpret_cast<const char*>(data), size); // NOLINT
+        ++writes;
+    }
+};
+
+static void feed_in_chunks(PushCompressor &comp, const std::string &str, std::size_t chunk)
+{
+    const auto *data = reinterpret_cast<const std::uint8_t*>(str.data()); // NOLINT
+    for(std::size_t pos=0; pos<str.size(); pos+=chunk)
+    {
+        comp.feed(data+pos, std::min(chunk, str.size()-pos)); // NOLINT
+    }
+    comp.flush();
+}
+
+static void feed_in_chunks(PushDecompressor &decomp, const std::string &str, std::size_t chunk)
+{
+    const auto *data = reinterpret_cast<const std::uint8_t*>(str.data()); // NOLINT
+    for(std::size_t pos=0; pos<str.size(); pos+=chunk)
+    {
+        decomp.feed(data+pos, std::min(chunk, str.size()-pos)); // NOLINT
+    }
+    decomp.flush();
+}
+
+TEST_CASE("Push API matches the istream API")
+{
+    unsigned dict_size = GENERATE(9U, 12, 16, 23);
+    bool variable_width = GENERATE(false, true);
+    std::size_t chunk = GENERATE(std::size_t(1), std::size_t(7), std::size_t(4096));
+    std::string str = generate_large_rnd_str(69) + std::string(1000, 'A') + generate_rnd_str(69); // NOLINT
+
+    std::istringstream iss(str);
+    std::ostringstream oss;
+    std::unique_ptr<Compressor> lzcm = makeLZWCompressor(dict_size, oss, variable_width);
+    (*lzcm)(iss, str.size());
+    lzcm->finish();
+
+    StringSink compressed;
+    std::unique_ptr<PushCompressor> lzc = makeLZWPushCompressor(dict_size, compressed, variable_width);
+    feed_in_chunks(*lzc, str, chunk);
+    CHECK(compressed.str == oss.str());
+
+    StringSink decompressed;
+    std::unique_ptr<PushDecompressor> lzd = makeLZWPushDecompressor(dict_size, decompressed, variable_width);
+    feed_in_chunks(*lzd, compressed.str, chunk);
+    CHECK(decompressed.str == str);
+    // output goes out in blocks, not per code
+    CHECK(decompressed.writes <= str.size() / LZW_OUT_BLOCK_SIZE + 1);
+}
+
+TEST_CASE("Bit packer and unpacker")
+{
+    std::size_t chunk = GENERATE(std::size_t(1), std::size_t(5), std::size_t(8), std::size_t(1000));
+    std::srand(420); // NOLINT
+    std::vector<std::pair<std::uint32_t, unsigned>> codes;
+    for(unsigned i=0; i<5000; ++i) // NOLINT
+    {
+        unsigned width = static_cast<unsigned>(std::rand() % 32) + 1; // NOLINT
+        std::uint64_t mask = (1ULL << width) - 1U;
+        codes.emplace_back(static_cast<std::uint32_t>(static_cast<std::uint64_t>(std::rand()) & mask), width);
+    }
+
+    StringSink packed;
+    BitPacker packer(packed, 64); // NOLINT
+    for(const auto &code : codes)
+    {
+        packer.put(code.first, code.second);
+    }
+    packer.put<13>(0x1ABCU); // NOLINT
+    packer.finish();
+
+    const auto *data = reinterpret_cast<const std::uint8_t*>(packed.str.data()); // NOLINT
+    BitUnpacker unpacker;
+    std::size_t pos = 0;
+    std::size_t next = 0;
+    while(next < codes.size())
+    {
+        if(unpacker.canGet(codes[next].second))
+        {
+            CHECK(unpacker.get(codes[next].second) == codes[next].first);
+            ++next;
+            continue;
+        }
+        REQUIRE(pos < packed.str.size());
+        std::size_t cur = std::min(chunk, packed.str.size() - pos);
+        unpacker.attach(data + pos, cur); // NOLINT
+        pos += cur;
+    }
+    while(!unpacker.canGet(13)) // NOLINT
+    {
+        REQUIRE(pos < packed.str.size());
+        std::size_t cur = std::min(chunk, packed.str.size() - pos);
+        unpacker.attach(data + pos, cur); // NOLINT
+        pos += cur;
+    }
+    CHECK(unpacker.get<13>() == 0x1ABCU);
+    CHECK(pos == packed.str.size());
+    CHECK(unpacker.onlyPaddingLeft());
+}
+
+TEST_CASE("Many dictionary resets")
+{
+    unsigned dict_size = GENERATE(9U, 10U, 11U);
+    bool variable_width = GENERATE(false, true);
+    int alphabet = GENERATE(2, 4, 16);
+    std::srand(static_cast<unsigned>(alphabet) * dict_size);
+    std::string str(200000, ' '); // NOLINT
+    for(char &chr : str)
+    {
+        chr = static_cast<char>('a' + std::rand() % alphabet); // NOLINT
+    }
+
+    StringSink compressed;
+    std::unique_ptr<PushCompressor> lzc = makeLZWPushCompressor(dict_size, compressed, variable_width);
+    feed_in_chunks(*lzc, str, 4096); // NOLINT
+
+    StringSink decompressed;
+    std::unique_ptr<PushDecompressor> lzd = makeLZWPushDecompressor(dict_size, decompressed, variable_width);
+    feed_in_chunks(*lzd, compressed.str, 4096); // NOLINT
+    CHECK(decompressed.str == str);
+}
+
+TEST_CASE("Block LZW does not depend on the thread count")
+{
+    unsigned dict_size = GENERATE(9U, 16U);
+    bool variable_width = GENERATE(false, true);
+    std::size_t block_size = GENERATE(std::size_t(1000), std::size_t(64 * 1024));
+    std::string str = generate_large_rnd_str(42) + std::string(5000, 'B') + generate_large_rnd_str(43); // NOLINT
+    const auto *data = reinterpret_cast<const std::uint8_t*>(str.data()); // NOLINT
+
+    unsigned max_threads = std::max(4U, ThreadPool::defaultThreadCount());
+    std::string reference;
+    for(unsigned threads=1; threads<=max_threads; ++threads)
+    {
+        StringSink compressed;
+        BlockLZWCompressor lzc(compressed, dict_size, variable_width, threads, block_size);
+        lzc.feed(data, str.size() / 3);
+        lzc.feed(data + str.size() / 3, str.size() - str.size() / 3); // NOLINT
+        lzc.flush();
+        if(threads == 1)
+        {
+            reference = compressed.str;
+        }
+        CHECK(compressed.str == reference);
+
+        StringSink decompressed;
+        BlockLZWDecompressor lzd(decompressed, dict_size, variable_width, threads);
+        feed_in_chunks(lzd, compressed.str, 777); // NOLINT
+        CHECK(decompressed.str == str);
+    }
+
+    // a truncated stream is an error, not a shorter file
+    StringSink decompressed;
+    BlockLZWDecompressor lzd(decompressed, dict_size, variable_width, 2);
+    CHECK_THROWS(feed_in_chunks(lzd, reference.substr(0, reference.size() - 1), 4096)); // NOLINT
+}
+
+TEST_CASE("Empty block LZW stream")
+{
+    StringSink compressed;
+    std::unique_ptr<PushCompressor> lzc = makeBlockLZWPushCompressor(12, compressed); // NOLINT
+    lzc->flush();
+    CHECK(compressed.str.empty());
+
+    StringSink decompressed;
+    std::unique_ptr<PushDecompressor> lzd = makeBlockLZWPushDecompressor(12, decompressed); // NOLINT
+    lzd->flush();
+    CHECK(decompressed.str.empty());
+}
+
+TEST_CASE("LZW dictionaries grow with the input")
+{
+    bool variable_width = GENERATE(false, true);
+    std::string str = "a short input, a short input";
+    std::size_t used_before = MemoryBudget::global().getUsed();
+
+    StringSink compressed;
+    std::unique_ptr<PushCompressor> lzc = makeLZWPushCompressor(26, compressed, variable_width, str.size()); // NOLINT
+    CHECK(MemoryBudget::global().getUsed() - used_before <= LZWCompressorMemoryBound(26, str.size())); // NOLINT
+    feed_in_chunks(*lzc, str, str.size());
+    CHECK(lzc->peakMemoryUsage() < 1024 * 1024); // NOLINT
+
+    StringSink decompressed;
+    std::unique_ptr<PushDecompressor> lzd = makeLZWPushDecompressor(26, decompressed, variable_width, compressed.str.size()); // NOLINT
+    feed_in_chunks(*lzd, compressed.str, compressed.str.size());
+    CHECK(decompressed.str == str);
+    CHECK(lzd->peakMemoryUsage() < 1024 * 1024); // NOLINT
+
+    // without a size hint the dictionary still starts small
+    StringSink decompressed2;
+    std::unique_ptr<PushDecompressor> lzd2 = makeLZWPushDecompressor(26, decompressed2, variable_width); // NOLINT
+    feed_in_chunks(*lzd2, compressed.str, 3);
+    CHECK(decompressed2.str == str);
+    CHECK(lzd2->peakMemoryUsage() < 1024 * 1024); // NOLINT
+
+    lzc.reset();
+    lzd.reset();
+    lzd2.reset();
+    CHECK(MemoryBudget::global().getUsed() == used_before);
+}
+
+TEST_CASE("Memory budget accounting")
+{
+    MemoryBudget budget(100); // NOLINT
+    auto first = std::make_unique<MemoryReservation>(budget, 80); // NOLINT
+    CHECK(budget.getUsed() == 80);
+    CHECK(budget.available() == 20);
+    {
+        // reserving never waits, even past the limit
+        MemoryReservation second(budget, 50); // NOLINT
+        CHECK(budget.getUsed() == 130);
+        CHECK(budget.available() == 0);
+        MemoryReservation moved(std::move(second));
+        CHECK(budget.getUsed() == 130);
+    }
+    CHECK(budget.getUsed() == 80);
+    first.reset();
+    CHECK(budget.getUsed() == 0);
+    CHECK(budget.getPeak() == 130);
+}
+
+TEST_CASE("Memory budget waits for space")
+{
+    MemoryBudget budget(100); // NOLINT
+    auto first = std::make_unique<MemoryReservation>(budget, 80); // NOLINT
+    // more than the limit never fits
+    CHECK_THROWS_AS(MemoryReservation(budget, 101, MemoryReservation::Wait()), std::runtime_error); // NOLINT
+    CHECK(budget.getUsed() == 80);
+
+    std::atomic<bool> acquired(false);
+    std::thread second([&budget, &acquired]()
+    {
+        MemoryReservation reservation(budget, 50, MemoryReservation::Wait()); // NOLINT
+        acquired = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50)); // NOLINT
+    CHECK_FALSE(acquired);
+    first.reset();
+    second.join();
+    CHECK(acquired);
+    CHECK(budget.getUsed() == 0);
+    CHECK(budget.getPeak() == 80);
+}
+
+TEST_CASE("Work stealing pool runs every job once")
+{
+    unsigned threads = GENERATE(1U, 4U);
+    WorkStealingPool pool(threads);
+    REQUIRE(pool.size() == threads);
+
+    for(std::size_t count : {0U, 3U, 1000U})
+    {
+        std::vector<std::atomic<unsigned>> runs(count);
+        pool.run(count, [&runs, threads](unsigned worker, std::size_t index)
+        {
+            REQUIRE(worker < threads);
+            // uneven jobs, the first ones are the longest
+            if(index < 4)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(20)); // NOLINT
+            }
+            ++runs[index];
+        });
+        CHECK(std::all_of(runs.begin(), runs.end(), [](const std::atomic<unsigned> &val) { return val == 1; }));
+    }
+
+    std::atomic<unsigned> started{0};
+    CHECK_THROWS_AS(pool.run(1000, [&started](unsigned, std::size_t index) // NOLINT
+    {
+        ++started;
+        if(index == 0)
+        {
+            throw std::runtime_error("job failed");
+        }
+    }), std::runtime_error);
+    // the pool is still usable after a failed batch
+    std::atomic<unsigned> after{0};
+    pool.run(10, [&after](unsigned, std::size_t) { ++after; }); // NOLINT
+    CHECK(after == 10);
+}
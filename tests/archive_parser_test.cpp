@@ -1,8 +1,34 @@
 #include <catch2/catch.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <cstring>
+#include <fstream>
+#include <random>
 #include <sstream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "archive_parser.hpp"
+#include "archive_reader.hpp"
+#include "crc32.hpp"
+#include "file_space.hpp"
+#include "free_space_map.hpp"
+#include "LZW.hpp"
+#include "LZW_block.hpp"
+#include "memory_budget.hpp"
+#include "parallel_ingest.hpp"
+#include "spill_buffer.hpp"
 
 TEST_CASE("Basic file store")
 {
@@ -151,3 +177,1509 @@ TEST_CASE("Basic file store")
     }
     CHECK(files_cnt == 3);
 }
+
+TEST_CASE("Variable width LZW entries")
+{
+    unsigned comp_level = GENERATE(3U, 5U, 9U);
+
+    std::stringstream arch_file;
+    ArchiveParser arch = ArchiveParser::MakeArchive(arch_file);
+    ArchiveParser::CompressionStrategy fixed("LZW", comp_level);
+    ArchiveParser::CompressionStrategy variable("LZW", comp_level | ArchiveParser::CompressionStrategy::LZW_VARIABLE_WIDTH);
+
+    std::string content;
+    for(unsigned i=0; i<2000; ++i) // NOLINT
+    {
+        content += "line " + std::to_string(i % 37) + " of some repetitive text\n";
+    }
+
+    std::istringstream ifs;
+    std::stringstream temp_file;
+
+    ifs.str(content);
+    arch.addFile("fixed.txt", ifs, fixed, temp_file);
+
+    temp_file = std::stringstream();
+    ifs.str(content);
+    ifs.clear();
+    arch.addFile("variable.txt", ifs, variable, temp_file);
+
+    CHECK(arch.verify());
+
+    std::uint64_t fixed_size = arch.findFile("fixed.txt")->getCompressedFileSize();
+    std::uint64_t variable_size = arch.findFile("variable.txt")->getCompressedFileSize();
+    CHECK(variable_size < fixed_size);
+    // the level may be lowered for a small file, the flag is kept
+    CHECK((arch.findFile("variable.txt")->getCompressionStrg().getAlgOptionsVal() & ArchiveParser::CompressionStrategy::LZW_VARIABLE_WIDTH) != 0);
+
+    std::ostringstream ofs;
+    arch.readFile("fixed.txt", ofs);
+    CHECK(ofs.str() == content);
+
+    ofs = std::ostringstream();
+    arch.readFile("variable.txt", ofs);
+    CHECK(ofs.str() == content);
+
+    CHECK_THROWS(ArchiveParser::CompressionStrategy("LZW", 10));
+    CHECK_THROWS(ArchiveParser::CompressionStrategy("LZW", 0x20 | 3));
+}
+
+TEST_CASE("Block LZW entries")
+{
+    unsigned comp_level = GENERATE(0U, 4U);
+    unsigned threads = GENERATE(1U, 3U);
+
+    std::stringstream arch_file;
+    ArchiveParser arch = ArchiveParser::MakeArchive(arch_file);
+    ArchiveParser::CompressionStrategy block("BLOCK_LZW", comp_level | ArchiveParser::CompressionStrategy::LZW_VARIABLE_WIDTH);
+    block.m_threads = threads;
+
+    std::string content;
+    for(unsigned i=0; i<100000; ++i) // NOLINT
+    {
+        content += "line " + std::to_string(i % 101) + " of some repetitive text\n";
+    }
+
+    std::istringstream ifs(content);
+    std::stringstream temp_file;
+    arch.addFile("block.txt", ifs, block, temp_file);
+
+    CHECK(arch.verify());
+    CHECK(arch.findFile("block.txt")->getCompressionStrg().getAlgStr() == std::string("BLOCK_LZW"));
+    CHECK(arch.findFile("block.txt")->getCompressedFileSize() < content.size());
+
+    std::ostringstream ofs;
+    arch.readFile("block.txt", ofs);
+    CHECK(ofs.str() == content);
+}
+
+TEST_CASE("LZW level is clamped to the file and the memory budget")
+{
+    ArchiveParser::CompressionStrategy level9("LZW", 9 | ArchiveParser::CompressionStrategy::LZW_VARIABLE_WIDTH);
+    constexpr std::size_t BIG_BUDGET = std::size_t(1) << 40U;
+
+    // a tiny file never fills even the smallest dictionary
+    CHECK((level9.clampLevel(10, BIG_BUDGET).getAlgOptionsVal() & 0x0FU) == 0);
+    CHECK((level9.clampLevel(10, BIG_BUDGET).getAlgOptionsVal() & ArchiveParser::CompressionStrategy::LZW_VARIABLE_WIDTH) != 0);
+    // 100 KB fit in a 2^18 dictionary (level 6) but not in 2^16
+    CHECK((level9.clampLevel(100000, BIG_BUDGET).getAlgOptionsVal() & 0x0FU) == 6);
+    CHECK((level9.clampLevel(std::uint64_t(1) << 40U, BIG_BUDGET).getAlgOptionsVal() & 0x0FU) == 9);
+    CHECK((level9.clampLevel(std::uint64_t(1) << 40U, 64 * 1024).getAlgOptionsVal() & 0x0FU) < 9);
+    CHECK(ArchiveParser::CompressionStrategy().clampLevel(10, 0).getAlgVal() == ArchiveParser::CompressionStrategy().getAlgVal());
+    // every entry that is compressed at the same time has its own dictionary
+    const std::size_t level9_budget = LZWCompressorMemoryBound(26, std::size_t(1) << 40U); // NOLINT
+    CHECK((level9.clampLevel(std::uint64_t(1) << 40U, level9_budget).getAlgOptionsVal() & 0x0FU) == 9);
+    ArchiveParser::CompressionStrategy concurrent = level9;
+    concurrent.m_concurrentEntries = 4;
+    CHECK((concurrent.clampLevel(std::uint64_t(1) << 40U, level9_budget).getAlgOptionsVal() & 0x0FU) < 9);
+
+    std::stringstream arch_file;
+    ArchiveParser arch = ArchiveParser::MakeArchive(arch_file);
+    std::string content;
+    for(unsigned i=0; i<300; ++i) // NOLINT
+    {
+        content += "small file " + std::to_string(i % 7) + "\n";
+    }
+    std::istringstream ifs(content);
+    std::stringstream temp_file;
+    arch.addFile("small.txt", ifs, level9, temp_file);
+    std::size_t compress_peak = arch.getLastPeakDictMemory();
+    CHECK(compress_peak > 0);
+    CHECK(compress_peak < 1024 * 1024);
+    CHECK(arch.findFile("small.txt")->getCompressionStrg().getAlgOptionsVal() < level9.getAlgOptionsVal());
+
+    std::ostringstream ofs;
+    arch.readFile("small.txt", ofs);
+    CHECK(ofs.str() == content);
+    CHECK(arch.getLastPeakDictMemory() > 0);
+    CHECK(arch.getLastPeakDictMemory() < 1024 * 1024);
+}
+
+TEST_CASE("Byte histogram entropy")
+{
+    ByteHistogram hist;
+    CHECK(hist.entropy() == 0);
+
+    std::vector<std::uint8_t> same(1001, 'x'); // NOLINT
+    hist.add(same.data(), same.size());
+    CHECK(hist.count('x') == 1001);
+    CHECK(hist.entropy() == Approx(0));
+
+    ByteHistogram uniform;
+    std::vector<std::uint8_t> all(256 * 7 + 3); // NOLINT
+    for(std::size_t i=0; i<all.size(); ++i)
+    {
+        all[i] = static_cast<std::uint8_t>(i);
+    }
+    uniform.add(all.data(), all.size() - 3);
+    CHECK(uniform.entropy() == Approx(8));
+    uniform.add(all.data(), 3);
+    CHECK(uniform.size() == all.size());
+    CHECK(uniform.count(1) == 8);
+}
+
+TEST_CASE("AUTO compression picks NONE or LZW per file")
+{
+    std::stringstream arch_file;
+    ArchiveParser arch = ArchiveParser::MakeArchive(arch_file);
+    ArchiveParser::CompressionStrategy autoComp("AUTO", 5 | ArchiveParser::CompressionStrategy::LZW_VARIABLE_WIDTH);
+    CHECK_THROWS(ArchiveParser::CompressionStrategy(autoComp.getAlgVal(), autoComp.getAlgOptionsVal()));
+
+    std::string random(200000, ' '); // NOLINT
+    std::mt19937 gen(7); // NOLINT
+    for(char &chr : random)
+    {
+        chr = static_cast<char>(gen());
+    }
+    std::string text;
+    for(unsigned i=0; i<5000; ++i) // NOLINT
+    {
+        text += "line " + std::to_string(i % 37) + " of some repetitive text\n";
+    }
+
+    std::istringstream ifs(random);
+    std::stringstream temp_file;
+    arch.addFile("random.bin", ifs, autoComp, temp_file);
+    // stored without compressing it first
+    CHECK(arch.findFile("random.bin")->getCompressionStrg().getAlgStr() == std::string("NONE"));
+    CHECK(arch.getLastPeakDictMemory() == 0);
+
+    ifs.str(text);
+    ifs.clear();
+    temp_file = std::stringstream();
+    arch.addFile("text.txt", ifs, autoComp, temp_file);
+    ArchiveParser::CompressionStrategy textComp = arch.findFile("text.txt")->getCompressionStrg();
+    CHECK(textComp.getAlgStr() == std::string("LZW"));
+    CHECK((textComp.getAlgOptionsVal() & ArchiveParser::CompressionStrategy::LZW_VARIABLE_WIDTH) != 0);
+
+    CHECK(arch.verify());
+    std::ostringstream ofs;
+    arch.readFile("random.bin", ofs);
+    CHECK(ofs.str() == random);
+    ofs = std::ostringstream();
+    arch.readFile("text.txt", ofs);
+    CHECK(ofs.str() == text);
+}
+
+TEST_CASE("Compression of incompressible files is aborted early")
+{
+    std::stringstream arch_file;
+    ArchiveParser arch = ArchiveParser::MakeArchive(arch_file);
+    ArchiveParser::CompressionStrategy lzw("LZW", 3 | ArchiveParser::CompressionStrategy::LZW_VARIABLE_WIDTH);
+    ArchiveParser::EarlyAbortPolicy policy;
+    policy.probeWindow = 256 * 1024; // NOLINT
+    policy.maxRatio = 0.95; // NOLINT
+    arch.setEarlyAbortPolicy(policy);
+
+    std::string random(4 * 1024 * 1024, ' '); // NOLINT
+    std::mt19937 gen(11); // NOLINT
+    for(char &chr : random)
+    {
+        chr = static_cast<char>(gen());
+    }
+
+    std::istringstream ifs(random);
+    std::stringstream temp_file;
+    arch.addFile("random.bin", ifs, lzw, temp_file);
+    CHECK(arch.getEarlyAbortCount() == 1);
+    CHECK(arch.findFile("random.bin")->getCompressionStrg().getAlgStr() == std::string("NONE"));
+
+    std::string text;
+    for(unsigned i=0; i<50000; ++i) // NOLINT
+    {
+        text += "line " + std::to_string(i % 37) + " of some repetitive text\n";
+    }
+    ifs.str(text);
+    ifs.clear();
+    temp_file = std::stringstream();
+    arch.addFile("text.txt", ifs, lzw, temp_file);
+    CHECK(arch.getEarlyAbortCount() == 1);
+    CHECK(arch.findFile("text.txt")->getCompressionStrg().getAlgStr() == std::string("LZW"));
+
+    // disabled: compressed in full and then stored because it grew
+    policy.probeWindow = 0;
+    arch.setEarlyAbortPolicy(policy);
+    ifs.str(random);
+    ifs.clear();
+    temp_file = std::stringstream();
+    arch.addFile("random2.bin", ifs, lzw, temp_file);
+    CHECK(arch.getEarlyAbortCount() == 1);
+    CHECK(arch.findFile("random2.bin")->getCompressionStrg().getAlgStr() == std::string("NONE"));
+
+    CHECK(arch.verify());
+    std::ostringstream ofs;
+    arch.readFile("random.bin", ofs);
+    CHECK(ofs.str() == random);
+    ofs = std::ostringstream();
+    arch.readFile("text.txt", ofs);
+    CHECK(ofs.str() == text);
+}
+
+TEST_CASE("CRC32 combine")
+{
+    std::string first = "The quick brown fox ";
+    std::string second(100000, 'j'); // NOLINT
+    second += "umps over the lazy dog";
+    const auto *firstData = reinterpret_cast<const std::uint8_t*>(first.data()); // NOLINT
+    const auto *secondData = reinterpret_cast<const std::uint8_t*>(second.data()); // NOLINT
+
+    CRC32 whole;
+    whole(firstData, first.size());
+    whole(secondData, second.size());
+    CRC32 crcFirst;
+    crcFirst(firstData, first.size());
+    CRC32 crcSecond;
+    crcSecond(secondData, second.size());
+
+    CHECK(CRC32::combine(crcFirst.getResult(), crcSecond.getResult(), second.size()) == whole.getResult());
+    CHECK(CRC32::combine(crcFirst.getResult(), 0, 0) == crcFirst.getResult());
+}
+
+TEST_CASE("Entries take only their compressed size")
+{
+    std::stringstream arch_file;
+    ArchiveParser arch = ArchiveParser::MakeArchive(arch_file);
+    ArchiveParser::CompressionStrategy lzw("LZW", 3);
+    std::string text;
+    for(unsigned i=0; i<2000; ++i) // NOLINT
+    {
+        text += "line " + std::to_string(i % 37) + " of some repetitive text\n";
+    }
+    std::istringstream ifs(text);
+    arch.addFile("a.txt", ifs, lzw);
+    ifs.str("short");
+    ifs.clear();
+    arch.addFile("b.txt", ifs, lzw);
+
+    // a.txt was allocated for its uncompressed size at the end of the
+    // archive, but the archive only grew by what was written
+    auto a = arch.findFile("a.txt")->getEntryBeginEnd();
+    auto b = arch.findFile("b.txt")->getEntryBeginEnd();
+    CHECK(b.first == a.second);
+    CHECK(arch.verify());
+
+    std::ostringstream ofs;
+    arch.readFile("a.txt", ofs);
+    CHECK(ofs.str() == text);
+}
+
+// hands out a string in small pieces and can not seek, like a pipe
+class PipeBuf final : public std::streambuf
+{
+private:
+    std::string data;
+    std::size_t pos = 0;
+    // reads past this many bytes fail
+    std::size_t failAt;
+    std::array<char, 1000> buf{};
+
+protected:
+    int_type underflow() override
+    {
+        if(pos >= failAt)
+        {
+            throw std::runtime_error("PipeBuf read failed");
+        }
+        if(pos == data.size())
+        {
+            return traits_type::eof();
+        }
+        std::size_t cur = std::min(buf.size(), data.size() - pos);
+        std::copy_n(data.begin() + static_cast<std::ptrdiff_t>(pos), cur, buf.begin());
+        pos += cur;
+        setg(buf.data(), buf.data(), buf.data() + cur); // NOLINT
+        return traits_type::to_int_type(buf[0]);
+    }
+
+    pos_type seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode which) override
+    {
+        (void) off; (void) dir; (void) which;
+        throw std::runtime_error("PipeBuf can not seek");
+    }
+
+    pos_type seekpos(pos_type off, std::ios::openmode which) override
+    {
+        (void) off; (void) which;
+        throw std::runtime_error("PipeBuf can not seek");
+    }
+
+public:
+    explicit PipeBuf(std::string _data, std::size_t _failAt = std::string::npos)
+        : data(std::move(_data)), failAt(_failAt)
+    { }
+};
+
+TEST_CASE("Streaming entries from non-seekable inputs")
+{
+    std::stringstream arch_file;
+    ArchiveParser arch = ArchiveParser::MakeArchive(arch_file);
+    ArchiveParser::CompressionStrategy lzw("LZW", 4 | ArchiveParser::CompressionStrategy::LZW_VARIABLE_WIDTH);
+    ArchiveParser::EarlyAbortPolicy policy;
+    policy.probeWindow = 256 * 1024; // NOLINT
+    arch.setEarlyAbortPolicy(policy);
+
+    std::string text;
+    for(unsigned i=0; i<30000; ++i) // NOLINT
+    {
+        text += "line " + std::to_string(i % 37) + " of some repetitive text\n";
+    }
+    std::string random(1000000, ' '); // NOLINT
+    std::mt19937 gen(5); // NOLINT
+    for(char &chr : random)
+    {
+        chr = static_cast<char>(gen());
+    }
+    std::string small_random = random.substr(0, 1000); // NOLINT
+
+    PipeBuf textBuf(text);
+    std::istream textIn(&textBuf);
+    textIn.exceptions(std::istream::badbit | std::istream::failbit);
+    arch.addFileStream("text.txt", textIn, lzw);
+    CHECK(arch.findFile("text.txt")->getCompressionStrg().getAlgStr() == std::string("LZW"));
+    CHECK(arch.findFile("text.txt")->getCompressedFileSize() < text.size());
+    // the caller's exception mask is restored
+    CHECK(textIn.exceptions() == (std::istream::badbit | std::istream::failbit));
+
+    // does not shrink in the probe window, so it is stored
+    PipeBuf randomBuf(random);
+    std::istream randomIn(&randomBuf);
+    arch.addFileStream("random.bin", randomIn, lzw);
+    CHECK(arch.findFile("random.bin")->getCompressionStrg().getAlgStr() == std::string("NONE"));
+    CHECK(arch.getEarlyAbortCount() == 1);
+
+    // fits in the head, compressed and then stored
+    PipeBuf smallBuf(small_random);
+    std::istream smallIn(&smallBuf);
+    arch.addFileStream("small.bin", smallIn, lzw);
+    CHECK(arch.findFile("small.bin")->getCompressionStrg().getAlgStr() == std::string("NONE"));
+
+    PipeBuf emptyBuf("");
+    std::istream emptyIn(&emptyBuf);
+    arch.addFileStream("empty", emptyIn, ArchiveParser::CompressionStrategy("AUTO", 3));
+
+    PipeBuf autoBuf(text);
+    std::istream autoIn(&autoBuf);
+    arch.addFileStream("auto.txt", autoIn, ArchiveParser::CompressionStrategy("AUTO", 3));
+    CHECK(arch.findFile("auto.txt")->getCompressionStrg().getAlgStr() == std::string("LZW"));
+
+    CHECK_THROWS(arch.addFileStream("text.txt", textIn, lzw));
+    CHECK(arch.verify());
+
+    // a failed add gives its space back, the next entry takes it
+    std::uint64_t end = 0;
+    for(const ArchiveParser::FileInfo &file : arch)
+    {
+        end = std::max(end, file.getEntryBeginEnd().second);
+    }
+    for(unsigned failAt : {100U, 600000U}) // NOLINT
+    {
+        PipeBuf failingBuf(text + text, failAt);
+        std::istream failingIn(&failingBuf);
+        CHECK_THROWS(arch.addFileStream("failed.txt", failingIn, lzw));
+        CHECK(arch.findFile("failed.txt") == arch.cend());
+    }
+    PipeBuf afterBuf(small_random);
+    std::istream afterIn(&afterBuf);
+    arch.addFileStream("after.bin", afterIn, lzw);
+    CHECK(arch.findFile("after.bin")->getEntryBeginEnd().first == end);
+    CHECK(arch.verify());
+
+    std::ostringstream ofs;
+    arch.readFile("text.txt", ofs);
+    CHECK(ofs.str() == text);
+    ofs = std::ostringstream();
+    arch.readFile("random.bin", ofs);
+    CHECK(ofs.str() == random);
+    ofs = std::ostringstream();
+    arch.readFile("small.bin", ofs);
+    CHECK(ofs.str() == small_random);
+    ofs = std::ostringstream();
+    arch.readFile("empty", ofs);
+    CHECK(ofs.str().empty());
+    ofs = std::ostringstream();
+    arch.readFile("auto.txt", ofs);
+    CHECK(ofs.str() == text);
+}
+
+TEST_CASE("Spill buffer moves to a temporary file past its memory limit")
+{
+    std::string data(300000, ' '); // NOLINT
+    std::mt19937 gen(7); // NOLINT
+    for(char &chr : data)
+    {
+        chr = static_cast<char>(gen());
+    }
+    SpillBuffer spill(100000, 250000); // NOLINT
+    spill.write(reinterpret_cast<const std::uint8_t*>(data.data()), 50000); // NOLINT
+    CHECK_FALSE(spill.spilled());
+    spill.write(reinterpret_cast<const std::uint8_t*>(data.data()) + 50000, 150000); // NOLINT
+    CHECK(spill.spilled());
+    CHECK(spill.size() == 200000);
+
+    VectorSink out;
+    spill.readAll(out);
+    CHECK(std::string(out.data.begin(), out.data.end()) == data.substr(0, 200000)); // NOLINT
+    // still appends after being read
+    spill.write(reinterpret_cast<const std::uint8_t*>(data.data()) + 200000, 10000); // NOLINT
+    out.data.clear();
+    spill.readAll(out);
+    CHECK(std::string(out.data.begin(), out.data.end()) == data.substr(0, 210000)); // NOLINT
+
+    CHECK_FALSE(spill.overflowed());
+    spill.write(reinterpret_cast<const std::uint8_t*>(data.data()), 90000); // NOLINT
+    CHECK(spill.overflowed());
+    CHECK(spill.size() == 210000);
+}
+
+TEST_CASE("Streams that stop shrinking after the head are stored when spilled")
+{
+    std::string data;
+    for(unsigned i=0; i<20000; ++i) // NOLINT
+    {
+        data += "line " + std::to_string(i % 37) + " of some repetitive text\n";
+    }
+    std::mt19937 gen(9); // NOLINT
+    for(unsigned i=0; i<2000000; ++i) // NOLINT
+    {
+        data += static_cast<char>(gen());
+    }
+    ArchiveParser::CompressionStrategy lzw("LZW", 4 | ArchiveParser::CompressionStrategy::LZW_VARIABLE_WIDTH);
+    ArchiveParser::EarlyAbortPolicy abort;
+    abort.probeWindow = 256 * 1024; // NOLINT
+    ArchiveParser::SpillPolicy spill;
+    spill.memoryLimit = 64 * 1024; // NOLINT
+    spill.maxSize = 16 * 1024 * 1024; // NOLINT
+
+    std::stringstream arch_file;
+    ArchiveParser arch = ArchiveParser::MakeArchive(arch_file);
+    arch.setEarlyAbortPolicy(abort);
+
+    // without keeping the input the compressed entry stays
+    PipeBuf keptBuf(data);
+    std::istream keptIn(&keptBuf);
+    arch.addFileStream("kept.bin", keptIn, lzw);
+    CHECK(arch.findFile("kept.bin")->getCompressionStrg().getAlgStr() == std::string("LZW"));
+    CHECK(arch.findFile("kept.bin")->getCompressedFileSize() > data.size());
+
+    arch.setSpillPolicy(spill);
+    PipeBuf storedBuf(data);
+    std::istream storedIn(&storedBuf);
+    arch.addFileStream("stored.bin", storedIn, lzw);
+    CHECK(arch.findFile("stored.bin")->getCompressionStrg().getAlgStr() == std::string("NONE"));
+    CHECK(arch.findFile("stored.bin")->getCompressedFileSize() == data.size());
+    CHECK(arch.getEarlyAbortCount() == 0);
+    CHECK(arch.verify());
+
+    std::ostringstream ofs;
+    arch.readFile("kept.bin", ofs);
+    CHECK(ofs.str() == data);
+    ofs = std::ostringstream();
+    arch.readFile("stored.bin", ofs);
+    CHECK(ofs.str() == data);
+}
+
+static std::vector<std::string> entryNames(ArchiveParser &arch)
+{
+    std::vector<std::string> res;
+    for(const ArchiveParser::FileInfo &file : arch)
+    {
+        res.push_back(file.getFileName());
+    }
+    return res;
+}
+
+TEST_CASE("Central directory")
+{
+    std::string a(5000, 'a'); // NOLINT
+    std::string b = "some text for b";
+    std::string c = "and c";
+    ArchiveParser::CompressionStrategy lzw("LZW", 3);
+    std::string flushed;
+    std::string stale;
+    {
+        std::stringstream arch_file;
+        ArchiveParser arch = ArchiveParser::MakeArchive(arch_file);
+        std::istringstream ains(a);
+        arch.addFile("a", ains, lzw);
+        std::istringstream bins(b);
+        arch.addFile("b", bins, lzw);
+        arch.addFolder("dir");
+        arch.flush();
+        flushed = arch_file.str();
+        CHECK(flushed[8] == 1); // NOLINT
+        std::istringstream cins(c);
+        arch.addFile("c", cins, lzw);
+        // the directory is not up to date until the next flush
+        stale = arch_file.str();
+        // deleting the first entry
+        arch.deleteFile("a");
+        CHECK(entryNames(arch) == std::vector<std::string>{"b", "dir", "c"});
+        CHECK(arch.verify());
+    }
+
+    SECTION("Read from the directory")
+    {
+        std::stringstream arch_file(flushed);
+        ArchiveParser arch(arch_file);
+        CHECK(entryNames(arch) == std::vector<std::string>{"a", "b", "dir"});
+        CHECK(arch.verify());
+        std::ostringstream ofs;
+        arch.readFile("a", ofs);
+        CHECK(ofs.str() == a);
+        CHECK(arch.getFileType("dir") == ArchiveParser::fileType::folder);
+    }
+    SECTION("A directory that is not up to date is not used")
+    {
+        std::stringstream arch_file(stale);
+        ArchiveParser arch(arch_file);
+        CHECK(entryNames(arch) == std::vector<std::string>{"a", "b", "dir", "c"});
+        CHECK(arch.verify());
+        std::ostringstream ofs;
+        arch.readFile("c", ofs);
+        CHECK(ofs.str() == c);
+    }
+    SECTION("A damaged directory is not used")
+    {
+        flushed.back() = static_cast<char>(flushed.back() ^ 1);
+        std::stringstream arch_file(flushed);
+        ArchiveParser arch(arch_file);
+        CHECK(entryNames(arch) == std::vector<std::string>{"a", "b", "dir"});
+        CHECK(arch.verify());
+    }
+}
+
+TEST_CASE("Version 0 archives are still read and written")
+{
+    std::string header = "PacoZIPP";
+    header.append(12, '\0'); // NOLINT
+    std::stringstream arch_file(header);
+    {
+        ArchiveParser arch(arch_file);
+        CHECK(entryNames(arch).empty());
+        std::istringstream ains("contents of a");
+        arch.addFile("a", ains, ArchiveParser::CompressionStrategy("NONE", 0));
+        std::istringstream bins("contents of b");
+        arch.addFile("b", bins, ArchiveParser::CompressionStrategy("LZW", 2));
+    }
+    CHECK(arch_file.str()[8] == 0); // NOLINT
+
+    ArchiveParser arch(arch_file);
+    CHECK(entryNames(arch) == std::vector<std::string>{"a", "b"});
+    CHECK(arch.verify());
+    std::ostringstream ofs;
+    arch.readFile("b", ofs);
+    CHECK(ofs.str() == "contents of b");
+}
+
+TEST_CASE("Headers are stored little endian")
+{
+    std::stringstream arch_file;
+    {
+        ArchiveParser arch = ArchiveParser::MakeArchive(arch_file);
+        std::istringstream ins(std::string(0x0102, 'x')); // NOLINT
+        arch.addFile("abc", ins, ArchiveParser::CompressionStrategy("NONE", 0));
+    }
+    auto byteAt = [&arch_file](std::size_t pos)
+    {
+        return static_cast<unsigned>(static_cast<unsigned char>(arch_file.str().at(pos)));
+    };
+    // version 1, first entry right after the 36 byte header
+    CHECK(byteAt(8) == 1);
+    CHECK(byteAt(9) == 0);
+    CHECK(byteAt(12) == 36); // NOLINT
+    CHECK(byteAt(13) == 0); // NOLINT
+    // data size, then the name after the 25 byte entry header
+    CHECK(byteAt(36) == 0x02); // NOLINT
+    CHECK(byteAt(37) == 0x01); // NOLINT
+    CHECK(arch_file.str().substr(36 + 25, 3) == "abc"); // NOLINT
+
+    ArchiveParser arch(arch_file);
+    CHECK(entryNames(arch) == std::vector<std::string>{"abc"});
+    CHECK(arch.verify());
+
+    std::stringstream truncated(arch_file.str().substr(0, 30)); // NOLINT
+    CHECK_THROWS(ArchiveParser(truncated));
+}
+
+TEST_CASE("Name index follows adds and deletes")
+{
+    std::stringstream arch_file;
+    {
+        ArchiveParser arch = ArchiveParser::MakeArchive(arch_file);
+        ArchiveParser::CompressionStrategy none("NONE", 0);
+        for(unsigned i=0; i<200; i++) // NOLINT
+        {
+            std::istringstream ins("file " + std::to_string(i));
+            arch.addFile(("f" + std::to_string(i)).c_str(), ins, none);
+        }
+        arch.addFolder("dir");
+        for(unsigned i=0; i<200; i+=3) // NOLINT
+        {
+            arch.deleteFile(("f" + std::to_string(i)).c_str());
+        }
+        arch.deleteFile("missing");
+        CHECK_THROWS(arch.addFolder("f1"));
+        std::istringstream ins("again");
+        arch.addFile("f0", ins, none);
+        CHECK(arch.verify());
+    }
+
+    ArchiveParser arch(arch_file);
+    for(unsigned i=1; i<200; i++) // NOLINT
+    {
+        std::string name = "f" + std::to_string(i);
+        if(i % 3 == 0)
+        {
+            CHECK(arch.findFile(name.c_str()) == arch.cend());
+            continue;
+        }
+        REQUIRE(arch.findFile(name.c_str()) != arch.cend());
+        CHECK(arch.findFile(name.c_str())->getFileName() == name);
+        std::ostringstream ofs;
+        arch.readFile(name.c_str(), ofs);
+        CHECK(ofs.str() == "file " + std::to_string(i));
+    }
+    std::ostringstream ofs;
+    arch.readFile("f0", ofs);
+    CHECK(ofs.str() == "again");
+    CHECK(arch.getFileType("dir") == ArchiveParser::fileType::folder);
+}
+
+TEST_CASE("Name index of a damaged archive with a repeated name")
+{
+    std::stringstream arch_file;
+    std::uint64_t secondName = 0;
+    {
+        ArchiveParser arch = ArchiveParser::MakeArchive(arch_file);
+        ArchiveParser::CompressionStrategy none("NONE", 0);
+        for(const char *name : {"dupA", "other", "dupB", "last"})
+        {
+            std::istringstream ins(std::string("contents of ") + name);
+            arch.addFile(name, ins, none);
+        }
+        // header, then "dup"
+        secondName = arch.findFile("dupB")->getEntryBeginEnd().first + 25 + 3; // NOLINT
+    }
+    std::string bytes = arch_file.str();
+    bytes[secondName] = 'A';
+    // no directory, the list is walked
+    std::fill_n(bytes.begin() + 20, 8, '\0'); // NOLINT
+
+    SECTION("Deleting the indexed entry maps the name to the next one")
+    {
+        std::stringstream damaged(bytes);
+        ArchiveParser arch(damaged);
+        std::ostringstream ofs;
+        arch.readFile("dupA", ofs);
+        CHECK(ofs.str() == "contents of dupA");
+        arch.deleteFile("dupA");
+        ofs = std::ostringstream();
+        arch.readFile("dupA", ofs);
+        CHECK(ofs.str() == "contents of dupB");
+        arch.deleteFile("dupA");
+        CHECK(arch.findFile("dupA") == arch.cend());
+        CHECK(arch.findFile("last") != arch.cend());
+    }
+    SECTION("Deleting the other entry keeps the name")
+    {
+        std::stringstream damaged(bytes);
+        ArchiveParser arch(damaged);
+        // the second dupA is the one after "other"
+        arch.deleteAfter(arch.findFile("other"));
+        std::ostringstream ofs;
+        arch.readFile("dupA", ofs);
+        CHECK(ofs.str() == "contents of dupA");
+        CHECK(entryNames(arch) == std::vector<std::string>{"dupA", "other", "last"});
+    }
+}
+
+TEST_CASE("Free space map")
+{
+    FreeSpaceMap map;
+    CHECK_FALSE(map.allocate(10).is_initialized()); // NOLINT
+    map.release(100, 50); // NOLINT
+    map.release(300, 20); // NOLINT
+    map.release(400, 20); // NOLINT
+    CHECK(map.freeBytes() == 90);
+    // best fit, the lower offset among equal sizes
+    CHECK(*map.allocate(15) == 300); // NOLINT
+    CHECK(*map.allocate(20) == 400); // NOLINT
+    CHECK(*map.allocate(30) == 100); // NOLINT
+    CHECK_FALSE(map.allocate(30).is_initialized()); // NOLINT
+    CHECK(map.size() == 2);
+
+    // merging with both neighbours
+    map.release(320, 80); // NOLINT
+    map.release(150, 150); // NOLINT
+    CHECK(map.size() == 2);
+    map.release(300, 15); // NOLINT
+    REQUIRE(map.size() == 1);
+    CHECK(map.extents().begin()->first == 130);
+    CHECK(map.extents().begin()->second == 270);
+    CHECK(map.trimEnd(420) == 420);
+    CHECK(map.trimEnd(400) == 130);
+    CHECK(map.size() == 0);
+    CHECK(map.freeBytes() == 0);
+}
+
+TEST_CASE("Holes left by deleted entries are reused after reopening")
+{
+    ArchiveParser::CompressionStrategy none("NONE", 0);
+    std::stringstream arch_file;
+    std::pair<std::uint64_t, std::uint64_t> hole;
+    {
+        ArchiveParser arch = ArchiveParser::MakeArchive(arch_file);
+        for(const char *name : {"a", "b", "c", "d"})
+        {
+            std::istringstream ins(std::string(1000, *name)); // NOLINT
+            arch.addFile(name, ins, none);
+        }
+        hole = arch.findFile("b")->getEntryBeginEnd();
+        arch.deleteFile("b");
+        arch.deleteFile("c");
+    }
+    std::string flushed = arch_file.str();
+
+    for(bool stale : {false, true})
+    {
+        std::string contents = flushed;
+        if(stale)
+        {
+            // no directory, the holes are found from the entries
+            std::fill_n(contents.begin() + 20, 8, '\0'); // NOLINT
+        }
+        std::stringstream reopened(contents);
+        ArchiveParser arch(reopened);
+        std::istringstream small(std::string(500, 'x')); // NOLINT
+        arch.addFile("x", small, none);
+        CHECK(arch.findFile("x")->getEntryBeginEnd().first == hole.first);
+        std::istringstream fits(std::string(1400, 'y')); // NOLINT
+        arch.addFile("y", fits, none);
+        CHECK(arch.findFile("y")->getEntryBeginEnd().first == arch.findFile("x")->getEntryBeginEnd().second);
+        std::istringstream large(std::string(5000, 'z')); // NOLINT
+        arch.addFile("z", large, none);
+        CHECK(arch.findFile("z")->getEntryBeginEnd().first == arch.findFile("d")->getEntryBeginEnd().second);
+        CHECK(arch.verify());
+    }
+}
+
+TEST_CASE("Deleted entries can be punched out of the archive file")
+{
+    boost::filesystem::path path = boost::filesystem::temp_directory_path() /
+                                   boost::filesystem::unique_path("pacozip-test-%%%%-%%%%.pz");
+    std::string data(1024 * 1024, ' '); // NOLINT
+    std::mt19937 gen(11); // NOLINT
+    for(char &chr : data)
+    {
+        chr = static_cast<char>(gen());
+    }
+    {
+        ArchiveParser arch = ArchiveParser::MakeArchive(path.string().c_str());
+        ArchiveParser::CompressionStrategy none("NONE", 0);
+        for(const char *name : {"a", "b", "c"})
+        {
+            std::istringstream ins(data);
+            arch.addFile(name, ins, none);
+        }
+        ArchiveParser::ArchiveStats before = arch.getStats();
+        CHECK(before.entries == 3);
+        CHECK(before.freeBytes == 0);
+
+        arch.deleteFile("b", true);
+        ArchiveParser::ArchiveStats after = arch.getStats();
+        CHECK(after.entries == 2);
+        CHECK(after.logicalSize == before.logicalSize);
+        CHECK(after.freeBytes > data.size());
+        CHECK(after.holes == 1);
+        if(after.punchedBytes != 0)
+        {
+            // whole blocks only, the entry is larger than one
+            CHECK(after.physicalSize + data.size() / 2 < before.physicalSize);
+        }
+        CHECK(arch.verify());
+    }
+    {
+        ArchiveParser arch(path.string().c_str());
+        std::ostringstream ofs;
+        arch.readFile("c", ofs);
+        CHECK(ofs.str() == data);
+        CHECK(arch.verify());
+        // punching needs a path
+        CHECK(arch.getStats().punchedBytes == 0);
+    }
+    boost::filesystem::remove(path);
+}
+
+// archive whose list order is not its disk order and that has holes
+static void fragmentArchive(ArchiveParser &arch, std::vector<std::pair<std::string, std::string>> &files)
+{
+    ArchiveParser::CompressionStrategy lzw("LZW", 3);
+    ArchiveParser::CompressionStrategy none("NONE", 0);
+    for(unsigned i=0; i<12; i++) // NOLINT
+    {
+        std::string name = "f" + std::to_string(i);
+        std::string data(1000 + 700 * i, static_cast<char>('a' + i)); // NOLINT
+        std::istringstream ins(data);
+        arch.addFile(name.c_str(), ins, i % 2 == 0 ? lzw : none);
+        files.emplace_back(name, data);
+    }
+    for(unsigned i : {1U, 4U, 5U, 9U}) // NOLINT
+    {
+        arch.deleteFile(("f" + std::to_string(i)).c_str());
+    }
+    files.erase(std::remove_if(files.begin(), files.end(), [&arch](const std::pair<std::string, std::string> &file)
+    {
+        return arch.findFile(file.first.c_str()) == arch.cend();
+    }), files.end());
+    for(unsigned i=0; i<3; i++) // NOLINT
+    {
+        std::string name = "g" + std::to_string(i);
+        std::string data(500 + 1000 * i, static_cast<char>('x' + i)); // NOLINT
+        std::istringstream ins(data);
+        arch.addFile(name.c_str(), ins, none);
+        files.emplace_back(name, data);
+    }
+    arch.addFolder("dir");
+}
+
+static void checkCompacted(ArchiveParser &arch, const std::vector<std::pair<std::string, std::string>> &files)
+{
+    CHECK(arch.verify());
+    CHECK(arch.getStats().holes == 0);
+    std::uint64_t end = 0;
+    for(const ArchiveParser::FileInfo &file : arch)
+    {
+        auto range = file.getEntryBeginEnd();
+        if(end != 0)
+        {
+            CHECK(range.first == end);
+        }
+        end = range.second;
+    }
+    for(const std::pair<std::string, std::string> &file : files)
+    {
+        std::ostringstream ofs;
+        arch.readFile(file.first.c_str(), ofs);
+        CHECK(ofs.str() == file.second);
+    }
+    CHECK(arch.getFileType("dir") == ArchiveParser::fileType::folder);
+}
+
+TEST_CASE("Compaction")
+{
+    std::vector<std::pair<std::string, std::string>> files;
+    boost::filesystem::path path = boost::filesystem::temp_directory_path() /
+                                   boost::filesystem::unique_path("pacozip-test-%%%%-%%%%.pz");
+    {
+        ArchiveParser arch = ArchiveParser::MakeArchive(path.string().c_str());
+        fragmentArchive(arch, files);
+        REQUIRE(arch.getStats().holes != 0);
+        std::vector<std::string> order = entryNames(arch);
+
+        SECTION("In place")
+        {
+            std::uint64_t size = arch.getStats().logicalSize;
+            arch.compact();
+            CHECK(entryNames(arch) == order);
+            CHECK(arch.getStats().logicalSize < size);
+            checkCompacted(arch, files);
+
+            ArchiveParser reopened(path.string().c_str());
+            CHECK(entryNames(reopened) == order);
+            checkCompacted(reopened, files);
+        }
+        SECTION("Into a new archive")
+        {
+            std::stringstream compacted;
+            arch.compactTo(compacted);
+            ArchiveParser copy(compacted);
+            CHECK(entryNames(copy) == order);
+            checkCompacted(copy, files);
+            // the source is unchanged
+            CHECK(arch.getStats().holes != 0);
+            CHECK(arch.verify());
+        }
+    }
+    boost::filesystem::remove(path);
+}
+
+TEST_CASE("Compaction of a version 0 archive")
+{
+    std::string header = "PacoZIPP";
+    header.append(12, '\0'); // NOLINT
+    std::stringstream arch_file(header);
+    std::vector<std::pair<std::string, std::string>> files;
+    ArchiveParser arch(arch_file);
+    fragmentArchive(arch, files);
+    arch.compact();
+    checkCompacted(arch, files);
+}
+
+TEST_CASE("Walking the entry list of an archive without a directory")
+{
+    std::string header = "PacoZIPP";
+    header.append(12, '\0'); // NOLINT
+    std::stringstream arch_file(header);
+    std::vector<std::pair<std::string, std::string>> files;
+    {
+        ArchiveParser arch(arch_file);
+        ArchiveParser::CompressionStrategy none("NONE", 0);
+        for(unsigned i=0; i<300; i++) // NOLINT
+        {
+            // a few entries larger than the read ahead window
+            std::string data(i % 50 == 0 ? 100000 : 300, static_cast<char>('a' + i % 26)); // NOLINT
+            std::string name = "dir/file" + std::to_string(i);
+            std::istringstream ins(data);
+            arch.addFile(name.c_str(), ins, none);
+            files.emplace_back(name, data);
+        }
+        std::string long_name(5000, 'n'); // NOLINT
+        std::istringstream ins("x");
+        arch.addFile(long_name.c_str(), ins, none);
+        files.emplace_back(long_name, "x");
+    }
+
+    ArchiveParser arch(arch_file);
+    CHECK(arch.verify());
+    std::size_t i = 0;
+    for(const ArchiveParser::FileInfo &file : arch)
+    {
+        REQUIRE(i < files.size());
+        CHECK(file.getFileName() == files[i].first);
+        CHECK(file.getCompressedFileSize() == files[i].second.size());
+        i++;
+    }
+    CHECK(i == files.size());
+    std::ostringstream ofs;
+    arch.readFile("dir/file250", ofs);
+    CHECK(ofs.str() == files[250].second);
+
+    // a link past the end of the archive
+    std::string broken = arch_file.str();
+    std::uint64_t past_end = broken.size() + 10;
+    std::memcpy(&broken[12], &past_end, sizeof(past_end)); // NOLINT
+    std::stringstream broken_file(broken);
+    CHECK_THROWS_AS(ArchiveParser(broken_file), std::runtime_error);
+}
+
+TEST_CASE("Concurrent reads through an ArchiveReader")
+{
+    ArchiveReader::Backend backend = GENERATE(ArchiveReader::Backend::pread, ArchiveReader::Backend::map);
+    boost::filesystem::path path = boost::filesystem::temp_directory_path() /
+                                   boost::filesystem::unique_path("pacozip-test-%%%%-%%%%.pz");
+    std::vector<std::pair<std::string, std::string>> files;
+    {
+        ArchiveParser arch = ArchiveParser::MakeArchive(path.string().c_str());
+        const std::array<ArchiveParser::CompressionStrategy, 3> strategies = {
+            ArchiveParser::CompressionStrategy("NONE", 0),
+            ArchiveParser::CompressionStrategy("LZW", 4),
+            ArchiveParser::CompressionStrategy("BLOCK_LZW", 2)};
+        for(unsigned i=0; i<30; i++) // NOLINT
+        {
+            std::string data;
+            for(unsigned j=0; j<(i+1)*500; j++) // NOLINT
+            {
+                data += std::to_string(i * j % 97) + ' ';
+            }
+            std::string name = "file" + std::to_string(i);
+            std::istringstream ins(data);
+            arch.addFile(name.c_str(), ins, strategies[i % strategies.size()]);
+            files.emplace_back(name, data);
+        }
+        arch.addFolder("folder");
+    }
+    SECTION("From the central directory") { }
+    SECTION("Walking the list")
+    {
+        // clear directory_pos as an unfinished change would
+        std::fstream arch_file(path.string(), std::fstream::in | std::fstream::out | std::fstream::binary);
+        arch_file.seekp(20); // NOLINT
+        const std::array<char, 8> zeros{};
+        arch_file.write(zeros.data(), zeros.size());
+    }
+
+    auto checkReader = [&files, backend](const ArchiveReader &reader)
+    {
+        REQUIRE(reader.size() == files.size() + 1);
+        CHECK(reader.verify());
+        // file0 is stored, file1 is not
+        boost::optional<ArchiveReader::ByteView> stored = reader.findFile("file0")->getStoredData();
+        CHECK_FALSE(reader.findFile("file1")->getStoredData().is_initialized());
+        CHECK(stored.is_initialized() == (backend == ArchiveReader::Backend::map));
+        if(stored)
+        {
+            CHECK(std::string(stored->data, stored->data + stored->size) == files[0].second); // NOLINT
+        }
+        CHECK(reader[files.size() - 1].getFileName() == files.back().first);
+        CHECK(reader.getFileType("folder") == ArchiveParser::fileType::folder);
+        CHECK_FALSE(reader.findFile("missing").is_initialized());
+        std::ostringstream missing;
+        CHECK_THROWS(reader.readFile("missing", missing));
+
+        std::vector<std::vector<bool>> ok(4, std::vector<bool>(files.size()));
+        // half of the threads share the reader, the others reopen it
+        std::vector<ArchiveReader> reopened;
+        for(std::size_t t=0; t<ok.size(); t+=2)
+        {
+            reopened.push_back(reader.reopen());
+            CHECK(reopened.back().size() == reader.size());
+        }
+        std::vector<std::thread> threads;
+        for(std::size_t t=0; t<ok.size(); t++)
+        {
+            const ArchiveReader &cur_reader = t % 2 == 0 ? reopened[t / 2] : reader;
+            threads.emplace_back([&cur_reader, &files, &ok, t]()
+            {
+                for(std::size_t i=0; i<files.size(); i++)
+                {
+                    // each thread in its own order
+                    std::size_t cur = (i + t * 7) % files.size(); // NOLINT
+                    std::ostringstream out;
+                    cur_reader.readFile(files[cur].first.c_str(), out);
+                    ok[t][cur] = out.str() == files[cur].second;
+                }
+            });
+        }
+        for(std::thread &thread : threads)
+        {
+            thread.join();
+        }
+        for(const std::vector<bool> &threadOk : ok)
+        {
+            CHECK(std::all_of(threadOk.begin(), threadOk.end(), [](bool val) { return val; }));
+        }
+    };
+
+    checkReader(ArchiveReader(path.string().c_str(), backend));
+    int fd = ::open(path.string().c_str(), O_RDONLY); // NOLINT
+    REQUIRE(fd >= 0);
+    {
+        ArchiveReader reader(fd, backend);
+        checkReader(reader);
+    }
+    ::close(fd);
+
+    boost::filesystem::remove(path);
+    CHECK_THROWS(ArchiveReader(path.string().c_str(), backend));
+}
+
+TEST_CASE("ArchiveReader extractions wait for the memory budget")
+{
+    const char *alg = GENERATE("LZW", "BLOCK_LZW");
+    boost::filesystem::path path = boost::filesystem::temp_directory_path() /
+                                   boost::filesystem::unique_path("pacozip-test-%%%%-%%%%.pz");
+    std::string data;
+    for(unsigned i=0; i<20000; i++) // NOLINT
+    {
+        data += std::to_string(i % 251) + ' '; // NOLINT
+    }
+    {
+        ArchiveParser arch = ArchiveParser::MakeArchive(path.string().c_str());
+        std::istringstream ins(data);
+        arch.addFile("file", ins, ArchiveParser::CompressionStrategy(alg, 4));
+    }
+    ArchiveReader reader(path.string().c_str());
+    MemoryBudget &budget = MemoryBudget::global();
+    std::size_t old_limit = budget.getLimit();
+    std::size_t need = reader[0].getCompressionStrg().decompressorMemoryBound(reader[0].getCompressedFileSize());
+    REQUIRE(need > 0);
+    // a block dictionary is sized for one frame, not for the whole entry
+    ArchiveParser::CompressionStrategy large_block("BLOCK_LZW", 9);
+    CHECK(large_block.decompressorMemoryBound(std::uint64_t(100) << 20U) // NOLINT
+          == blockLZWDictionaryCount(0) * LZWDecompressorMemoryBound(26, 4 * LZW_BLOCK_SIZE + 4)); // NOLINT
+
+    budget.setLimit(budget.getUsed() + need);
+    auto other = std::make_unique<MemoryReservation>(budget, 1);
+    std::atomic<bool> done(false);
+    std::string extracted;
+    std::thread extraction([&reader, &done, &extracted]()
+    {
+        std::ostringstream out;
+        reader.readFile("file", out);
+        extracted = out.str();
+        done = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50)); // NOLINT
+    CHECK_FALSE(done);
+    other.reset();
+    extraction.join();
+    CHECK(extracted == data);
+
+    // a decoder larger than the whole budget fails instead of waiting forever
+    budget.setLimit(need - 1);
+    std::ostringstream out;
+    CHECK_THROWS_AS(reader.readFile("file", out), std::runtime_error);
+    budget.setLimit(old_limit);
+    boost::filesystem::remove(path);
+}
+
+TEST_CASE("Stored entries are copied between file descriptors")
+{
+    boost::filesystem::path dir = boost::filesystem::temp_directory_path() /
+                                  boost::filesystem::unique_path("pacozip-test-%%%%-%%%%");
+    boost::filesystem::create_directories(dir);
+    std::string data(300000, ' '); // NOLINT
+    std::mt19937 gen(5); // NOLINT
+    for(char &chr : data)
+    {
+        chr = static_cast<char>(gen());
+    }
+    std::string text;
+    for(unsigned i=0; i<20000; i++) // NOLINT
+    {
+        text += "line " + std::to_string(i % 13) + '\n';
+    }
+    for(const auto &file : {std::make_pair("random", &data), std::make_pair("text", &text)})
+    {
+        std::ofstream out((dir / file.first).string(), std::ofstream::binary);
+        out << *file.second;
+    }
+
+    std::string archPath = (dir / "arch.pz").string();
+    {
+        ArchiveParser arch = ArchiveParser::MakeArchive(archPath.c_str());
+        // the random data is stored once compressing it is given up
+        arch.addFileFromPath("random", (dir / "random").string().c_str(), ArchiveParser::CompressionStrategy("LZW", 5));
+        arch.addFileFromPath("text", (dir / "text").string().c_str(), ArchiveParser::CompressionStrategy("LZW", 5));
+        arch.addFileFromPath("text_stored", (dir / "text").string().c_str(), ArchiveParser::CompressionStrategy("NONE", 0));
+        CHECK(arch.findFile("random")->getCompressionStrg().getAlgStr() == std::string("NONE"));
+        CHECK(arch.findFile("text")->getCompressedFileSize() < text.size());
+        CHECK(arch.verify());
+        CHECK_THROWS(arch.addFileFromPath("missing", (dir / "missing").string().c_str()));
+    }
+
+    ArchiveReader reader(archPath.c_str());
+    CHECK(reader.verify());
+    for(const auto &file : {std::make_pair("random", &data), std::make_pair("text", &text),
+                               std::make_pair("text_stored", &text)})
+    {
+        std::string outPath = (dir / (std::string(file.first) + ".out")).string();
+        int fd = ::open(outPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600); // NOLINT
+        REQUIRE(fd >= 0);
+        // the contents go after what is already in the file
+        CHECK(::write(fd, "head", 4) == 4);
+        reader.findFile(file.first)->readFile(fd);
+        CHECK(::write(fd, "tail", 4) == 4);
+        ::close(fd);
+        std::ifstream in(outPath, std::ifstream::binary);
+        std::ostringstream contents;
+        contents << in.rdbuf();
+        CHECK(contents.str() == "head" + *file.second + "tail");
+    }
+
+    int inFd = ::open((dir / "random").string().c_str(), O_RDONLY); // NOLINT
+    int outFd = ::open((dir / "copy").string().c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600); // NOLINT
+    REQUIRE(inFd >= 0);
+    REQUIRE(outFd >= 0);
+    copyFileRange(inFd, 1000, outFd, 10, 5000); // NOLINT
+    CHECK_THROWS(copyFileRange(inFd, data.size() - 10, outFd, 0, 20)); // NOLINT
+    ::close(inFd);
+    ::close(outFd);
+    std::ifstream in((dir / "copy").string(), std::ifstream::binary);
+    std::ostringstream contents;
+    contents << in.rdbuf();
+    REQUIRE(contents.str().size() >= 5010); // NOLINT
+    CHECK(contents.str().substr(10, 5000) == data.substr(1000, 5000)); // NOLINT
+
+    boost::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Parallel ingest")
+{
+    boost::filesystem::path dir = boost::filesystem::temp_directory_path() /
+                                  boost::filesystem::unique_path("pacozip-test-%%%%-%%%%");
+    boost::filesystem::create_directories(dir);
+    std::vector<std::pair<std::string, std::string>> files;
+    std::mt19937 gen(11); // NOLINT
+    for(unsigned i=0; i<40; i++) // NOLINT
+    {
+        std::string contents;
+        std::size_t size = gen() % 50000; // NOLINT
+        for(std::size_t j=0; j<size; j++)
+        {
+            // every third file does not compress
+            contents += i % 3 == 0 ? static_cast<char>(gen()) : static_cast<char>('a' + (j * i) % 7); // NOLINT
+        }
+        std::string name = "file" + std::to_string(i);
+        std::ofstream out((dir / name).string(), std::ofstream::binary);
+        out << contents;
+        files.emplace_back(name, std::move(contents));
+    }
+
+    auto makeArchive = [&dir, &files](const char *archName, const ParallelIngest::Options &options)
+    {
+        std::string archPath = (dir / archName).string();
+        ArchiveParser arch = ArchiveParser::MakeArchive(archPath.c_str());
+        arch.setDefaultCompressionStrategy(ArchiveParser::CompressionStrategy("AUTO", 3 | ArchiveParser::CompressionStrategy::LZW_VARIABLE_WIDTH));
+        ParallelIngest ingest(arch, options);
+        ingest.addFolder("empty");
+        for(const std::pair<std::string, std::string> &file : files)
+        {
+            ingest.addFile(file.first.c_str(), (dir / file.first).string().c_str());
+        }
+        ingest.finish();
+        CHECK(arch.verify());
+        return archPath;
+    };
+    auto readAll = [](const std::string &path)
+    {
+        std::ifstream in(path, std::ifstream::binary);
+        std::ostringstream contents;
+        contents << in.rdbuf();
+        return contents.str();
+    };
+
+    SECTION("Every file is added")
+    {
+        ParallelIngest::Options options;
+        options.threads = 4; // NOLINT
+        options.maxPending = 3; // NOLINT
+        ArchiveParser arch(makeArchive("arch.pz", options).c_str());
+        CHECK(arch.verify());
+        CHECK(arch.getFileType("empty") == ArchiveParser::fileType::folder);
+        for(const std::pair<std::string, std::string> &file : files)
+        {
+            std::ostringstream out;
+            arch.readFile(file.first.c_str(), out);
+            CHECK(out.str() == file.second);
+        }
+        CHECK(arch.findFile("file1")->getCompressionStrg().getAlgStr() != std::string("NONE"));
+    }
+    SECTION("Prepared files past the memory limit spill")
+    {
+        ParallelIngest::Options options;
+        options.threads = 3; // NOLINT
+        options.deterministic = true;
+        options.memoryLimit = 8 * 1024; // NOLINT
+        ArchiveParser arch(makeArchive("spilled.pz", options).c_str());
+        CHECK(arch.verify());
+        for(const std::pair<std::string, std::string> &file : files)
+        {
+            std::ostringstream out;
+            arch.readFile(file.first.c_str(), out);
+            CHECK(out.str() == file.second);
+        }
+    }
+    SECTION("The deterministic layout does not depend on timing")
+    {
+        ParallelIngest::Options options;
+        options.threads = 4; // NOLINT
+        options.deterministic = true;
+        std::string first = readAll(makeArchive("first.pz", options));
+        options.threads = 2; // NOLINT
+        std::string second = readAll(makeArchive("second.pz", options));
+        CHECK(first == second);
+        ArchiveParser arch((dir / "first.pz").string().c_str());
+        std::vector<std::string> names = entryNames(arch);
+        REQUIRE(names.size() == files.size() + 1);
+        for(std::size_t i=0; i<files.size(); i++)
+        {
+            CHECK(names[i + 1] == files[i].first);
+        }
+    }
+    SECTION("Deterministic levels do not depend on the memory held elsewhere")
+    {
+        MemoryBudget &budget = MemoryBudget::global();
+        std::size_t old_limit = budget.getLimit();
+        // room for the largest dictionaries of four workers and the committer
+        budget.setLimit(5 * LZWCompressorMemoryBound(16, 50000)); // NOLINT
+        auto compressTree = [&dir, &files, &readAll](const char *archName)
+        {
+            std::string archPath = (dir / archName).string();
+            {
+                ArchiveParser arch = ArchiveParser::MakeArchive(archPath.c_str());
+                arch.setDefaultCompressionStrategy(ArchiveParser::CompressionStrategy("LZW", 8 | ArchiveParser::CompressionStrategy::LZW_VARIABLE_WIDTH));
+                ParallelIngest::Options options;
+                options.threads = 4; // NOLINT
+                options.deterministic = true;
+                ParallelIngest ingest(arch, options);
+                for(const auto &file : files)
+                {
+                    ingest.addFile(file.first.c_str(), (dir / file.first).string().c_str());
+                }
+                // read as a stream, without a known size
+                ingest.addStream("stream", (dir / files[1].first).string().c_str());
+                ingest.finish();
+            }
+            return readAll(archPath);
+        };
+        std::string first = compressTree("levels1.pz");
+        std::string second;
+        {
+            // as if other entries held all but half a dictionary right now
+            MemoryReservation held(budget, budget.getLimit() - LZWCompressorMemoryBound(16, 50000) / 2); // NOLINT
+            second = compressTree("levels2.pz");
+        }
+        budget.setLimit(old_limit);
+        CHECK(first == second);
+    }
+    SECTION("Errors stop the ingest")
+    {
+        std::string archPath = (dir / "failed.pz").string();
+        ArchiveParser arch = ArchiveParser::MakeArchive(archPath.c_str());
+        ParallelIngest::Options options;
+        options.threads = 2;
+        ParallelIngest ingest(arch, options);
+        ingest.addFile("file0", (dir / "file0").string().c_str());
+        ingest.addFile("missing", (dir / "missing").string().c_str());
+        CHECK_THROWS(ingest.finish());
+        CHECK(arch.verify());
+        CHECK_FALSE(arch.findFile("missing") != arch.cend());
+    }
+    SECTION("Prepared files")
+    {
+        std::istringstream text(files[1].second);
+        ArchiveParser::PreparedFile prepared = ArchiveParser::prepareFile("text", text, ArchiveParser::CompressionStrategy("LZW", 5),
+                                                                          ArchiveParser::EarlyAbortPolicy(), ArchiveParser::SpillPolicy());
+        CHECK(prepared.getCompressedFileSize() < files[1].second.size());
+        std::istringstream random(files[0].second);
+        ArchiveParser::PreparedFile stored = ArchiveParser::prepareFile("random", random, ArchiveParser::CompressionStrategy("LZW", 5),
+                                                                        ArchiveParser::EarlyAbortPolicy(), ArchiveParser::SpillPolicy());
+        CHECK(stored.getCompressionStrg().getAlgStr() == std::string("NONE"));
+        CHECK(stored.getCompressedFileSize() == files[0].second.size());
+
+        std::stringstream archStream;
+        ArchiveParser arch = ArchiveParser::MakeArchive(archStream);
+        arch.addPreparedFile(std::move(prepared));
+        arch.addPreparedFile(std::move(stored));
+        CHECK(arch.verify());
+        std::ostringstream out;
+        arch.readFile("random", out);
+        CHECK(out.str() == files[0].second);
+        std::istringstream again(files[1].second);
+        ArchiveParser::PreparedFile duplicate = ArchiveParser::prepareFile("text", again, ArchiveParser::CompressionStrategy("LZW", 5),
+                                                                           ArchiveParser::EarlyAbortPolicy(), ArchiveParser::SpillPolicy());
+        CHECK_THROWS(arch.addPreparedFile(std::move(duplicate)));
+        CHECK(arch.verify());
+    }
+
+    boost::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Batched writes")
+{
+    boost::filesystem::path dir = boost::filesystem::temp_directory_path() /
+                                  boost::filesystem::unique_path("pacozip-test-%%%%-%%%%");
+    boost::filesystem::create_directories(dir);
+    std::string archPath = (dir / "arch.pz").string();
+    auto readAll = [&archPath]()
+    {
+        std::ifstream in(archPath, std::ifstream::binary);
+        std::ostringstream contents;
+        contents << in.rdbuf();
+        return contents.str();
+    };
+    auto contentsOf = [](ArchiveParser &arch, const char *name)
+    {
+        std::ostringstream out;
+        arch.readFile(name, out);
+        return out.str();
+    };
+    std::string text;
+    for(unsigned i=0; i<5000; i++) // NOLINT
+    {
+        text += "batch " + std::to_string(i % 17) + '\n';
+    }
+    {
+        ArchiveParser arch = ArchiveParser::MakeArchive(archPath.c_str());
+        for(const char *name : {"a", "b", "c"})
+        {
+            std::istringstream file(text + name);
+            arch.addFile(name, file, ArchiveParser::CompressionStrategy("LZW", 5));
+        }
+        arch.deleteFile("b");
+    }
+    const std::string before = readAll();
+
+    SECTION("Abort leaves the archive as it was")
+    {
+        {
+            ArchiveParser arch(archPath.c_str());
+            arch.beginBatch();
+            CHECK_THROWS(arch.beginBatch());
+            CHECK_THROWS(arch.compact());
+            for(const char *name : {"d", "e"})
+            {
+                std::istringstream file(text + name);
+                arch.addFile(name, file, ArchiveParser::CompressionStrategy("LZW", 5));
+            }
+            arch.addFolder("folder");
+            arch.deleteFile("a", true);
+            CHECK(arch.inBatch());
+            CHECK(arch.verify());
+            CHECK(contentsOf(arch, "e") == text + "e");
+            CHECK(arch.findFile("a") == arch.cend());
+            arch.flush();
+            CHECK(readAll().substr(0, before.size()) == before);
+            arch.abort();
+            CHECK_FALSE(arch.inBatch());
+            CHECK_THROWS(arch.abort());
+            CHECK(entryNames(arch) == std::vector<std::string>{"a", "c"});
+            CHECK(contentsOf(arch, "a") == text + "a");
+        }
+        CHECK(readAll() == before);
+    }
+    SECTION("Destroying the parser aborts the batch")
+    {
+        {
+            ArchiveParser arch(archPath.c_str());
+            arch.beginBatch();
+            std::istringstream file(text);
+            arch.addFile("d", file, ArchiveParser::CompressionStrategy("NONE", 0));
+            arch.deleteFile("c");
+        }
+        CHECK(readAll() == before);
+    }
+    SECTION("Commit links everything")
+    {
+        {
+            ArchiveParser arch(archPath.c_str());
+            arch.beginBatch();
+            for(const char *name : {"d", "e", "f"})
+            {
+                std::istringstream file(text + name);
+                arch.addFile(name, file, ArchiveParser::CompressionStrategy("LZW", 5));
+            }
+            arch.deleteFile("e");
+            arch.deleteFile("a", true);
+            std::istringstream stream(text + "g");
+            arch.addFileStream("g", stream, ArchiveParser::CompressionStrategy("NONE", 0));
+            arch.addFolder("folder");
+            arch.commit();
+            CHECK_THROWS(arch.commit());
+            CHECK(arch.verify());
+        }
+        ArchiveParser arch(archPath.c_str());
+        CHECK(arch.verify());
+        CHECK(entryNames(arch) == std::vector<std::string>{"c", "d", "f", "g", "folder"});
+        for(const char *name : {"c", "d", "f", "g"})
+        {
+            CHECK(contentsOf(arch, name) == text + name);
+        }
+        CHECK(arch.getFileType("folder") == ArchiveParser::fileType::folder);
+
+        // what the batch freed is free after it
+        CHECK(arch.getStats().freeBytes >= 2 * arch.findFile("d")->getCompressedFileSize());
+        std::istringstream file(text + "h");
+        arch.addFile("h", file, ArchiveParser::CompressionStrategy("LZW", 5));
+        CHECK(arch.verify());
+    }
+    SECTION("Batches on a stream")
+    {
+        std::stringstream archStream;
+        {
+            ArchiveParser arch = ArchiveParser::MakeArchive(archStream);
+            arch.beginBatch();
+            std::istringstream file(text);
+            arch.addFile("x", file, ArchiveParser::CompressionStrategy("LZW", 5));
+            arch.addFolder("y");
+            arch.commit();
+        }
+        ArchiveParser arch(archStream);
+        CHECK(arch.verify());
+        CHECK(entryNames(arch) == std::vector<std::string>{"x", "y"});
+        CHECK(contentsOf(arch, "x") == text);
+    }
+
+    boost::filesystem::remove_all(dir);
+}